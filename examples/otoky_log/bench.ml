@@ -0,0 +1,64 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+
+type msg = {
+  body : string;
+} with type_desc
+
+let vtype =
+  let type_desc = type_desc_msg in
+  let marshall { body = body } = (body, String.length body) in
+  let unmarshall cstr = { body = Cstr.copy cstr } in
+  Otoky_type.make ~type_desc ~marshall ~unmarshall ~compare
+
+let target = 200000.
+
+let count = 1000000
+let batch = 1000
+
+let report what n t =
+  let rate = float n /. t in
+  Printf.printf "%-8s %d msgs in %.2fs: %.0f msgs/s (%s target)\n%!"
+    what n t rate (if rate >= target then "meets" else "misses")
+
+let time f =
+  let t0 = Unix.gettimeofday () in
+  f ();
+  Unix.gettimeofday () -. t0
+
+let bench () =
+  let fn = Filename.temp_file "otoky_log" "fdb" in
+  let log = Otoky_log.open_ ~omode:[Oreader;Owriter;Ocreat;Otrunc] ~width:128l ~group:batch vtype fn in
+  let msg = { body = String.make 64 'x' } in
+
+  report "append" count (time (fun () ->
+    for i = 1 to count do Otoky_log.append log msg done;
+    Otoky_log.flush log));
+
+  let c = Otoky_log.consumer log "bench" in
+  let got = ref 0 in
+  report "read" count (time (fun () ->
+    while !got < count do
+      let msgs = Otoky_log.read c batch in
+      if Array.length msgs = 0 then failwith "log ended early";
+      got := !got + Array.length msgs;
+      Otoky_log.commit c
+    done));
+
+  let removed = ref 0 in
+  let t = time (fun () ->
+    let rec loop () =
+      let n = Otoky_log.truncate log ~max:batch () in
+      removed := !removed + n;
+      if n > 0 then loop () in
+    loop ()) in
+  report "truncate" !removed t;
+
+  Otoky_log.close log;
+  Unix.unlink fn;
+  Unix.unlink (fn ^ ".cursors")
+
+;;
+
+bench ()
@@ -0,0 +1,188 @@
+open Tokyo_cabinet
+
+let failures = ref 0
+
+let check what ok =
+  if not ok
+  then begin
+    Printf.printf "FAIL %s\n%!" what;
+    incr failures
+  end
+
+(* floats are compared by bits, so nan and -0. round trip too *)
+let same (ts, vs) (ts', vs') =
+  ts = ts' && Array.map Int64.bits_of_float vs = Array.map Int64.bits_of_float vs'
+
+let roundtrip what ts vs =
+  let blk = Otoky_tseries.encode ts vs (Array.length ts) in
+  check what (same (ts, vs) (Otoky_tseries.decode blk));
+  blk
+
+(* the header is the count and the last timestamp, first timestamp and
+   first value *)
+let header_bits = 32 + 64 + 64 + 64
+
+let bytes bits = (bits + 7) / 8
+
+let fits v n =
+  let half = Int64.shift_left 1L (n - 1) in
+  v >= Int64.neg half && v < half
+
+(* bits of a delta-of-delta timestamp, per width *)
+let dod_bits d =
+  if d = 0L then 1
+  else if fits d 7 then 2 + 7
+  else if fits d 9 then 3 + 9
+  else if fits d 12 then 4 + 12
+  else 4 + 64
+
+(* timestamps from 0 with these deltas-of-deltas; wrapping is fine for
+   the codec *)
+let of_dods dods =
+  let n = List.length dods + 1 in
+  let ts = Array.make n 0L in
+  let delta = ref 0L in
+  ignore
+    (List.fold_left
+       (fun i d ->
+          delta := Int64.add !delta d;
+          ts.(i + 1) <- Int64.add ts.(i) !delta;
+          i + 1)
+       0 dods);
+  ts
+
+let test_dod_widths () =
+  List.iter
+    (fun (what, dods) ->
+       let ts = of_dods dods in
+       let vs = Array.make (Array.length ts) 1.5 in
+       let blk = roundtrip ("dod " ^ what) ts vs in
+       (* values repeat, so each costs one bit *)
+       let bits = List.fold_left (fun b d -> b + dod_bits d + 1) header_bits dods in
+       check ("dod size " ^ what) (String.length blk = bytes bits))
+    [ "0", [ 0L; 0L; 0L ];
+      "7", [ 1L; -1L; 63L; -64L ];
+      "9", [ 64L; -65L; 255L; -256L ];
+      "12", [ 256L; -257L; 2047L; -2048L ];
+      "64", [ 2048L; -2049L; Int64.shift_left 1L 40; Int64.max_int; Int64.min_int ];
+      "mixed", [ 0L; 63L; 64L; 256L; 2048L; 0L; -2048L; -256L; -64L; 0L ] ]
+
+let test_xor_windows () =
+  let base = Int64.bits_of_float 1234.5678 in
+  let flip x = Int64.float_of_bits (Int64.logxor base x) in
+  let n = 64 in
+  let ts = Array.make n 0L in
+  (* every XOR is 0xff << 20: the first opens a window (lead clamped to
+     31, trail 20, 13 bits) and the rest reuse it *)
+  let vs = Array.init n (fun i -> if i land 1 = 0 then flip 0L else flip (Int64.shift_left 0xffL 20)) in
+  let blk = roundtrip "xor reuse" ts vs in
+  let bits = header_bits + (1 + 2 + 5 + 6 + 13) + (n - 2) * (1 + 2 + 13) in
+  check "xor reuse size" (String.length blk = bytes bits);
+  (* changes inside the window, below it, above it, then inside again *)
+  let xs =
+    [ 0L; Int64.shift_left 0xffL 20; Int64.shift_left 0x81L 20; Int64.shift_left 0x3cL 20;
+      Int64.shift_left 1L 10; Int64.shift_left 1L 60; 1L; Int64.shift_left 0x3cL 20;
+      Int64.min_int; -1L; 0L ] in
+  let vs = Array.of_list (List.map flip xs) in
+  ignore (roundtrip "xor windows" (Array.make (Array.length vs) 0L) vs);
+  let vs = [| 0.; -0.; nan; infinity; neg_infinity; nan; 1e-310; 1e308; -1.; -1. |] in
+  ignore (roundtrip "xor specials" (Array.make (Array.length vs) 0L) vs)
+
+let test_single () =
+  let blk = roundtrip "n=1" [| 42L |] [| 3.5 |] in
+  check "n=1 size" (String.length blk = bytes header_bits);
+  ignore (roundtrip "n=1 extremes" [| Int64.min_int |] [| nan |])
+
+let temp () = Filename.temp_file "otoky_tseries" "bdb"
+
+let points lo hi step =
+  let rec loop ts acc = if ts > hi then List.rev acc else loop (Int64.add ts step) (ts :: acc) in
+  loop lo []
+
+let value id ts = Int64.to_float id *. 1000. +. Int64.to_float ts /. 7.
+
+let expect t what id ?lower ?upper pts =
+  let ok ts =
+    (match lower with Some l -> ts >= l | None -> true) &&
+    (match upper with Some u -> ts <= u | None -> true) in
+  let pts = List.filter ok pts in
+  let want = (Array.of_list pts, Array.of_list (List.map (value id) pts)) in
+  check what (same want (Otoky_tseries.range t id ?lower ?upper ()))
+
+let test_resume () =
+  let fn = temp () in
+  let omode = [Oreader; Owriter; Ocreat; Otrunc] in
+  let append t pts = List.iter (fun ts -> Otoky_tseries.append t 1L ts (value 1L ts)) pts in
+  (* one full block of 4 and a partial one of 2 *)
+  let t = Otoky_tseries.open_ ~omode ~block:4 fn in
+  append t (points 10L 60L 10L);
+  Otoky_tseries.close t;
+  (* the partial block is resumed, filled and a new one started *)
+  let t = Otoky_tseries.open_ ~omode:[Oreader; Owriter] ~block:4 fn in
+  expect t "resume before append" 1L (points 10L 60L 10L);
+  begin try
+    Otoky_tseries.append t 1L 60L 0.;
+    check "resume keeps last timestamp" false
+  with Error (Einvalid, _, _) -> () end;
+  append t (points 70L 90L 10L);
+  Otoky_tseries.close t;
+  let t = Otoky_tseries.open_ ~omode:[Oreader] ~block:4 fn in
+  expect t "resume after append" 1L (points 10L 90L 10L);
+  Otoky_tseries.close t;
+  (* the resumed block was rewritten in place: [10..40] [50..80] [90] *)
+  let bdb = BDB.new_ () in
+  BDB.open_ bdb ~omode:[Oreader] fn;
+  check "resume block count" (BDB.rnum bdb = 3L);
+  BDB.close bdb;
+  Sys.remove fn
+
+let test_iter_bounds () =
+  let fn = temp () in
+  let t = Otoky_tseries.open_ ~omode:[Oreader; Owriter; Ocreat; Otrunc] ~block:4 fn in
+  let series = [ 1L, points 0L 2000L 50L; 2L, points 100L 1000L 100L; 3L, points (-500L) 500L 250L ] in
+  List.iter
+    (fun (id, pts) -> List.iter (fun ts -> Otoky_tseries.append t id ts (value id ts)) pts)
+    series;
+  Otoky_tseries.close t;
+  let t = Otoky_tseries.open_ ~omode:[Oreader] ~block:4 fn in
+  let pts2 = List.assoc 2L series in
+  (* blocks of series 2 are [100..400] [500..800] [900..1000] *)
+  List.iter
+    (fun (what, lower, upper) -> expect t ("iter " ^ what) 2L ?lower ?upper pts2)
+    [ "all", None, None;
+      "before the first block", Some 0L, Some 50L;
+      "up to the first point", Some 0L, Some 100L;
+      "from before into a block", Some (-1000L), Some 650L;
+      "inside a block", Some 510L, Some 790L;
+      "across blocks", Some 350L, Some 950L;
+      "on block starts", Some 500L, Some 900L;
+      "between points", Some 101L, Some 199L;
+      "past the last", Some 1001L, None;
+      "upper past the last", Some 950L, Some 5000L;
+      "empty range", Some 600L, Some 500L ];
+  (* neighbours must not leak into each other's ranges *)
+  List.iter
+    (fun (id, pts) ->
+       let what = Printf.sprintf "iter series %Ld" id in
+       expect t what id pts;
+       expect t (what ^ " lower before") id ~lower:Int64.min_int ~upper:0L pts;
+       expect t (what ^ " upper after") id ~lower:0L ~upper:Int64.max_int pts)
+    series;
+  expect t "iter missing series before" 0L [];
+  expect t "iter missing series after" 4L [];
+  Otoky_tseries.close t;
+  Sys.remove fn
+
+;;
+
+test_dod_widths ();
+test_xor_windows ();
+test_single ();
+test_resume ();
+test_iter_bounds ();
+if !failures > 0
+then begin
+  Printf.printf "%d failed\n" !failures;
+  exit 1
+end
+else print_endline "ok"
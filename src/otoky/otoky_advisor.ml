@@ -0,0 +1,215 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+type sizes = {
+  count : int;
+  key_bytes : int;
+  val_bytes : int;
+  key_hist : int array;
+  val_hist : int array;
+}
+
+let hist_buckets = 32
+
+let log2 n =
+  let rec loop i n = if n <= 1 then i else loop (i + 1) (n lsr 1) in
+  loop 0 n
+
+let clamp lo hi n = if n < lo then lo else if n > hi then hi else n
+
+let avg bytes count = if count = 0 then 0 else bytes / count
+
+let two_gb = 0x80000000L
+
+let sample_sizes (foreach : ?batch:int -> (Tclist.t -> Tclist.t -> bool) -> unit) samples =
+  let count = ref 0 in
+  let key_bytes = ref 0 in
+  let val_bytes = ref 0 in
+  let key_hist = Array.make hist_buckets 0 in
+  let val_hist = Array.make hist_buckets 0 in
+  let len = ref 0 in
+  let add hist bytes tclist i =
+    ignore (Tclist.val_ tclist i len);
+    bytes := !bytes + !len;
+    let b = min (hist_buckets - 1) (log2 !len) in
+    hist.(b) <- hist.(b) + 1 in
+  foreach ~batch:(min samples 4096) begin fun keys vals ->
+    begin try
+      let n = min (Tclist.num keys) (samples - !count) in
+      for i = 0 to n - 1 do
+        add key_hist key_bytes keys i;
+        add val_hist val_bytes vals i
+      done;
+      count := !count + n
+    with e -> Tclist.del keys; Tclist.del vals; raise e end;
+    Tclist.del keys;
+    Tclist.del vals;
+    !count < samples
+  end;
+  {
+    count = !count;
+    key_bytes = !key_bytes;
+    val_bytes = !val_bytes;
+    key_hist = key_hist;
+    val_hist = val_hist;
+  }
+
+let avg_key sizes = avg sizes.key_bytes sizes.count
+let avg_val sizes = avg sizes.val_bytes sizes.count
+
+module Hdb =
+struct
+  module HDB_raw = HDB.Fun (Cstr_cstr) (Tclist_tclist)
+
+  type stats = {
+    rnum : int64;
+    fsiz : int64;
+    cur_bnum : int64;
+    bnumused : int64;
+    cur_opts : opt list;
+    sizes : sizes;
+  }
+
+  type advice = {
+    bnum : int64;
+    apow : int;
+    fpow : int;
+    opts : opt list;
+    xmsiz : int64;
+  }
+
+  (* record header: magic, hash, two chain links, padding size, varint sizes *)
+  let rec_overhead large = if large then 24 else 16
+
+  let sample ?(samples = 10000) hdb =
+    {
+      rnum = HDB.rnum hdb;
+      fsiz = HDB.fsiz hdb;
+      cur_bnum = HDB.bnum hdb;
+      bnumused = HDB.bnumused hdb;
+      cur_opts = HDB.opts hdb;
+      sizes = sample_sizes (HDB_raw.foreach hdb) samples;
+    }
+
+  let load s =
+    if s.bnumused = 0L then 0.0 else Int64.to_float s.rnum /. Int64.to_float s.bnumused
+
+  let live_bytes s =
+    let large = List.mem Tlarge s.cur_opts in
+    Int64.mul s.rnum (Int64.of_int (rec_overhead large + avg_key s.sizes + avg_val s.sizes))
+
+  let advise ?(headroom = 2.0) ?(memory = 0x40000000L) s =
+    let expected = max 1024L (Int64.of_float (Int64.to_float s.rnum *. headroom)) in
+    let rec_size = rec_overhead false + avg_key s.sizes + avg_val s.sizes in
+    (* bigger records get bigger alignment, so updates fit in place more often *)
+    let apow = clamp 4 10 (log2 rec_size - 3) in
+    let fpow = clamp 10 16 (log2 (Int64.to_int (Int64.div expected 1000L))) in
+    let bnum = Int64.mul expected 2L in
+    let padded = (rec_size + (1 lsl apow) - 1) land (lnot ((1 lsl apow) - 1)) in
+    let projected =
+      Int64.add (Int64.mul expected (Int64.of_int padded)) (Int64.mul bnum 8L) in
+    let large = projected > two_gb in
+    let opts = List.filter (fun o -> o <> Tlarge) s.cur_opts in
+    let opts = if large then Tlarge :: opts else opts in
+    let buckets = Int64.add 256L (Int64.mul bnum (if large then 8L else 4L)) in
+    {
+      bnum = bnum;
+      apow = apow;
+      fpow = fpow;
+      opts = opts;
+      xmsiz = max buckets (min memory projected);
+    }
+
+  let apply hdb a =
+    HDB.optimize hdb ~bnum:a.bnum ~apow:a.apow ~fpow:a.fpow ~opts:a.opts ()
+
+  let prepare hdb a =
+    HDB.setxmsiz hdb a.xmsiz
+end
+
+module Bdb =
+struct
+  module BDB_raw = BDB.Fun (Cstr_cstr) (Tclist_tclist)
+
+  type stats = {
+    rnum : int64;
+    fsiz : int64;
+    cur_lmemb : int32;
+    cur_nmemb : int32;
+    lnum : int64;
+    nnum : int64;
+    cur_bnum : int64;
+    bnumused : int64;
+    cur_opts : opt list;
+    sizes : sizes;
+  }
+
+  type advice = {
+    lmemb : int32;
+    nmemb : int32;
+    bnum : int64;
+    apow : int;
+    fpow : int;
+    opts : opt list;
+    lcnum : int32;
+    ncnum : int32;
+    xmsiz : int64;
+  }
+
+  let leaf_bytes = 8192
+  let fill = 0.7
+
+  let sample ?(samples = 10000) bdb =
+    {
+      rnum = BDB.rnum bdb;
+      fsiz = BDB.fsiz bdb;
+      cur_lmemb = BDB.lmemb bdb;
+      cur_nmemb = BDB.nmemb bdb;
+      lnum = BDB.lnum bdb;
+      nnum = BDB.nnum bdb;
+      cur_bnum = BDB.bnum bdb;
+      bnumused = BDB.bnumused bdb;
+      cur_opts = BDB.opts bdb;
+      sizes = sample_sizes (BDB_raw.foreach bdb) samples;
+    }
+
+  let leaf_fill s =
+    let cap = Int64.to_float s.lnum *. Int64.to_float (Int64.of_int32 s.cur_lmemb) in
+    if cap = 0.0 then 0.0 else Int64.to_float s.rnum /. cap
+
+  let advise ?(headroom = 2.0) ?(memory = 0x40000000L) s =
+    let expected = max 1024. (Int64.to_float s.rnum *. headroom) in
+    let avg_key = avg_key s.sizes and avg_val = avg_val s.sizes in
+    let lmemb = clamp 32 2048 (leaf_bytes / (avg_key + avg_val + 4)) in
+    let nmemb = clamp 64 2048 (leaf_bytes / (avg_key + 12)) in
+    let leaves = expected /. (float lmemb *. fill) in
+    let nodes = leaves /. (float nmemb *. fill) +. 1. in
+    let bnum = Int64.of_float (2. *. (leaves +. nodes)) in
+    let projected = Int64.of_float (leaves *. float leaf_bytes) in
+    let large = projected > two_gb in
+    let opts = List.filter (fun o -> o <> Tlarge) s.cur_opts in
+    let opts = if large then Tlarge :: opts else opts in
+    (* keep every non-leaf node cached; give leaves what is left *)
+    let node_bytes = nodes *. float (nmemb * (avg_key + 12)) in
+    let leaf_budget = max 0. (Int64.to_float memory -. node_bytes) in
+    let lcnum = clamp 64 (max 64 (int_of_float leaves)) (int_of_float (leaf_budget /. float leaf_bytes)) in
+    let ncnum = max 512 (int_of_float nodes) in
+    {
+      lmemb = Int32.of_int lmemb;
+      nmemb = Int32.of_int nmemb;
+      bnum = bnum;
+      apow = 8;
+      fpow = 10;
+      opts = opts;
+      lcnum = Int32.of_int lcnum;
+      ncnum = Int32.of_int ncnum;
+      xmsiz = Int64.add 256L (Int64.mul bnum (if large then 8L else 4L));
+    }
+
+  let apply bdb a =
+    BDB.optimize bdb ~lmemb:a.lmemb ~nmemb:a.nmemb ~bnum:a.bnum ~apow:a.apow ~fpow:a.fpow ~opts:a.opts ()
+
+  let prepare bdb a =
+    BDB.setcache bdb ~lcnum:a.lcnum ~ncnum:a.ncnum ();
+    BDB.setxmsiz bdb a.xmsiz
+end
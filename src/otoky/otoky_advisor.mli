@@ -0,0 +1,87 @@
+open Tokyo_cabinet
+
+(* key and value sizes from the first records of a database, in file
+   order. key_hist.(i) counts keys of 2^i to 2^(i+1) - 1 bytes. *)
+type sizes = {
+  count : int;
+  key_bytes : int;
+  val_bytes : int;
+  key_hist : int array;
+  val_hist : int array;
+}
+
+val avg_key : sizes -> int
+val avg_val : sizes -> int
+
+(* advise plans for headroom times the current record count (default 2.0)
+   and sizes caches to fit in memory bytes (default 1GB). apply rewrites
+   the database with optimize; prepare sets the cache parameters, which
+   must be done before open. *)
+
+module Hdb :
+sig
+  type stats = {
+    rnum : int64;
+    fsiz : int64;
+    cur_bnum : int64;
+    bnumused : int64;
+    cur_opts : opt list;
+    sizes : sizes;
+  }
+
+  type advice = {
+    bnum : int64;
+    apow : int;
+    fpow : int;
+    opts : opt list;
+    xmsiz : int64;
+  }
+
+  val sample : ?samples:int -> HDB.t -> stats
+
+  (* average chain length of used buckets *)
+  val load : stats -> float
+  val live_bytes : stats -> int64
+
+  val advise : ?headroom:float -> ?memory:int64 -> stats -> advice
+  val apply : HDB.t -> advice -> unit
+  val prepare : HDB.t -> advice -> unit
+end
+
+module Bdb :
+sig
+  type stats = {
+    rnum : int64;
+    fsiz : int64;
+    cur_lmemb : int32;
+    cur_nmemb : int32;
+    lnum : int64;
+    nnum : int64;
+    cur_bnum : int64;
+    bnumused : int64;
+    cur_opts : opt list;
+    sizes : sizes;
+  }
+
+  type advice = {
+    lmemb : int32;
+    nmemb : int32;
+    bnum : int64;
+    apow : int;
+    fpow : int;
+    opts : opt list;
+    lcnum : int32;
+    ncnum : int32;
+    xmsiz : int64;
+  }
+
+  val sample : ?samples:int -> BDB.t -> stats
+
+  (* records per leaf over lmemb *)
+  val leaf_fill : stats -> float
+
+  (* apply needs the database's comparison function already set *)
+  val advise : ?headroom:float -> ?memory:int64 -> stats -> advice
+  val apply : BDB.t -> advice -> unit
+  val prepare : BDB.t -> advice -> unit
+end
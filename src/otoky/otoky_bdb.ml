@@ -7,17 +7,20 @@ struct
 
   let type_desc_hash_key = "__otoky_type_desc_hash__"
 
-  let is_type_desc_hash_key k klen =
-    (* argh. maybe we should store the type_desc hash somewhere else. but where? *)
-    if klen <> String.length type_desc_hash_key
+  let equal_key s k klen =
+    if klen <> String.length s
     then false
     else
       let rec loop i =
         if i = klen then true
-        else if String.unsafe_get k i <> String.unsafe_get type_desc_hash_key i then false
+        else if String.unsafe_get k i <> String.unsafe_get s i then false
         else loop (i + 1) in
       loop 0
 
+  let is_type_desc_hash_key k klen =
+    (* argh. maybe we should store the type_desc hash somewhere else. but where? *)
+    equal_key type_desc_hash_key k klen
+
   let marshall_key t k func =
     let (k, klen) as mk = t.marshall k in
     if is_type_desc_hash_key k klen
@@ -63,6 +66,11 @@ struct
     with e -> Tclist.del tclist; raise e
 end
 
+type token = string
+
+let string_of_token token = token
+let token_of_string s = s
+
 module Cursor =
 struct
   module BDBCUR_raw = BDBCUR.Fun (Cstr_cstr)
@@ -112,6 +120,39 @@ struct
       Cstr.del cstr;
       v
     with e -> Cstr.del cstr; raise e
+
+  let same_key t key =
+    let (k, klen) as cstr = BDBCUR_raw.key t.bdbcur in
+    let same = Type.equal_key key k klen in
+    Cstr.del cstr;
+    same
+
+  (* a token is the key under the cursor and its ordinal among the
+     duplicates of that key, as "ordinal:key" *)
+  let resume t token =
+    let c = try String.index token ':' with Not_found -> invalid_arg "Otoky_bdb.Cursor.resume" in
+    let n = try int_of_string (String.sub token 0 c) with Failure _ -> invalid_arg "Otoky_bdb.Cursor.resume" in
+    let key = String.sub token (c + 1) (String.length token - c - 1) in
+    (* step to the recorded duplicate, or the end of its run if it has
+       shrunk, then past it; running off the end leaves the cursor
+       exhausted *)
+    try
+      BDBCUR.jump t.bdbcur key;
+      let rec loop i =
+        if i <= n && same_key t key then (BDBCUR.next t.bdbcur; loop (i + 1)) in
+      loop 0
+    with Error (Enorec, _, _) -> ()
+
+  let token t =
+    let key = BDBCUR.key t.bdbcur in
+    let rec count n =
+      match (try BDBCUR.prev t.bdbcur; Some (same_key t key) with Error (Enorec, _, _) -> None) with
+        | Some true -> count (n + 1)
+        | _ -> n in
+    let n = count 0 in
+    BDBCUR.jump t.bdbcur key;
+    for i = 1 to n do BDBCUR.next t.bdbcur done;
+    string_of_int n ^ ":" ^ key
 end
 
 module BDB_raw = BDB.Fun (Cstr_cstr) (Tclist_tclist)
@@ -120,11 +161,16 @@ type ('k, 'v) t = {
   bdb : BDB.t;
   ktype : 'k Type.t;
   vtype : 'v Type.t;
+  mutable access : access; (* the last hint for the whole file *)
 }
 
-let open_ ?omode ktype vtype fn =
+let new_bdb ktype =
   let bdb = BDB.new_ () in
   BDB.setcmpfunc bdb (BDB.Cmp_custom_cstr (Type.compare_cstr ktype));
+  bdb
+
+let open_ ?omode ktype vtype fn =
+  let bdb = new_bdb ktype in
   BDB.open_ bdb ?omode fn;
   let hash = Type.type_desc_hash ktype ^ Type.type_desc_hash vtype in
   begin try
@@ -141,10 +187,22 @@ let open_ ?omode ktype vtype fn =
     bdb = bdb;
     ktype = ktype;
     vtype = vtype;
+    access = Acc_normal;
   }
 
+let advise t ?off ?len acc =
+  BDB.advise t.bdb ?off ?len acc;
+  match off, len with
+    | None, None -> t.access <- acc
+    | _ -> ()
+
+let bdb t = t.bdb
 let close t = BDB.close t.bdb
 let copy t fn = BDB.copy t.bdb fn
+let defrag t ?step () = BDB.defrag t.bdb ?step ()
+let defrag_start t ?interval ?step ?threshold () = BDB.defrag_start t.bdb ?interval ?step ?threshold ()
+let defrag_stop t = BDB.defrag_stop t.bdb
+let frag t = BDB.frag t.bdb
 let fsiz t = BDB.fsiz t.bdb
 
 let get t k =
@@ -174,7 +232,7 @@ let putlist t k vs =
   try
     BDB_raw.putlist t.bdb (Type.marshall_key t.ktype k "putlist") tclist;
     Tclist.del tclist
-  with e -> Tclist.del tclist
+  with e -> Tclist.del tclist; raise e
 
 let range t ?bkey ?binc ?ekey ?einc ?max () =
   let marshall_key = function
@@ -186,6 +244,17 @@ let range t ?bkey ?binc ?ekey ?einc ?max () =
     (BDB_raw.range t.bdb ?bkey ?binc ?ekey ?einc ?max ())
 
 let rnum t = BDB.rnum t.bdb
+
+let scan t func =
+  let pages = BDB.pages t.bdb in
+  BDB.advise t.bdb Acc_sequential;
+  let finish () =
+    BDB.drop_pages t.bdb pages;
+    BDB.advise t.bdb t.access in
+  let r = try func () with e -> finish (); raise e in
+  finish ();
+  r
+
 let setcache t ?lcnum ?ncnum () = BDB.setcache t.bdb ?lcnum ?ncnum ()
 let setdfunit t dfunit = BDB.setdfunit t.bdb dfunit
 let setxmsiz t xmsiz = BDB.setxmsiz t.bdb xmsiz
@@ -197,9 +266,26 @@ let trancommit t = BDB.trancommit t.bdb
 let tune t ?lmemb ?nmemb ?bnum ?apow ?fpow ?opts () =
   BDB.tune t.bdb ?lmemb ?nmemb ?bnum ?apow ?fpow ?opts ()
 
+let update t k func =
+  BDB_raw.update t.bdb (Type.marshall_key t.ktype k "update") begin fun cstr ->
+    let v =
+      match cstr with
+        | None -> None
+        | Some cstr ->
+            let v =
+              try t.vtype.Type.unmarshall cstr
+              with e -> Cstr.del cstr; raise e in
+            Cstr.del cstr;
+            Some v in
+    match func v with
+      | None -> None
+      | Some v -> Some (t.vtype.Type.marshall v)
+  end
+
 let vanish t = BDB.vanish t.bdb
 let vnum t k = BDB_raw.vnum t.bdb (Type.marshall_key t.ktype k "vnum")
 let vsiz t k = BDB_raw.vsiz t.bdb (Type.marshall_key t.ktype k "vsiz")
+let warm t ?progress () = BDB.warm t.bdb ?progress ()
 
 let cursor t = {
   Cursor.bdbcur = BDBCUR.new_ t.bdb;
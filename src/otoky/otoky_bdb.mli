@@ -1,5 +1,10 @@
 open Tokyo_cabinet
 
+type token
+
+val string_of_token : token -> string
+val token_of_string : string -> token
+
 module Cursor :
 sig
   type ('k, 'v) t
@@ -13,14 +18,38 @@ sig
   val prev : ('k, 'v) t -> unit
   val put : ('k, 'v) t -> ?cpmode:BDBCUR.cpmode -> 'v -> unit
   val val_ : ('k, 'v) t -> 'v
+
+  (* token records the record under the cursor, as its key and its
+     position among the duplicates of the key; resume moves to the
+     record after it, possibly in another process. taking a token walks
+     back over the earlier duplicates. if no record follows, resume
+     leaves the cursor exhausted, so key and val_ raise
+     Error (Enorec, ...). *)
+  val resume : ('k, 'v) t -> token -> unit
+  val token : ('k, 'v) t -> token
 end
 
 type ('k, 'v) t
 
 val open_ : ?omode:omode list -> 'k Otoky_type.t -> 'v Otoky_type.t -> string -> ('k, 'v) t
 
+(* access hints for a byte range of the file (default all of it) *)
+val advise : ('k, 'v) t -> ?off:int64 -> ?len:int64 -> access -> unit
+
+(* the underlying handle, for code working on marshalled records such as
+   Otoky_compact. writes through it bypass the type checks. *)
+val bdb : ('k, 'v) t -> BDB.t
+
+(* a new, unopened handle ordering keys as a ('k, 'v) t does *)
+val new_bdb : 'k Otoky_type.t -> BDB.t
+
 val close : ('k, 'v) t -> unit
+
 val copy : ('k, 'v) t -> string -> unit
+val defrag : ('k, 'v) t -> ?step:int64 -> unit -> unit
+val defrag_start : ('k, 'v) t -> ?interval:float -> ?step:int64 -> ?threshold:float -> unit -> unit
+val defrag_stop : ('k, 'v) t -> unit
+val frag : ('k, 'v) t -> float
 val fsiz : ('k, 'v) t -> int64
 val get : ('k, 'v) t -> 'k -> 'v
 val getlist : ('k, 'v) t -> 'k -> 'v list
@@ -44,6 +73,14 @@ val range :
   'k list
 
 val rnum : ('k, 'v) t -> int64
+
+(* run a cursor scan under sequential hints, then drop from the page
+   cache the file pages that were not cached before it, and restore the
+   last hint advise gave the whole file (hints for byte ranges are not
+   restored). the leaf cache is a single LRU that scans still pass
+   through; to keep hot leaves cached, give the process doing scans its
+   own handle with a small lcnum. *)
+val scan : ('k, 'v) t -> (unit -> 'a) -> 'a
 val setcache : ('k, 'v) t -> ?lcnum:int32 -> ?ncnum:int32 -> unit -> unit
 val setdfunit : ('k, 'v) t -> int32 -> unit
 val setxmsiz : ('k, 'v) t -> int64 -> unit
@@ -57,8 +94,16 @@ val tune :
   ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit ->
   unit
 
+(* as BDB.update: func must not use the database, and may run more
+   than once when the record is absent *)
+val update : ('k, 'v) t -> 'k -> ('v option -> 'v option) -> unit
 val vanish : ('k, 'v) t -> unit
 val vnum : ('k, 'v) t -> 'k -> int
 val vsiz : ('k, 'v) t -> 'k -> int
 
+(* pull the file into the page cache, then walk the first leaves, as
+   many as the leaf cache holds, to fill the leaf and node caches;
+   progress gets (done, total) mapped bytes *)
+val warm : ('k, 'v) t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit
+
 val cursor : ('k, 'v) t -> ('k, 'v) Cursor.t
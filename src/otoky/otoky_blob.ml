@@ -0,0 +1,303 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+module HDB_raw = HDB.Fun (Cstr_cstr) (Tclist_tclist)
+module BDB_raw = BDB.Fun (Cstr_cstr) (Tclist_tclist)
+
+type t = {
+  get : Cstr.t -> Cstr.t;
+  put : Cstr.t -> Cstr.t -> unit;
+  out : Cstr.t -> unit;
+  tranbegin : unit -> unit;
+  trancommit : unit -> unit;
+  tranabort : unit -> unit;
+}
+
+let of_hdb hdb = {
+  get = HDB_raw.get hdb;
+  put = HDB_raw.put hdb;
+  out = HDB_raw.out hdb;
+  tranbegin = (fun () -> HDB.tranbegin hdb);
+  trancommit = (fun () -> HDB.trancommit hdb);
+  tranabort = (fun () -> HDB.tranabort hdb);
+}
+
+let of_bdb bdb = {
+  get = BDB_raw.get bdb;
+  put = BDB_raw.put bdb;
+  out = BDB_raw.out bdb;
+  tranbegin = (fun () -> BDB.tranbegin bdb);
+  trancommit = (fun () -> BDB.trancommit bdb);
+  tranabort = (fun () -> BDB.tranabort bdb);
+}
+
+(* a blob is a meta record under its name, holding its size, chunk size
+   and generation in decimal, and chunks under the name, a NUL, the
+   generation and the chunk index, each in 8 big-endian bytes. a writer
+   puts its chunks under a new generation and the meta record last, so
+   a reader sees the chunks of the generation it opened or none. *)
+
+type meta = {
+  size : int64;
+  chunk : int;
+  gen : int64;
+}
+
+let check_name name func =
+  if String.contains name '\000'
+  then raise (Error (Einvalid, func, "blob name contains NUL"))
+
+let chunk_key name gen i =
+  let n = String.length name in
+  let k = String.create (n + 17) in
+  String.blit name 0 k 0 n;
+  k.[n] <- '\000';
+  for j = 0 to 7 do
+    let shift = 8 * (7 - j) in
+    k.[n + 1 + j] <- Char.chr (Int64.to_int (Int64.logand (Int64.shift_right_logical gen shift) 0xffL));
+    k.[n + 9 + j] <- Char.chr ((i lsr shift) land 0xff)
+  done;
+  k
+
+let get_meta t name =
+  let cstr = t.get (Cstr.of_string name) in
+  let meta = Cstr.copy cstr in
+  Cstr.del cstr;
+  try Scanf.sscanf meta "%Ld %d %Ld" (fun size chunk gen -> { size = size; chunk = chunk; gen = gen })
+  with Scanf.Scan_failure _ | Failure _ | End_of_file ->
+    raise (Error (Emisc, "meta", "bad blob meta record"))
+
+(* generations are random rather than counted, so one is not reused
+   after the blob is removed and written again *)
+let gens = Random.State.make_self_init ()
+
+let new_gen old =
+  let rec pick () =
+    let gen = Random.State.int64 gens Int64.max_int in
+    match old with
+      | Some m when m.gen = gen -> pick ()
+      | _ -> gen in
+  pick ()
+
+let chunks m =
+  Int64.to_int (Int64.div (Int64.add m.size (Int64.of_int (m.chunk - 1))) (Int64.of_int m.chunk))
+
+let remove_chunks t name m =
+  for i = 0 to chunks m - 1 do
+    try t.out (Cstr.of_string (chunk_key name m.gen i))
+    with Error (Enorec, _, _) -> ()
+  done
+
+let size t name = (get_meta t name).size
+
+let remove t name =
+  check_name name "remove";
+  t.tranbegin ();
+  begin try
+    let m = get_meta t name in
+    t.out (Cstr.of_string name);
+    remove_chunks t name m
+  with e -> t.tranabort (); raise e end;
+  t.trancommit ()
+
+(* writers *)
+
+type writer = {
+  w_blob : t;
+  w_name : string;
+  w_buf : string;
+  mutable w_fill : int;
+  mutable w_index : int;
+  mutable w_size : int64;
+  w_gen : int64;
+  w_old : meta option;
+  mutable w_open : bool;
+}
+
+let writer t ?(chunk = 1 lsl 20) name =
+  check_name name "writer";
+  if chunk <= 0 then raise (Error (Einvalid, "writer", "bad chunk size"));
+  t.tranbegin ();
+  let old =
+    try Some (get_meta t name)
+    with
+      | Error (Enorec, _, _) -> None
+      | e -> t.tranabort (); raise e in
+  {
+    w_blob = t;
+    w_name = name;
+    w_buf = String.create chunk;
+    w_fill = 0;
+    w_index = 0;
+    w_size = 0L;
+    w_gen = new_gen old;
+    w_old = old;
+    w_open = true;
+  }
+
+let check_writer w func =
+  if not w.w_open then raise (Error (Einvalid, func, "writer is closed"))
+
+let abort w =
+  if w.w_open
+  then begin
+    w.w_open <- false;
+    w.w_blob.tranabort ()
+  end
+
+let put_chunk w =
+  try
+    w.w_blob.put (Cstr.of_string (chunk_key w.w_name w.w_gen w.w_index)) (w.w_buf, w.w_fill);
+    w.w_index <- w.w_index + 1;
+    w.w_size <- Int64.add w.w_size (Int64.of_int w.w_fill);
+    w.w_fill <- 0
+  with e -> abort w; raise e
+
+(* copy from a string-like source; blit copies n bytes from src at off
+   into the chunk buffer at its fill point *)
+let output_gen w func blit len =
+  check_writer w func;
+  let chunk = String.length w.w_buf in
+  let rec loop off =
+    if off < len
+    then begin
+      let n = min (len - off) (chunk - w.w_fill) in
+      blit off n;
+      w.w_fill <- w.w_fill + n;
+      if w.w_fill = chunk then put_chunk w;
+      loop (off + n)
+    end in
+  loop 0
+
+let output w s off len =
+  if off < 0 || len < 0 || off + len > String.length s then invalid_arg "Otoky_blob.output";
+  output_gen w "output" (fun o n -> String.blit s (off + o) w.w_buf w.w_fill n) len
+
+let output_string w s = output w s 0 (String.length s)
+
+let output_bigarray w (buf : Cstr.buf) off len =
+  if off < 0 || len < 0 || off + len > Bigarray.Array1.dim buf then invalid_arg "Otoky_blob.output_bigarray";
+  output_gen w "output_bigarray"
+    (fun o n ->
+       let (s, _) = Cstr.of_bigarray (Bigarray.Array1.sub buf (off + o) n) in
+       String.unsafe_blit s 0 w.w_buf w.w_fill n)
+    len
+
+let close_out w =
+  check_writer w "close_out";
+  if w.w_fill > 0 then put_chunk w;
+  let t = w.w_blob in
+  begin try
+    let meta = Printf.sprintf "%Ld %d %Ld" w.w_size (String.length w.w_buf) w.w_gen in
+    t.put (Cstr.of_string w.w_name) (Cstr.of_string meta);
+    begin match w.w_old with
+      | Some m -> remove_chunks t w.w_name m
+      | None -> ()
+    end
+  with e -> abort w; raise e end;
+  w.w_open <- false;
+  t.trancommit ()
+
+let with_writer t ?chunk name func =
+  let w = writer t ?chunk name in
+  let r = try func w with e -> abort w; raise e in
+  close_out w;
+  r
+
+(* readers *)
+
+type reader = {
+  r_blob : t;
+  r_name : string;
+  r_meta : meta;
+  mutable r_pos : int64;
+  mutable r_index : int; (* of the chunk in r_cur, or -1 *)
+  mutable r_cur : Cstr.t;
+}
+
+let no_chunk = ("", 0)
+
+let reader t name =
+  check_name name "reader";
+  let m = get_meta t name in
+  {
+    r_blob = t;
+    r_name = name;
+    r_meta = m;
+    r_pos = 0L;
+    r_index = -1;
+    r_cur = no_chunk;
+  }
+
+let length r = r.r_meta.size
+let pos_in r = r.r_pos
+
+let seek_in r pos =
+  if pos < 0L || pos > r.r_meta.size then invalid_arg "Otoky_blob.seek_in";
+  r.r_pos <- pos
+
+let drop_chunk r =
+  if r.r_index >= 0
+  then begin
+    Cstr.del r.r_cur;
+    r.r_cur <- no_chunk;
+    r.r_index <- -1
+  end
+
+let close_in r = drop_chunk r
+
+(* the current chunk and the offset of pos in it; only one chunk is held
+   at a time. a chunk is gone once a writer has replaced the generation
+   the reader opened, and must have the length the meta record gives. *)
+let load r =
+  let m = r.r_meta in
+  let chunk = Int64.of_int m.chunk in
+  let index = Int64.to_int (Int64.div r.r_pos chunk) in
+  if index <> r.r_index
+  then begin
+    drop_chunk r;
+    let cur =
+      try r.r_blob.get (Cstr.of_string (chunk_key r.r_name m.gen index))
+      with Error (Enorec, _, _) -> raise (Error (Enorec, "input", "blob replaced or removed")) in
+    let want = Int64.sub m.size (Int64.mul (Int64.of_int index) chunk) in
+    if Int64.of_int (snd cur) <> min want chunk
+    then begin
+      Cstr.del cur;
+      raise (Error (Emisc, "input", "bad blob chunk"))
+    end;
+    r.r_cur <- cur;
+    r.r_index <- index
+  end;
+  Int64.to_int (Int64.rem r.r_pos chunk)
+
+(* read up to len bytes with blit, returning how many; 0 at the end *)
+let input_gen r blit len =
+  if len = 0 || r.r_pos >= r.r_meta.size then 0
+  else
+    let off = load r in
+    let (_, clen) = r.r_cur in
+    let n = min len (clen - off) in
+    blit off n;
+    r.r_pos <- Int64.add r.r_pos (Int64.of_int n);
+    n
+
+let input r s off len =
+  if off < 0 || len < 0 || off + len > String.length s then invalid_arg "Otoky_blob.input";
+  input_gen r (fun coff n -> let (c, _) = r.r_cur in String.unsafe_blit c coff s off n) len
+
+let input_bigarray r (buf : Cstr.buf) off len =
+  if off < 0 || len < 0 || off + len > Bigarray.Array1.dim buf then invalid_arg "Otoky_blob.input_bigarray";
+  input_gen r
+    (fun coff n ->
+       let src = Cstr.to_bigarray r.r_cur in
+       Bigarray.Array1.blit (Bigarray.Array1.sub src coff n) (Bigarray.Array1.sub buf off n))
+    len
+
+let really_input r s off len =
+  let rec loop off len =
+    if len > 0
+    then
+      let n = input r s off len in
+      if n = 0 then raise End_of_file;
+      loop (off + n) (len - n) in
+  loop off len
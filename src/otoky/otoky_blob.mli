@@ -0,0 +1,50 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+(* large values split into chunks under derived keys of an HDB or BDB,
+   streamed so memory per reader or writer is one chunk. blob names
+   must not contain NUL. *)
+type t
+
+val of_hdb : HDB.t -> t
+val of_bdb : BDB.t -> t
+
+val size : t -> string -> int64
+val remove : t -> string -> unit
+
+(* a writer replaces the blob when closed. it writes the new chunks
+   under a new generation and switches the meta record to it last, then
+   removes the old chunks. all this runs in a transaction from writer to
+   close_out (or abort), so a crash or abort leaves the old blob. TC
+   transactions belong to the handle, not the thread: only one is open
+   on a handle at a time, so other writers, remove and other
+   transactions wait until then, and plain writes through the handle
+   from any thread land inside the writer's transaction and are rolled
+   back if it aborts. give blobs a handle of their own, or let nothing else write through
+   it while a writer is open. a writer dropped without close_out or
+   abort leaves the transaction open; with_writer closes it or aborts if
+   func raises. chunk defaults to 1MB. *)
+type writer
+
+val writer : t -> ?chunk:int -> string -> writer
+val with_writer : t -> ?chunk:int -> string -> (writer -> 'a) -> 'a
+val output : writer -> string -> int -> int -> unit
+val output_string : writer -> string -> unit
+val output_bigarray : writer -> Cstr.buf -> int -> int -> unit
+val close_out : writer -> unit
+val abort : writer -> unit
+
+(* a reader reads the generation current at open. it never mixes
+   chunks of two generations: once a writer or remove has dropped that
+   generation, input raises Error (Enorec, _, _). input returns 0 at
+   the end, like Pervasives.input *)
+type reader
+
+val reader : t -> string -> reader
+val length : reader -> int64
+val pos_in : reader -> int64
+val seek_in : reader -> int64 -> unit
+val input : reader -> string -> int -> int -> int
+val input_bigarray : reader -> Cstr.buf -> int -> int -> int
+val really_input : reader -> string -> int -> int -> unit
+val close_in : reader -> unit
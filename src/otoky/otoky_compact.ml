@@ -0,0 +1,343 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+let no_compaction func = Error (Einvalid, func, "no compaction in progress")
+
+let precompact path = path ^ ".precompact"
+
+let reopen_omode omode =
+  match omode with
+    | None -> None
+    | Some omode -> Some (List.filter (fun m -> m <> Otrunc) omode)
+
+(* swap the compacted file in, with the original moved aside until the
+   new file has opened; open_ opens the file at path *)
+let swap c_path path open_ =
+  let old = precompact path in
+  begin try Sys.rename path old
+  with e -> (try Sys.remove c_path with Sys_error _ -> ()); raise e end;
+  let h =
+    try Sys.rename c_path path; open_ ()
+    with e ->
+      (try Sys.remove c_path with Sys_error _ -> ());
+      Sys.rename old path;
+      raise e in
+  (try Sys.remove old with Sys_error _ -> ());
+  h
+
+module Hdb =
+struct
+  type compaction = {
+    c_hdb : HDB.t;
+    c_path : string;
+  }
+
+  type ('k, 'v) t = {
+    gate : ('k, 'v) Otoky_hdb.t Otoky_gate.t;
+    omode : omode list option;
+    ktype : 'k Otoky_type.t;
+    vtype : 'v Otoky_type.t;
+    mutable compaction : compaction option;
+  }
+
+  let open_ ?omode ktype vtype fn =
+    let db = Otoky_hdb.open_ ?omode ktype vtype fn in
+    {
+      gate = Otoky_gate.create db Otoky_hdb.close;
+      omode = omode;
+      ktype = ktype;
+      vtype = vtype;
+      compaction = None;
+    }
+
+  let read t func = Otoky_gate.read t.gate func
+  let key t k () = Cstr.copy (t.ktype.Otoky_type.marshall k)
+
+  let compaction t func =
+    match t.compaction with
+      | None -> raise (no_compaction func)
+      | Some c -> c
+
+  let compact_abort t =
+    let c = compaction t "compact_abort" in
+    t.compaction <- None;
+    Otoky_gate.stop_log t.gate;
+    (try HDB.close c.c_hdb with Error _ -> ());
+    (try Sys.remove c.c_path with Sys_error _ -> ())
+
+  (* copy the records one at a time through the handle's iterator, so
+     writers only wait for single reads. a record written meanwhile is
+     logged, and the replay fixes up whatever the copy got of it. the
+     type_desc hash record is copied with the rest. *)
+  let compact_copy t c =
+    read t (fun db -> HDB.iterinit (Otoky_hdb.hdb db));
+    let next () =
+      read t begin fun db ->
+        let hdb = Otoky_hdb.hdb db in
+        try
+          let k = HDB.iternext hdb in
+          Some (k, try Some (HDB.get hdb k) with Error (Enorec, _, _) -> None)
+        with Error (Enorec, _, _) -> None
+      end in
+    let rec loop () =
+      match next () with
+        | None -> ()
+        | Some (_, None) -> loop ()
+        | Some (k, Some v) -> HDB.put c.c_hdb k v; loop () in
+    loop ()
+
+  let compact_start t =
+    if not (Otoky_gate.start_log t.gate)
+    then raise (Error (Einvalid, "compact_start", "compaction already in progress"));
+    let c = {
+      c_hdb = HDB.new_ ();
+      c_path = Otoky_hdb.path (Otoky_gate.current t.gate) ^ ".compact";
+    } in
+    t.compaction <- Some c;
+    try
+      let (rnum, opts) =
+        read t (fun db -> let hdb = Otoky_hdb.hdb db in (HDB.rnum hdb, HDB.opts hdb)) in
+      let bnum = if rnum > 0L then Some (Int64.mul rnum 2L) else None in
+      HDB.tune c.c_hdb ?bnum ~opts ();
+      HDB.open_ c.c_hdb ~omode:[Owriter; Ocreat; Otrunc] c.c_path;
+      compact_copy t c
+    with e -> compact_abort t; raise e
+
+  let compact_optimize t ?bnum ?apow ?fpow ?opts () =
+    HDB.optimize (compaction t "compact_optimize").c_hdb ?bnum ?apow ?fpow ?opts ()
+
+  (* one round of replaying the logged keys into the copy; false if
+     there was nothing to replay *)
+  let compact_replay t c =
+    let (vanished, keys) = Otoky_gate.take t.gate in
+    if vanished then HDB.vanish c.c_hdb;
+    List.iter
+      (fun k ->
+         let v =
+           read t (fun db -> try Some (HDB.get (Otoky_hdb.hdb db) k) with Error (Enorec, _, _) -> None) in
+         match v with
+           | Some v -> HDB.put c.c_hdb k v
+           | None -> try HDB.out c.c_hdb k with Error (Enorec, _, _) -> ())
+      keys;
+    vanished || keys <> []
+
+  let compact_finish t =
+    let c = compaction t "compact_finish" in
+    let path = Otoky_hdb.path (Otoky_gate.current t.gate) in
+    try
+      (* catch up alongside writers, then hold them off for the last
+         round and the swap; reads go on on the old handle throughout *)
+      let rec catch_up n = if n > 0 && compact_replay t c then catch_up (n - 1) in
+      catch_up 8;
+      Otoky_gate.exclusive t.gate begin fun () ->
+        while compact_replay t c do () done;
+        HDB.close c.c_hdb;
+        t.compaction <- None;
+        Otoky_gate.stop_log t.gate;
+        let db =
+          swap c.c_path path
+            (fun () -> Otoky_hdb.open_ ?omode:(reopen_omode t.omode) t.ktype t.vtype path) in
+        Otoky_gate.install t.gate db
+      end
+    with e ->
+      begin match t.compaction with
+        | None -> ()
+        | Some _ -> compact_abort t
+      end;
+      raise e
+
+  let compact t ?bnum ?apow ?fpow ?opts () =
+    compact_start t;
+    begin try compact_optimize t ?bnum ?apow ?fpow ?opts ()
+    with e -> compact_abort t; raise e end;
+    compact_finish t
+
+  let close t =
+    begin match t.compaction with
+      | None -> ()
+      | Some _ -> compact_abort t
+    end;
+    Otoky_hdb.close (Otoky_gate.current t.gate)
+
+  let get t k = read t (fun db -> Otoky_hdb.get db k)
+  let iterinit t = read t Otoky_hdb.iterinit
+  let iternext t = read t Otoky_hdb.iternext
+  let out t k = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_hdb.out db k)
+  let path t = Otoky_hdb.path (Otoky_gate.current t.gate)
+  let put t k v = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_hdb.put db k v)
+  let putasync t k v = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_hdb.putasync db k v)
+  let putkeep t k v = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_hdb.putkeep db k v)
+  let rnum t = read t Otoky_hdb.rnum
+  let sync t = read t Otoky_hdb.sync
+  let tranabort t = Otoky_gate.tranabort t.gate Otoky_hdb.tranabort
+  let tranbegin t = Otoky_gate.tranbegin t.gate Otoky_hdb.tranbegin
+  let trancommit t = Otoky_gate.trancommit t.gate Otoky_hdb.trancommit
+  let update t k func = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_hdb.update db k func)
+  let vanish t = Otoky_gate.vanish t.gate Otoky_hdb.vanish
+end
+
+module Bdb =
+struct
+  type compaction = {
+    c_bdb : BDB.t;
+    c_path : string;
+  }
+
+  type ('k, 'v) t = {
+    gate : ('k, 'v) Otoky_bdb.t Otoky_gate.t;
+    omode : omode list option;
+    ktype : 'k Otoky_type.t;
+    vtype : 'v Otoky_type.t;
+    mutable compaction : compaction option;
+  }
+
+  let open_ ?omode ktype vtype fn =
+    let db = Otoky_bdb.open_ ?omode ktype vtype fn in
+    {
+      gate = Otoky_gate.create db Otoky_bdb.close;
+      omode = omode;
+      ktype = ktype;
+      vtype = vtype;
+      compaction = None;
+    }
+
+  let read t func = Otoky_gate.read t.gate func
+  let key t k () = Cstr.copy (t.ktype.Otoky_type.marshall k)
+
+  let compaction t func =
+    match t.compaction with
+      | None -> raise (no_compaction func)
+      | Some c -> c
+
+  let compact_abort t =
+    let c = compaction t "compact_abort" in
+    t.compaction <- None;
+    Otoky_gate.stop_log t.gate;
+    (try BDB.close c.c_bdb with Error _ -> ());
+    (try Sys.remove c.c_path with Sys_error _ -> ())
+
+  (* copy the records a key at a time, seeking past the last key copied
+     on each step since a cursor held across writes can skip records
+     moved by leaf splits. writers only wait for single steps; a key
+     written meanwhile is logged, and the replay fixes up whatever the
+     copy got of it. *)
+  let compact_copy t c =
+    let bdb = Otoky_bdb.bdb (Otoky_gate.current t.gate) in
+    let cur = BDBCUR.new_ bdb in
+    let next last =
+      read t begin fun _ ->
+        try
+          begin match last with
+            | None -> BDBCUR.first cur
+            | Some k ->
+                BDBCUR.jump cur k;
+                while BDBCUR.key cur = k do BDBCUR.next cur done
+          end;
+          let k = BDBCUR.key cur in
+          Some (k, try BDB.getlist bdb k with Error (Enorec, _, _) -> [])
+        with Error (Enorec, _, _) -> None
+      end in
+    let rec loop last =
+      match next last with
+        | None -> ()
+        | Some (k, vs) ->
+            if vs <> [] then BDB.putlist c.c_bdb k vs;
+            loop (Some k) in
+    loop None
+
+  let compact_start t =
+    if not (Otoky_gate.start_log t.gate)
+    then raise (Error (Einvalid, "compact_start", "compaction already in progress"));
+    let c = {
+      c_bdb = Otoky_bdb.new_bdb t.ktype;
+      c_path = Otoky_bdb.path (Otoky_gate.current t.gate) ^ ".compact";
+    } in
+    t.compaction <- Some c;
+    try
+      let (lmemb, nmemb, bnum, opts) =
+        read t begin fun db ->
+          let bdb = Otoky_bdb.bdb db in
+          (BDB.lmemb bdb, BDB.nmemb bdb, BDB.bnum bdb, BDB.opts bdb)
+        end in
+      BDB.tune c.c_bdb ~lmemb ~nmemb ~bnum ~opts ();
+      BDB.open_ c.c_bdb ~omode:[Owriter; Ocreat; Otrunc] c.c_path;
+      compact_copy t c
+    with e -> compact_abort t; raise e
+
+  let compact_optimize t ?lmemb ?nmemb ?bnum ?apow ?fpow ?opts () =
+    BDB.optimize (compaction t "compact_optimize").c_bdb ?lmemb ?nmemb ?bnum ?apow ?fpow ?opts ()
+
+  (* one round of replaying the logged keys into the copy; false if
+     there was nothing to replay *)
+  let compact_replay t c =
+    let (vanished, keys) = Otoky_gate.take t.gate in
+    if vanished then BDB.vanish c.c_bdb;
+    List.iter
+      (fun k ->
+         let vs =
+           read t (fun db -> try BDB.getlist (Otoky_bdb.bdb db) k with Error (Enorec, _, _) -> []) in
+         (try BDB.outlist c.c_bdb k with Error (Enorec, _, _) -> ());
+         if vs <> [] then BDB.putlist c.c_bdb k vs)
+      keys;
+    vanished || keys <> []
+
+  let compact_finish t =
+    let c = compaction t "compact_finish" in
+    let path = Otoky_bdb.path (Otoky_gate.current t.gate) in
+    try
+      (* catch up alongside writers, then hold them off for the last
+         round and the swap; reads go on on the old handle throughout *)
+      let rec catch_up n = if n > 0 && compact_replay t c then catch_up (n - 1) in
+      catch_up 8;
+      Otoky_gate.exclusive t.gate begin fun () ->
+        while compact_replay t c do () done;
+        BDB.close c.c_bdb;
+        t.compaction <- None;
+        Otoky_gate.stop_log t.gate;
+        let db =
+          swap c.c_path path
+            (fun () -> Otoky_bdb.open_ ?omode:(reopen_omode t.omode) t.ktype t.vtype path) in
+        Otoky_gate.install t.gate db
+      end
+    with e ->
+      begin match t.compaction with
+        | None -> ()
+        | Some _ -> compact_abort t
+      end;
+      raise e
+
+  let compact t ?lmemb ?nmemb ?bnum ?apow ?fpow ?opts () =
+    compact_start t;
+    begin try compact_optimize t ?lmemb ?nmemb ?bnum ?apow ?fpow ?opts ()
+    with e -> compact_abort t; raise e end;
+    compact_finish t
+
+  let close t =
+    begin match t.compaction with
+      | None -> ()
+      | Some _ -> compact_abort t
+    end;
+    Otoky_bdb.close (Otoky_gate.current t.gate)
+
+  let get t k = read t (fun db -> Otoky_bdb.get db k)
+  let getlist t k = read t (fun db -> Otoky_bdb.getlist db k)
+  let out t k = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.out db k)
+  let outlist t k = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.outlist db k)
+  let path t = Otoky_bdb.path (Otoky_gate.current t.gate)
+  let put t k v = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.put db k v)
+  let putdup t k v = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.putdup db k v)
+  let putkeep t k v = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.putkeep db k v)
+  let putlist t k vs = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.putlist db k vs)
+
+  let range t ?bkey ?binc ?ekey ?einc ?max () =
+    read t (fun db -> Otoky_bdb.range db ?bkey ?binc ?ekey ?einc ?max ())
+
+  let rnum t = read t Otoky_bdb.rnum
+  let sync t = read t Otoky_bdb.sync
+  let tranabort t = Otoky_gate.tranabort t.gate Otoky_bdb.tranabort
+  let tranbegin t = Otoky_gate.tranbegin t.gate Otoky_bdb.tranbegin
+  let trancommit t = Otoky_gate.trancommit t.gate Otoky_bdb.trancommit
+  let update t k func = Otoky_gate.write t.gate ~key:(key t k) (fun db -> Otoky_bdb.update db k func)
+  let vanish t = Otoky_gate.vanish t.gate Otoky_bdb.vanish
+  let vnum t k = read t (fun db -> Otoky_bdb.vnum db k)
+end
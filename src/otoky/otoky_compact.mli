@@ -0,0 +1,108 @@
+open Tokyo_cabinet
+
+(* online compaction for Otoky_hdb and Otoky_bdb handles, in the
+   otoky.compact package, which needs threads. a compacting handle wraps
+   a typed one and runs its operations through a gate, so they cost a
+   mutex round trip or two more; handles that never compact should use
+   Otoky_hdb and Otoky_bdb directly.
+
+   compact_start logs the keys written from then on and copies the
+   records to path ^ ".compact" one at a time; compact_optimize rewrites
+   the copy (it may run in another thread); compact_finish replays
+   logged keys into it alongside writers, then waits for open
+   transactions and holds off writes for the last replay and the swap.
+   the swap renames the copy over path and opens a new handle on it;
+   reads never wait, running on the old handle until it is replaced. if
+   opening the new file fails, the original is put back. a crash during
+   the swap can leave the original at path ^ ".precompact".
+
+   compact_start and compact_finish must not be called inside a
+   transaction. defrag moves records without writing them, so neither
+   defrag nor a defrag thread may run during a compaction. iterators
+   and cursors belong to a handle, so iteration does not carry over the
+   swap. *)
+
+module Hdb :
+sig
+  type ('k, 'v) t
+
+  val open_ : ?omode:omode list -> 'k Otoky_type.t -> 'v Otoky_type.t -> string -> ('k, 'v) t
+  val close : ('k, 'v) t -> unit
+
+  (* the copy shares the handle's iterator, so iterinit and iternext
+     must not be used until compact_start returns *)
+  val compact : ('k, 'v) t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+  val compact_abort : ('k, 'v) t -> unit
+  val compact_finish : ('k, 'v) t -> unit
+  val compact_optimize : ('k, 'v) t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+  val compact_start : ('k, 'v) t -> unit
+
+  val get : ('k, 'v) t -> 'k -> 'v
+  val iterinit : ('k, 'v) t -> unit
+  val iternext : ('k, 'v) t -> 'k
+  val out : ('k, 'v) t -> 'k -> unit
+  val path : ('k, 'v) t -> string
+  val put : ('k, 'v) t -> 'k -> 'v -> unit
+  val putasync : ('k, 'v) t -> 'k -> 'v -> unit
+  val putkeep : ('k, 'v) t -> 'k -> 'v -> unit
+  val rnum : ('k, 'v) t -> int64
+  val sync : ('k, 'v) t -> unit
+  val tranabort : ('k, 'v) t -> unit
+  val tranbegin : ('k, 'v) t -> unit
+  val trancommit : ('k, 'v) t -> unit
+  val update : ('k, 'v) t -> 'k -> ('v option -> 'v option) -> unit
+  val vanish : ('k, 'v) t -> unit
+
+  (* run other operations that do not write on the current handle *)
+  val read : ('k, 'v) t -> (('k, 'v) Otoky_hdb.t -> 'a) -> 'a
+end
+
+module Bdb :
+sig
+  type ('k, 'v) t
+
+  val open_ : ?omode:omode list -> 'k Otoky_type.t -> 'v Otoky_type.t -> string -> ('k, 'v) t
+  val close : ('k, 'v) t -> unit
+
+  (* the copy walks the tree with its own cursor, so iteration with
+     cursors may go on meanwhile *)
+  val compact :
+    ('k, 'v) t ->
+    ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit ->
+    unit
+  val compact_abort : ('k, 'v) t -> unit
+  val compact_finish : ('k, 'v) t -> unit
+  val compact_optimize :
+    ('k, 'v) t ->
+    ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit ->
+    unit
+  val compact_start : ('k, 'v) t -> unit
+
+  val get : ('k, 'v) t -> 'k -> 'v
+  val getlist : ('k, 'v) t -> 'k -> 'v list
+  val out : ('k, 'v) t -> 'k -> unit
+  val outlist : ('k, 'v) t -> 'k -> unit
+  val path : ('k, 'v) t -> string
+  val put : ('k, 'v) t -> 'k -> 'v -> unit
+  val putdup : ('k, 'v) t -> 'k -> 'v -> unit
+  val putkeep : ('k, 'v) t -> 'k -> 'v -> unit
+  val putlist : ('k, 'v) t -> 'k -> 'v list -> unit
+
+  val range :
+    ('k, 'v) t ->
+    ?bkey:'k -> ?binc:bool -> ?ekey:'k -> ?einc:bool -> ?max:int -> unit ->
+    'k list
+
+  val rnum : ('k, 'v) t -> int64
+  val sync : ('k, 'v) t -> unit
+  val tranabort : ('k, 'v) t -> unit
+  val tranbegin : ('k, 'v) t -> unit
+  val trancommit : ('k, 'v) t -> unit
+  val update : ('k, 'v) t -> 'k -> ('v option -> 'v option) -> unit
+  val vanish : ('k, 'v) t -> unit
+  val vnum : ('k, 'v) t -> 'k -> int
+
+  (* run other operations that do not write on the current handle,
+     including cursor walks; cursor writes would not be logged *)
+  val read : ('k, 'v) t -> (('k, 'v) Otoky_bdb.t -> 'a) -> 'a
+end
@@ -98,13 +98,39 @@ let put t k v =
 let putkeep t k v =
   FDB_raw.putkeep t.fdb (to_raw_key k "putkeep") (marshall t v "putkeep")
 
+let raw_bounds lower upper func =
+  let lower = match lower with None -> Some 2L | Some k -> Some (to_raw_key k func) in
+  let upper = match upper with None -> None | Some k -> Some (to_raw_key k func) in
+  lower, upper
+
 let range t ?lower ?upper ?max () =
-  let lower = match lower with None -> Some 2L | Some k -> Some (to_raw_key k "range") in
-  let upper = match upper with None -> None | Some k -> Some (to_raw_key k "range") in
+  let lower, upper = raw_bounds lower upper "range" in
   let range = FDB.range t.fdb ?lower ?upper ?max () in
   Array.iteri (fun i k -> range.(i) <- of_raw_key k) range;
   range
 
+let range_kv t ?lower ?upper ?max () =
+  let lower, upper = raw_bounds lower upper "range_kv" in
+  let kv = FDB.range_kv t.fdb ?lower ?upper ?max () in
+  (* in place on the Bigarray, so no id is boxed *)
+  let ids = kv.FDB.ids in
+  for i = 0 to Bigarray.Array1.dim ids - 1 do
+    ids.{i} <- Int64.pred ids.{i}
+  done;
+  kv
+
+let range_values t ?lower ?upper ?max () =
+  let kv = range_kv t ?lower ?upper ?max () in
+  let offs = kv.FDB.offs in
+  let vals =
+    Array.init (Bigarray.Array1.dim kv.FDB.ids) begin fun i ->
+      let off = Int64.to_int offs.{i} in
+      let len = Int64.to_int offs.{i + 1} - off in
+      (* points into vals, which the Cstr keeps alive; not to be deleted *)
+      t.vtype.Type.unmarshall (Cstr.of_bigarray (Bigarray.Array1.sub kv.FDB.vals off len))
+    end in
+  kv.FDB.ids, vals
+
 let rnum t = FDB.rnum t.fdb
 let sync t = FDB.sync t.fdb
 let tranabort t = FDB.tranabort t.fdb
@@ -16,6 +16,14 @@ val path : 'v t -> string
 val put : 'v t -> int64 -> 'v -> unit
 val putkeep : 'v t -> int64 -> 'v -> unit
 val range : 'v t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> int64 array
+
+(* a range's ids and values from one call into TC. range_kv leaves the
+   values marshalled; range_values unmarshalls them. *)
+val range_kv : 'v t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> FDB.kv
+val range_values :
+  'v t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit ->
+  (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t * 'v array
+
 val rnum : 'v t -> int64
 val sync : 'v t -> unit
 val tranabort : 'v t -> unit
@@ -0,0 +1,200 @@
+type 'h handle = {
+  h : 'h;
+  mutable readers : int;
+  mutable retired : bool; (* replaced by install *)
+}
+
+type 'h t = {
+  lock : Mutex.t;
+  cond : Condition.t; (* broadcast on any change below *)
+  close : 'h -> unit;
+  mutable cur : 'h handle;
+  mutable writers : int; (* writes running *)
+  mutable trans : int; (* transactions begun and not ended *)
+  mutable vanishing : int; (* vanishes running *)
+  mutable draining : bool; (* new transactions wait for an exclusive section or start_log *)
+  mutable blocked : bool; (* new writes wait for an exclusive section *)
+  mutable logging : bool;
+  mutable vanished : bool;
+  dirty : (string, unit) Hashtbl.t;
+  tran_keys : (string, unit) Hashtbl.t; (* keys written since tranbegin, while logging *)
+}
+
+let handle h = { h = h; readers = 0; retired = false }
+
+let create h close = {
+  lock = Mutex.create ();
+  cond = Condition.create ();
+  close = close;
+  cur = handle h;
+  writers = 0;
+  trans = 0;
+  vanishing = 0;
+  draining = false;
+  blocked = false;
+  logging = false;
+  vanished = false;
+  dirty = Hashtbl.create 1024;
+  tran_keys = Hashtbl.create 64;
+}
+
+let wait_while g cond =
+  while cond () do Condition.wait g.cond g.lock done
+
+let current g = g.cur.h
+
+let read g func =
+  Mutex.lock g.lock;
+  let c = g.cur in
+  c.readers <- c.readers + 1;
+  Mutex.unlock g.lock;
+  let finish () =
+    Mutex.lock g.lock;
+    c.readers <- c.readers - 1;
+    let close = c.retired && c.readers = 0 in
+    Mutex.unlock g.lock;
+    if close then g.close c.h in
+  let r = try func c.h with e -> finish (); raise e in
+  finish ();
+  r
+
+let enter g =
+  Mutex.lock g.lock;
+  wait_while g (fun () -> g.blocked);
+  g.writers <- g.writers + 1;
+  let h = g.cur.h in
+  Mutex.unlock g.lock;
+  h
+
+let leave g key =
+  Mutex.lock g.lock;
+  begin match key with
+    | Some key when g.logging ->
+        let k = try key () with e -> Mutex.unlock g.lock; raise e in
+        Hashtbl.replace g.dirty k ();
+        if g.trans > 0 then Hashtbl.replace g.tran_keys k ()
+    | _ -> ()
+  end;
+  g.writers <- g.writers - 1;
+  if g.writers = 0 then Condition.broadcast g.cond;
+  Mutex.unlock g.lock
+
+let write g ?key func =
+  let h = enter g in
+  let r = try func h with e -> leave g key; raise e in
+  leave g key;
+  r
+
+let vanish g func =
+  Mutex.lock g.lock;
+  wait_while g (fun () -> g.blocked);
+  g.writers <- g.writers + 1;
+  g.vanishing <- g.vanishing + 1;
+  (* flagged before it runs, so a replay that takes keys written after
+     it also takes the flag; keys logged before it replay as removed *)
+  if g.logging then g.vanished <- true;
+  let h = g.cur.h in
+  Mutex.unlock g.lock;
+  let finish () =
+    Mutex.lock g.lock;
+    g.writers <- g.writers - 1;
+    g.vanishing <- g.vanishing - 1;
+    Condition.broadcast g.cond;
+    Mutex.unlock g.lock in
+  let r = try func h with e -> finish (); raise e in
+  finish ();
+  r
+
+let tranbegin g func =
+  Mutex.lock g.lock;
+  wait_while g (fun () -> g.draining || g.blocked);
+  g.trans <- g.trans + 1;
+  let h = g.cur.h in
+  Mutex.unlock g.lock;
+  (* not counted as a write: TC's tranbegin polls while another
+     transaction is open, and must not hold up the exclusive section
+     that the open transaction's commit waits behind *)
+  try func h
+  with e ->
+    Mutex.lock g.lock;
+    g.trans <- g.trans - 1;
+    Condition.broadcast g.cond;
+    Mutex.unlock g.lock;
+    raise e
+
+let tranend g aborted func =
+  let finish () =
+    Mutex.lock g.lock;
+    if aborted && g.logging
+    then Hashtbl.iter (fun k () -> Hashtbl.replace g.dirty k ()) g.tran_keys;
+    Hashtbl.clear g.tran_keys;
+    g.trans <- g.trans - 1;
+    Condition.broadcast g.cond;
+    Mutex.unlock g.lock in
+  let r = try write g func with e -> finish (); raise e in
+  finish ();
+  r
+
+let trancommit g func = tranend g false func
+let tranabort g func = tranend g true func
+
+let exclusive g func =
+  Mutex.lock g.lock;
+  wait_while g (fun () -> g.draining || g.blocked);
+  g.draining <- true;
+  wait_while g (fun () -> g.trans > 0);
+  g.blocked <- true;
+  wait_while g (fun () -> g.writers > 0);
+  Mutex.unlock g.lock;
+  let release () =
+    Mutex.lock g.lock;
+    g.draining <- false;
+    g.blocked <- false;
+    Condition.broadcast g.cond;
+    Mutex.unlock g.lock in
+  let r = try func () with e -> release (); raise e in
+  release ();
+  r
+
+let install g h =
+  Mutex.lock g.lock;
+  let old = g.cur in
+  g.cur <- handle h;
+  old.retired <- true;
+  let close = old.readers = 0 in
+  Mutex.unlock g.lock;
+  if close then g.close old.h
+
+let start_log g =
+  Mutex.lock g.lock;
+  wait_while g (fun () -> g.draining || g.blocked);
+  g.draining <- true;
+  wait_while g (fun () -> g.trans > 0 || g.vanishing > 0);
+  let started = not g.logging in
+  if started
+  then begin
+    g.logging <- true;
+    g.vanished <- false;
+    Hashtbl.clear g.dirty
+  end;
+  g.draining <- false;
+  Condition.broadcast g.cond;
+  Mutex.unlock g.lock;
+  started
+
+let stop_log g =
+  Mutex.lock g.lock;
+  g.logging <- false;
+  g.vanished <- false;
+  Hashtbl.clear g.dirty;
+  Hashtbl.clear g.tran_keys;
+  Mutex.unlock g.lock
+
+let take g =
+  Mutex.lock g.lock;
+  let vanished = g.vanished in
+  let keys = Hashtbl.fold (fun k () ks -> k :: ks) g.dirty [] in
+  g.vanished <- false;
+  Hashtbl.clear g.dirty;
+  Mutex.unlock g.lock;
+  (vanished, keys)
@@ -0,0 +1,47 @@
+(* coordination of the operations on a handle 'h with online compaction,
+   for Otoky_compact. reads never wait; writes and transactions wait only
+   while an exclusive section runs. while logging is on, the keys written
+   are logged once the write is done. *)
+type 'h t
+
+(* a gate over the handle; close closes a handle replaced by install,
+   once the reads running on it have finished *)
+val create : 'h -> ('h -> unit) -> 'h t
+
+(* the current handle *)
+val current : 'h t -> 'h
+
+(* run a read on the current handle *)
+val read : 'h t -> ('h -> 'a) -> 'a
+
+(* run a write on the current handle. key gives the marshalled key
+   written, and is only called while logging; it is logged after the
+   write, even if the write raised. *)
+val write : 'h t -> ?key:(unit -> string) -> ('h -> 'a) -> 'a
+
+(* run a vanish of the handle, logged before it runs *)
+val vanish : 'h t -> ('h -> 'a) -> 'a
+
+(* TC runs one transaction per handle at a time. while logging, writes
+   made in a transaction are logged again when it aborts, since the
+   abort rolls them back. *)
+val tranbegin : 'h t -> ('h -> unit) -> unit
+val trancommit : 'h t -> ('h -> unit) -> unit
+val tranabort : 'h t -> ('h -> unit) -> unit
+
+(* wait for open transactions and running writes, then run func while
+   new ones wait; reads go on. it must not be called from inside a
+   transaction. *)
+val exclusive : 'h t -> (unit -> 'a) -> 'a
+
+(* in an exclusive section: make h the current handle *)
+val install : 'h t -> 'h -> unit
+
+(* start logging, once open transactions and any vanish running have
+   finished; false if logging was already on. it must not be called
+   from inside a transaction. *)
+val start_log : 'h t -> bool
+val stop_log : 'h t -> unit
+
+(* the logged vanish flag and keys, clearing them *)
+val take : 'h t -> bool * string list
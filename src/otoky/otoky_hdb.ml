@@ -31,8 +31,14 @@ type ('k, 'v) t = {
   hdb : HDB.t;
   ktype : 'k Type.t;
   vtype : 'v Type.t;
+  mutable access : access; (* the last hint for the whole file *)
 }
 
+type token = string
+
+let string_of_token token = token
+let token_of_string s = s
+
 let open_ ?omode ktype vtype fn =
   let hdb = HDB.new_ () in
   HDB.open_ hdb ?omode fn;
@@ -51,10 +57,21 @@ let open_ ?omode ktype vtype fn =
     hdb = hdb;
     ktype = ktype;
     vtype = vtype;
+    access = Acc_normal;
   }
 
+let advise t ?off ?len acc =
+  HDB.advise t.hdb ?off ?len acc;
+  match off, len with
+    | None, None -> t.access <- acc
+    | _ -> ()
+
 let close t = HDB.close t.hdb
 let copy t fn = HDB.copy t.hdb fn
+let defrag t ?step () = HDB.defrag t.hdb ?step ()
+let defrag_start t ?interval ?step ?threshold () = HDB.defrag_start t.hdb ?interval ?step ?threshold ()
+let defrag_stop t = HDB.defrag_stop t.hdb
+let frag t = HDB.frag t.hdb
 let fsiz t = HDB.fsiz t.hdb
 
 let get t k =
@@ -65,6 +82,8 @@ let get t k =
     v
   with e -> Cstr.del cstr; raise e
 
+let hdb t = t.hdb
+
 let iterinit t = HDB.iterinit t.hdb
 
 let iternext t =
@@ -77,6 +96,27 @@ let iternext t =
   Cstr.del cstr;
   k
 
+(* a token is the marshalled key and the file offset of its record, as
+   "offset:key"; the offset is -1 where TC can't give it *)
+let iterresume t token =
+  let c = try String.index token ':' with Not_found -> invalid_arg "Otoky_hdb.iterresume" in
+  let off = try Int64.of_string (String.sub token 0 c) with Failure _ -> invalid_arg "Otoky_hdb.iterresume" in
+  let key = String.sub token (c + 1) (String.length token - c - 1) in
+  try
+    HDB.iterinit2 t.hdb key;
+    (* skip the checkpointed key itself *)
+    begin try Cstr.del (HDB_raw.iternext t.hdb)
+    with Error (Enorec, _, _) -> () end
+  with Error (Enorec, _, _) as e ->
+    (* the key is gone; carry on from where its record was *)
+    if off < 0L then raise e;
+    HDB.iterseek t.hdb off
+
+let itertoken t k =
+  let mk = Type.marshall_key t.ktype k "itertoken" in
+  let off = try HDB_raw.iteroffset t.hdb mk with Error (Emisc, _, _) -> -1L in
+  Int64.to_string off ^ ":" ^ Cstr.copy mk
+
 let optimize t ?bnum ?apow ?fpow ?opts () = HDB.optimize t.hdb ?bnum ?apow ?fpow ?opts ()
 let out t k = HDB_raw.out t.hdb (Type.marshall_key t.ktype k "out")
 let path t = HDB.path t.hdb
@@ -84,6 +124,17 @@ let put t k v = HDB_raw.put t.hdb (Type.marshall_key t.ktype k "put") (t.vtype.T
 let putasync t k v = HDB_raw.putasync t.hdb (Type.marshall_key t.ktype k "putasync") (t.vtype.Type.marshall v)
 let putkeep t k v = HDB_raw.putkeep t.hdb (Type.marshall_key t.ktype k "putkeep") (t.vtype.Type.marshall v)
 let rnum t = HDB.rnum t.hdb
+
+let scan t func =
+  let pages = HDB.pages t.hdb in
+  HDB.advise t.hdb Acc_sequential;
+  let finish () =
+    HDB.drop_pages t.hdb pages;
+    HDB.advise t.hdb t.access in
+  let r = try func () with e -> finish (); raise e in
+  finish ();
+  r
+
 let setcache t rcnum = HDB.setcache t.hdb rcnum
 let setdfunit t dfunit = HDB.setdfunit t.hdb dfunit
 let setxmsiz t xmsiz = HDB.setxmsiz t.hdb xmsiz
@@ -92,5 +143,22 @@ let tranabort t = HDB.tranabort t.hdb
 let tranbegin t = HDB.tranbegin t.hdb
 let trancommit t = HDB.trancommit t.hdb
 let tune t ?bnum ?apow ?fpow ?opts () = HDB.tune t.hdb ?bnum ?apow ?fpow ?opts ()
+let update t k func =
+  HDB_raw.update t.hdb (Type.marshall_key t.ktype k "update") begin fun cstr ->
+    let v =
+      match cstr with
+        | None -> None
+        | Some cstr ->
+            let v =
+              try t.vtype.Type.unmarshall cstr
+              with e -> Cstr.del cstr; raise e in
+            Cstr.del cstr;
+            Some v in
+    match func v with
+      | None -> None
+      | Some v -> Some (t.vtype.Type.marshall v)
+  end
+
 let vanish t = HDB.vanish t.hdb
 let vsiz t k = HDB_raw.vsiz t.hdb (Type.marshall_key t.ktype k "vsiz")
+let warm t ?progress () = HDB.warm t.hdb ?progress ()
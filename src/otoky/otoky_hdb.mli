@@ -2,14 +2,44 @@ open Tokyo_cabinet
 
 type ('k, 'v) t
 
+type token
+
+val string_of_token : token -> string
+val token_of_string : string -> token
+
 val open_ : ?omode:omode list -> 'k Otoky_type.t -> 'v Otoky_type.t -> string -> ('k, 'v) t
 
+(* access hints for a byte range of the file (default all of it) *)
+val advise : ('k, 'v) t -> ?off:int64 -> ?len:int64 -> access -> unit
+
 val close : ('k, 'v) t -> unit
+
 val copy : ('k, 'v) t -> string -> unit
+val defrag : ('k, 'v) t -> ?step:int64 -> unit -> unit
+val defrag_start : ('k, 'v) t -> ?interval:float -> ?step:int64 -> ?threshold:float -> unit -> unit
+val defrag_stop : ('k, 'v) t -> unit
+val frag : ('k, 'v) t -> float
 val fsiz : ('k, 'v) t -> int64
 val get : ('k, 'v) t -> 'k -> 'v
+
+(* the underlying handle, for code working on marshalled records such as
+   Otoky_compact. writes through it bypass the type checks. *)
+val hdb : ('k, 'v) t -> HDB.t
 val iterinit : ('k, 'v) t -> unit
 val iternext : ('k, 'v) t -> 'k
+
+(* a token records a key returned by iternext and the file offset of
+   its record; iterresume restarts iteration just after it, possibly in
+   another process. if the key has since been removed, iteration
+   carries on from the offset in file order, so records written since
+   may or may not be seen. the offset is stale once the file has been
+   optimized or defragmented; iterresume checks only that a record or
+   free block appears to start there, else it raises
+   Error (Einvalid, _, _). with a TC other than 1.4 tokens hold no
+   offset and iterresume raises Error (Enorec, _, _) for a removed key.
+   itertoken raises Error (Enorec, _, _) if the key is absent. *)
+val iterresume : ('k, 'v) t -> token -> unit
+val itertoken : ('k, 'v) t -> 'k -> token
 val optimize : ('k, 'v) t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
 val out : ('k, 'v) t -> 'k -> unit
 val path : ('k, 'v) t -> string
@@ -17,6 +47,13 @@ val put : ('k, 'v) t -> 'k -> 'v -> unit
 val putasync : ('k, 'v) t -> 'k -> 'v -> unit
 val putkeep : ('k, 'v) t -> 'k -> 'v -> unit
 val rnum : ('k, 'v) t -> int64
+
+(* run an iternext scan under sequential hints, then drop from the page
+   cache the file pages that were not cached before it, so pages other
+   readers had cached stay. pages still mapped (the bucket array and
+   records within xmsiz) are kept. the last hint advise gave the whole
+   file is restored after; hints for byte ranges are not. *)
+val scan : ('k, 'v) t -> (unit -> 'a) -> 'a
 val setcache : ('k, 'v) t -> int32 -> unit
 val setdfunit : ('k, 'v) t -> int32 -> unit
 val setxmsiz : ('k, 'v) t -> int64 -> unit
@@ -25,5 +62,12 @@ val tranabort : ('k, 'v) t -> unit
 val tranbegin : ('k, 'v) t -> unit
 val trancommit : ('k, 'v) t -> unit
 val tune : ('k, 'v) t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+(* as HDB.update: func must not use the database, and may run more
+   than once when the record is absent *)
+val update : ('k, 'v) t -> 'k -> ('v option -> 'v option) -> unit
 val vanish : ('k, 'v) t -> unit
 val vsiz : ('k, 'v) t -> 'k -> int
+
+(* pull the file into the page cache ahead of use; progress gets
+   (done, total) mapped bytes *)
+val warm : ('k, 'v) t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit
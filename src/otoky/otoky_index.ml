@@ -0,0 +1,250 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+type ('k, 'v) hook = {
+  add : 'k -> 'v -> unit; (* entries of the value not already there *)
+  drop : 'k -> 'v -> 'v option -> unit; (* entries of the old value the new one lacks *)
+  h_tranbegin : unit -> unit;
+  h_trancommit : unit -> unit;
+  h_tranabort : unit -> unit;
+}
+
+type ('k, 'v) store = {
+  ktype : 'k Otoky_type.t;
+  s_get : 'k -> 'v;
+  s_put : 'k -> 'v -> unit;
+  s_out : 'k -> unit;
+  s_iter : ('k -> 'v -> unit) -> unit;
+  tranbegin : unit -> unit;
+  trancommit : unit -> unit;
+  tranabort : unit -> unit;
+  mutable hooks : ('k, 'v) hook list;
+}
+
+let of_hdb ktype hdb = {
+  ktype = ktype;
+  s_get = Otoky_hdb.get hdb;
+  s_put = Otoky_hdb.put hdb;
+  s_out = Otoky_hdb.out hdb;
+  s_iter =
+    (fun func ->
+       Otoky_hdb.iterinit hdb;
+       let rec loop () =
+         match (try Some (Otoky_hdb.iternext hdb) with Error (Enorec, _, _) -> None) with
+           | None -> ()
+           | Some k -> func k (Otoky_hdb.get hdb k); loop () in
+       loop ());
+  tranbegin = (fun () -> Otoky_hdb.tranbegin hdb);
+  trancommit = (fun () -> Otoky_hdb.trancommit hdb);
+  tranabort = (fun () -> Otoky_hdb.tranabort hdb);
+  hooks = [];
+}
+
+let of_bdb ktype bdb = {
+  ktype = ktype;
+  s_get = Otoky_bdb.get bdb;
+  s_put = Otoky_bdb.put bdb;
+  s_out = Otoky_bdb.out bdb;
+  s_iter =
+    (fun func ->
+       let cur = Otoky_bdb.cursor bdb in
+       let next () = try Otoky_bdb.Cursor.next cur; true with Error (Enorec, _, _) -> false in
+       let rec loop () =
+         func (Otoky_bdb.Cursor.key cur) (Otoky_bdb.Cursor.val_ cur);
+         if next () then loop () in
+       if (try Otoky_bdb.Cursor.first cur; true with Error (Enorec, _, _) -> false)
+       then loop ());
+  tranbegin = (fun () -> Otoky_bdb.tranbegin bdb);
+  trancommit = (fun () -> Otoky_bdb.trancommit bdb);
+  tranabort = (fun () -> Otoky_bdb.tranabort bdb);
+  hooks = [];
+}
+
+(* write the record at k with func, given its old value, where new_ is
+   its new one. the entries of new_ go in under a transaction on each
+   index, committed before the store's, and stale entries come out only
+   after the store commits, so a failure or crash at any point leaves at
+   most extra entries; see build *)
+let write s k new_ func =
+  s.tranbegin ();
+  let begun = ref [] in
+  let old =
+    try
+      List.iter (fun h -> h.h_tranbegin (); begun := h :: !begun) s.hooks;
+      let old = try Some (s.s_get k) with Error (Enorec, _, _) -> None in
+      begin match new_ with
+        | Some v -> List.iter (fun h -> h.add k v) s.hooks
+        | None -> ()
+      end;
+      func old;
+      old
+    with e ->
+      List.iter (fun h -> h.h_tranabort ()) !begun;
+      s.tranabort ();
+      raise e in
+  let rec commit = function
+    | [] -> ()
+    | h :: hs ->
+        begin try h.h_trancommit ()
+        with e ->
+          (try h.h_tranabort () with Error _ -> ());
+          List.iter (fun h -> h.h_tranabort ()) hs;
+          s.tranabort ();
+          raise e
+        end;
+        commit hs in
+  commit s.hooks;
+  s.trancommit ();
+  match old with
+    | Some v -> List.iter (fun h -> h.drop k v new_) s.hooks
+    | None -> ()
+
+let get s k = s.s_get k
+
+let put s k v = write s k (Some v) (fun _ -> s.s_put k v)
+
+let out s k = write s k None (fun _ -> s.s_out k)
+
+(* index entries are keyed by the index key and the marshalled primary
+   key together, so each (i, k) is a single record found with one seek.
+   the marshalled i comes first and its length last, 4 bytes
+   big-endian. entries order by i, then by the bytes of the primary
+   key, so (i, "") comes before every entry for i. *)
+let entry_type itype ktype =
+  Otoky_type.make
+    ~type_desc:(Type_desc.hide
+                  (Type_desc.Tuple [ Type_desc.show itype.Otoky_type.type_desc;
+                                     Type_desc.show ktype.Otoky_type.type_desc ]))
+    ~marshall:(fun (i, mk) ->
+                 let (s, len) = itype.Otoky_type.marshall i in
+                 let klen = String.length mk in
+                 let r = String.create (len + klen + 4) in
+                 String.blit s 0 r 0 len;
+                 String.blit mk 0 r len klen;
+                 for j = 0 to 3 do
+                   r.[len + klen + j] <- Char.unsafe_chr ((len lsr (24 - 8 * j)) land 0xff)
+                 done;
+                 (r, len + klen + 4))
+    ~unmarshall:(fun (s, len) ->
+                   let rec loop j n =
+                     if j = 4 then n
+                     else loop (j + 1) ((n lsl 8) lor Char.code (String.unsafe_get s (len - 4 + j))) in
+                   let ilen = loop 0 0 in
+                   (itype.Otoky_type.unmarshall (s, ilen), String.sub s ilen (len - 4 - ilen)))
+    ~compare:(fun (i, mk) (i', mk') ->
+                match itype.Otoky_type.compare i i' with
+                  | 0 -> compare mk mk'
+                  | c -> c)
+
+let unit_type =
+  Otoky_type.make
+    ~type_desc:(Type_desc.hide Type_desc.Unit)
+    ~marshall:(fun () -> ("", 0))
+    ~unmarshall:(fun _ -> ())
+    ~compare:compare
+
+type ('k, 'v, 'i) index = {
+  store : ('k, 'v) store;
+  bdb : ('i * string, unit) Otoky_bdb.t; (* (index key, marshalled primary key) -> () *)
+  itype : 'i Otoky_type.t;
+  extract : 'v -> 'i list;
+  mutable hook : ('k, 'v) hook option;
+}
+
+let marshall_key x k = Cstr.copy (x.store.ktype.Otoky_type.marshall k)
+
+let remove x i k =
+  try Otoky_bdb.out x.bdb (i, marshall_key x k)
+  with Error (Enorec, _, _) -> ()
+
+(* the entry may be there already, left by a write whose store commit
+   failed or was lost in a crash; put leaves it as it was *)
+let add x k v =
+  let mk = marshall_key x k in
+  List.iter (fun i -> Otoky_bdb.put x.bdb (i, mk) ()) (x.extract v)
+
+let drop x k old new_ =
+  let news = match new_ with Some v -> x.extract v | None -> [] in
+  let mem i is = List.exists (fun i' -> x.itype.Otoky_type.compare i i' = 0) is in
+  List.iter (fun i -> if not (mem i news) then remove x i k) (x.extract old)
+
+let index s ?omode itype extract fn =
+  let x = {
+    store = s;
+    bdb = Otoky_bdb.open_ ?omode (entry_type itype s.ktype) unit_type fn;
+    itype = itype;
+    extract = extract;
+    hook = None;
+  } in
+  let h = {
+    add = add x;
+    drop = drop x;
+    h_tranbegin = (fun () -> Otoky_bdb.tranbegin x.bdb);
+    h_trancommit = (fun () -> Otoky_bdb.trancommit x.bdb);
+    h_tranabort = (fun () -> Otoky_bdb.tranabort x.bdb);
+  } in
+  x.hook <- Some h;
+  s.hooks <- s.hooks @ [ h ];
+  x
+
+let close x =
+  match x.hook with
+    | None -> ()
+    | Some h ->
+        x.store.hooks <- List.filter (fun h' -> h' != h) x.store.hooks;
+        x.hook <- None;
+        Otoky_bdb.close x.bdb
+
+let build x =
+  Otoky_bdb.vanish x.bdb;
+  x.store.s_iter (fun k v -> add x k v)
+
+(* collect entries from the cursor position while while_ holds *)
+let scan x cur ?max while_ =
+  let next () = try Otoky_bdb.Cursor.next cur; true with Error (Enorec, _, _) -> false in
+  let rec loop n acc =
+    if Some n = max then List.rev acc
+    else
+      let (i, mk) = Otoky_bdb.Cursor.key cur in
+      if not (while_ i) then List.rev acc
+      else
+        let acc = (i, x.store.ktype.Otoky_type.unmarshall (mk, String.length mk)) :: acc in
+        if next () then loop (n + 1) acc else List.rev acc in
+  loop 0 []
+
+let range x ?lower ?upper ?max () =
+  let cur = Otoky_bdb.cursor x.bdb in
+  let start =
+    try
+      begin match lower with
+        | Some i -> Otoky_bdb.Cursor.jump cur (i, "")
+        | None -> Otoky_bdb.Cursor.first cur
+      end;
+      true
+    with Error (Enorec, _, _) -> false in
+  if not start then []
+  else
+    scan x cur ?max
+      (fun i ->
+         match upper with
+           | Some u -> x.itype.Otoky_type.compare i u <= 0
+           | None -> true)
+
+let prefix x ?max p =
+  let len = String.length p in
+  let cur = Otoky_bdb.cursor x.bdb in
+  if (try Otoky_bdb.Cursor.jump cur (p, ""); true with Error (Enorec, _, _) -> false)
+  then scan x cur ?max (fun i -> String.length i >= len && String.sub i 0 len = p)
+  else []
+
+let find x i = List.map snd (range x ~lower:i ~upper:i ())
+
+let lookup x i =
+  List.fold_right
+    (fun k acc ->
+       match (try Some (x.store.s_get k) with Error (Enorec, _, _) -> None) with
+         | Some v when List.exists (fun i' -> x.itype.Otoky_type.compare i i' = 0) (x.extract v) ->
+             (k, v) :: acc
+         | _ -> acc)
+    (find x i)
+    []
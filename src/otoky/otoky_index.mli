@@ -0,0 +1,55 @@
+open Tokyo_cabinet
+
+(* secondary indexes over an Otoky_hdb or Otoky_bdb. an index maps the
+   index keys a function extracts from each value to the primary keys
+   holding them, in a companion Otoky_bdb with a record per index key
+   and primary key, ordered by the index key type and then by the
+   marshalled primary key. adding or removing an entry is one seek
+   however many records share the index key. a write through the store adds the new value's index entries
+   in a transaction on each index, committed before the store's, and
+   removes the old value's stale entries once the store has committed. *)
+type ('k, 'v) store
+
+(* the store does not own the primary handle; closing it is up to the
+   caller, after closing the indexes. a BDB store holds one value per
+   key. *)
+val of_hdb : 'k Otoky_type.t -> ('k, 'v) Otoky_hdb.t -> ('k, 'v) store
+val of_bdb : 'k Otoky_type.t -> ('k, 'v) Otoky_bdb.t -> ('k, 'v) store
+
+val get : ('k, 'v) store -> 'k -> 'v
+val put : ('k, 'v) store -> 'k -> 'v -> unit
+val out : ('k, 'v) store -> 'k -> unit
+
+type ('k, 'v, 'i) index
+
+(* open the index file at path and attach it to the store. a value has
+   any number of index keys. an index created over existing records is
+   empty until build. *)
+val index :
+  ('k, 'v) store -> ?omode:omode list -> 'i Otoky_type.t -> ('v -> 'i list) -> string ->
+  ('k, 'v, 'i) index
+
+(* detach and close the index *)
+val close : ('k, 'v, 'i) index -> unit
+
+(* rewrite the index from every record of the store. the commits of
+   one write are not atomic across files, but a crash or a failed
+   commit (which aborts the indexes not yet committed and the store)
+   only leaves extra entries: new ones for a write the store lost, or
+   stale ones for a write it kept. lookup skips them; build removes
+   them. *)
+val build : ('k, 'v, 'i) index -> unit
+
+(* index entries with lower <= i <= upper (default all) in index key
+   order, up to max *)
+val range : ('k, 'v, 'i) index -> ?lower:'i -> ?upper:'i -> ?max:int -> unit -> ('i * 'k) list
+
+(* entries whose index key starts with prefix, for string index keys
+   compared as strings *)
+val prefix : ('k, 'v, string) index -> ?max:int -> string -> (string * 'k) list
+
+(* the primary keys with index key i *)
+val find : ('k, 'v, 'i) index -> 'i -> 'k list
+
+(* the records with index key i, checked against the extractor *)
+val lookup : ('k, 'v, 'i) index -> 'i -> ('k * 'v) list
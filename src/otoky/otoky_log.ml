@@ -0,0 +1,104 @@
+open Tokyo_cabinet
+
+type 'v t = {
+  log : 'v Otoky_fdb.t;
+  cursors : HDB.t; (* consumer name -> last consumed id, in decimal *)
+  group : int;
+  mutable pending : 'v list; (* newest first *)
+  mutable npending : int;
+}
+
+type 'v consumer = {
+  c_log : 'v t;
+  name : string;
+  mutable pos : int64;
+}
+
+let open_ ?omode ?width ?(group = 1000) vtype fn =
+  let log = Otoky_fdb.open_ ?omode ?width vtype fn in
+  let cursors = HDB.new_ () in
+  begin try HDB.open_ cursors ?omode (fn ^ ".cursors")
+  with e -> Otoky_fdb.close log; raise e end;
+  {
+    log = log;
+    cursors = cursors;
+    group = group;
+    pending = [];
+    npending = 0;
+  }
+
+(* one transaction per batch, so a batch costs one commit *)
+let put_all t vs =
+  Otoky_fdb.tranbegin t.log;
+  begin try List.iter (fun v -> Otoky_fdb.put t.log FDB.id_next v) vs
+  with e -> Otoky_fdb.tranabort t.log; raise e end;
+  Otoky_fdb.trancommit t.log
+
+let flush t =
+  if t.pending <> []
+  then begin
+    put_all t (List.rev t.pending);
+    t.pending <- [];
+    t.npending <- 0
+  end
+
+let append t v =
+  t.pending <- v :: t.pending;
+  t.npending <- t.npending + 1;
+  if t.npending >= t.group then flush t
+
+let append_batch t vs =
+  put_all t (List.rev_append t.pending vs);
+  t.pending <- [];
+  t.npending <- 0
+
+let close t =
+  flush t;
+  Otoky_fdb.close t.log;
+  HDB.close t.cursors
+
+(* a new consumer is registered at 0 straight away, so truncate keeps
+   every entry for it until it commits *)
+let consumer t name =
+  begin try HDB.putkeep t.cursors name "0"
+  with Error (Ekeep, _, _) -> () end;
+  let pos = Int64.of_string (HDB.get t.cursors name) in
+  { c_log = t; name = name; pos = pos }
+
+let position c = c.pos
+let seek c pos = c.pos <- pos
+
+let read c n =
+  let (ids, vals) = Otoky_fdb.range_values c.c_log.log ~lower:(Int64.succ c.pos) ~max:n () in
+  let len = Array.length vals in
+  if len > 0 then c.pos <- ids.{len - 1};
+  vals
+
+let commit c = HDB.put c.c_log.cursors c.name (Int64.to_string c.pos)
+
+let low_water t =
+  HDB.iterinit t.cursors;
+  let rec loop low =
+    match (try Some (HDB.iternext t.cursors) with Error (Enorec, _, _) -> None) with
+      | None -> low
+      | Some name ->
+          let pos = Int64.of_string (HDB.get t.cursors name) in
+          loop (match low with Some l when l <= pos -> low | _ -> Some pos) in
+  loop None
+
+let truncate t ?(max = 10000) () =
+  match low_water t with
+    | None -> 0
+    | Some low ->
+        (* the last consumed entry stays, so FDB's max id never drops
+           and ids are not reused *)
+        let upper = Int64.pred low in
+        if upper < 1L then 0
+        else begin
+          let ids = Otoky_fdb.range t.log ~upper ~max () in
+          Otoky_fdb.tranbegin t.log;
+          begin try Array.iter (Otoky_fdb.out t.log) ids
+          with e -> Otoky_fdb.tranabort t.log; raise e end;
+          Otoky_fdb.trancommit t.log;
+          Array.length ids
+        end
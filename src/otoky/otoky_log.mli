@@ -0,0 +1,43 @@
+open Tokyo_cabinet
+
+(* a durable log of 'v entries on an FDB, with ids from 1 in append
+   order. consumer positions are kept in an HDB at the path ^ ".cursors".
+   a log has one writer. *)
+type 'v t
+
+type 'v consumer
+
+(* appends are buffered and written group (default 1000) at a time in
+   one transaction *)
+val open_ : ?omode:omode list -> ?width:int32 -> ?group:int -> 'v Otoky_type.t -> string -> 'v t
+
+(* flushes pending appends *)
+val close : 'v t -> unit
+
+val append : 'v t -> 'v -> unit
+
+(* write the pending appends and these in one transaction *)
+val append_batch : 'v t -> 'v list -> unit
+
+val flush : 'v t -> unit
+
+(* a named consumer, at its committed position. a new one is
+   registered at 0, so truncate holds back for it from then on. *)
+val consumer : 'v t -> string -> 'v consumer
+
+(* the id of the last entry read *)
+val position : 'v consumer -> int64
+val seek : 'v consumer -> int64 -> unit
+
+(* up to n entries after the position, advancing it. unflushed appends
+   are not seen. *)
+val read : 'v consumer -> int -> 'v array
+
+(* persist the position; a consumer reopened after a crash resumes from
+   its last commit, so entries can be read twice but not lost *)
+val commit : 'v consumer -> unit
+
+(* remove up to max (default 10000) entries that every registered
+   consumer has committed past, keeping the last of them; returns the
+   number removed. with no consumers nothing is removed. *)
+val truncate : 'v t -> ?max:int -> unit -> int
@@ -0,0 +1,266 @@
+open Tokyo_cabinet
+
+type cursor =
+  | After of string * string * int (* order value, primary key, its place in the run of the value *)
+  | Skip of int
+
+type page = {
+  keys : string list;
+  cols : (string * string) list array;
+  next : cursor option;
+}
+
+let bad_cursor () = invalid_arg "Otoky_query.cursor_of_string"
+
+let string_of_cursor = function
+  | Skip n -> "s" ^ string_of_int n
+  | After (v, k, n) ->
+      let b = Buffer.create 64 in
+      Buffer.add_char b 'a';
+      List.iter
+        (fun s ->
+           Buffer.add_string b (string_of_int (String.length s));
+           Buffer.add_char b ':';
+           Buffer.add_string b s)
+        [ v; k; string_of_int n ];
+      Buffer.contents b
+
+let cursor_of_string s =
+  let len = String.length s in
+  let int_of s = try int_of_string s with Failure _ -> bad_cursor () in
+  if len = 0 then bad_cursor ();
+  match s.[0] with
+    | 's' -> Skip (int_of (String.sub s 1 (len - 1)))
+    | 'a' ->
+        let rec items i acc =
+          if i = len then List.rev acc
+          else
+            let c = try String.index_from s i ':' with Not_found -> bad_cursor () in
+            let n = int_of (String.sub s i (c - i)) in
+            if n < 0 || c + 1 + n > len then bad_cursor ();
+            items (c + 1 + n) (String.sub s (c + 1) n :: acc) in
+        begin match items 1 [] with
+          | [ v; k; n ] -> After (v, k, int_of n)
+          | [ v; k ] -> After (v, k, 0)
+          | _ -> bad_cursor ()
+        end
+    | _ -> bad_cursor ()
+
+(* TC compares numeric columns as doubles read by tcatof, which takes
+   the longest numeric prefix after blanks and reads none as 0 *)
+let num s =
+  let len = String.length s in
+  let rec blanks i = if i < len && s.[i] > '\000' && s.[i] <= ' ' then blanks (i + 1) else i in
+  let rec digits i = if i < len && s.[i] >= '0' && s.[i] <= '9' then digits (i + 1) else i in
+  let sign i =
+    if i < len && s.[i] = '-' then (-1., i + 1)
+    else if i < len && s.[i] = '+' then (1., i + 1)
+    else (1., i) in
+  let (sg, i) = sign (blanks 0) in
+  let starts w =
+    let n = String.length w in
+    i + n <= len && String.lowercase (String.sub s i n) = w in
+  if starts "inf" then sg *. infinity
+  else if starts "nan" then nan
+  else
+    let e = digits i in
+    let e = if e < len && s.[e] = '.' then digits (e + 1) else e in
+    let m = try float_of_string (String.sub s i (e - i)) with Failure _ -> 0. in
+    let m =
+      if e < len && (s.[e] = 'e' || s.[e] = 'E')
+      then
+        let (esg, j) = sign (blanks (e + 1)) in
+        let x = try int_of_string (String.sub s j (digits j - j)) with Failure _ -> 0 in
+        m *. 10. ** (esg *. float_of_int x)
+      else m in
+    sg *. m
+
+let rec take n = function
+  | [] -> []
+  | _ when n = 0 -> []
+  | x :: xs -> x :: take (n - 1) xs
+
+let last rows = List.nth rows (List.length rows - 1)
+
+let page tdb prepare ?order ?columns ?after size =
+  let keyset, col, qord =
+    match order with
+      | Some (col, (TDBQRY.Qo_numasc | TDBQRY.Qo_numdesc as qord)) -> true, col, qord
+      | Some (col, qord) -> false, col, qord
+      | None -> false, "", TDBQRY.Qo_strasc in
+  let columns =
+    match columns with
+      | Some cs when keyset && col <> "" && not (List.mem col cs) -> Some (col :: cs)
+      | cs -> cs in
+  let run cond order max skip =
+    let qry = TDBQRY.new_ tdb in
+    prepare qry;
+    cond qry;
+    begin match order with
+      | Some (col, qord) -> TDBQRY.setorder qry ~qord col
+      | None -> ()
+    end;
+    TDBQRY.setlimit qry ?max ~skip ();
+    let (keys, cols) = TDBQRY.search_get qry ?columns () in
+    List.combine keys (Array.to_list cols) in
+  let make rows next =
+    { keys = List.map fst rows; cols = Array.of_list (List.map snd rows); next = next } in
+  if not keyset
+  then begin
+    let skip =
+      match after with
+        | None -> 0
+        | Some (Skip n) -> n
+        | Some (After _) -> invalid_arg "Otoky_query.page" in
+    let rows = run ignore order (Some size) skip in
+    make rows (if List.length rows < size || rows = [] then None else Some (Skip (skip + size)))
+  end
+  else begin
+    (* records run in (order value, primary key) order. TC sorts on one
+       column only, so records sharing a value are sorted here. *)
+    let value (k, cs) = if col = "" then k else try List.assoc col cs with Not_found -> "" in
+    let same a b = compare (num a) (num b) = 0 in
+    let cmp a b =
+      let c = compare (num (value a)) (num (value b)) in
+      let c = if qord = TDBQRY.Qo_numasc then c else - c in
+      if c <> 0 then c else compare (fst a) (fst b) in
+    (* up to size records with order value v and primary key after k, in
+       primary key order, and how many of the run come before them. TC
+       has no condition for keys after k, so the query runs in key order
+       over a window of the run from n, the place k had in it: a window
+       starting past k means records before it went, so the run is read
+       from its start; one ending before k means records were added, so
+       the next window is read. *)
+    let ties v k n =
+      let window skip max =
+        run (fun qry -> TDBQRY.addcond qry col TDBQRY.Qc_numeq v) (Some ("", TDBQRY.Qo_strasc)) (Some max) skip in
+      let rec from skip =
+        let max = if n - skip > 0 then n - skip + size else size in
+        let rows = window skip max in
+        match rows with
+          | (k', _) :: _ when skip > 0 && k' > k -> from 0
+          | _ ->
+              let before = List.length (List.filter (fun (k', _) -> k' <= k) rows) in
+              if before = max
+              then from (skip + max)
+              else (skip + before, take size (List.filter (fun (k', _) -> k' > k) rows)) in
+      from (if n > size then n - size else 0) in
+    (* the cursor after the last row, whose place in its run counts the
+       rows of the run in the page and, if the page starts in that run,
+       the base records of the run before the page *)
+    let cursor base rows =
+      if rows = [] then None
+      else
+        let r = last rows in
+        let v = value r in
+        let run = List.length (List.filter (fun r' -> same (value r') v) rows) in
+        let base = if same (value (List.hd rows)) v then base else 0 in
+        Some (After (v, fst r, base + run)) in
+    let (base, tied), skip, beyond =
+      match after with
+        | None -> (0, []), 0, None
+        | Some (Skip n) -> (0, []), n, None
+        | Some (After (v, k, n)) -> ties v k n, 0, Some v in
+    let want = size - List.length tied in
+    if want <= 0
+    then make tied (cursor base tied)
+    else
+      let cond qry =
+        match beyond with
+          | None -> ()
+          | Some v ->
+              let op = if qord = TDBQRY.Qo_numasc then TDBQRY.Qc_numgt else TDBQRY.Qc_numlt in
+              TDBQRY.addcond qry col op v in
+      let rows = List.sort cmp (run cond order (Some want) skip) in
+      if List.length rows < want
+      then make (tied @ rows) None
+      else
+        (* the limit may cut the run of the last value anywhere, so that
+           run is left to the next page *)
+        let v = value (last rows) in
+        let rows = tied @ List.filter (fun r -> not (same (value r) v)) rows in
+        if rows <> []
+        then make rows (cursor base rows)
+        else
+          let (_, rows) = ties v "" 0 in
+          make rows (cursor 0 rows)
+  end
+
+let iter tdb prepare ?order ?columns ?(chunk = 1000) func =
+  let rec loop after =
+    let p = page tdb prepare ?order ?columns ?after chunk in
+    if p.keys <> [] && func p.keys p.cols
+    then match p.next with
+      | Some _ as after -> loop after
+      | None -> () in
+  loop None
+
+type arg = Lit of string | Param of int
+
+type cond = {
+  column : string;
+  negate : bool;
+  noidx : bool;
+  op : TDBQRY.qcond;
+  arg : arg;
+}
+
+type prepared = {
+  tdb : TDB.t;
+  conds : cond list;
+  order : (string * TDBQRY.qord) option;
+  max : int option;
+  skip : int option;
+  mutable pool : TDBQRY.t list;
+  mutable last_hint : string;
+}
+
+let cond ?(negate = false) ?(noidx = false) column op arg =
+  { column = column; negate = negate; noidx = noidx; op = op; arg = arg }
+
+let prepare tdb ?order ?max ?skip conds =
+  { tdb = tdb; conds = conds; order = order; max = max; skip = skip; pool = []; last_hint = "" }
+
+let build p =
+  let qry = TDBQRY.new_ p.tdb in
+  List.iter
+    (fun c ->
+       let expr = match c.arg with Lit s -> s | Param _ -> "" in
+       TDBQRY.addcond qry c.column ~negate:c.negate ~noidx:c.noidx c.op expr)
+    p.conds;
+  begin match p.order with
+    | Some (col, qord) -> TDBQRY.setorder qry ~qord col
+    | None -> ()
+  end;
+  TDBQRY.setlimit qry ?max:p.max ?skip:p.skip ();
+  qry
+
+(* taking from the pool does not allocate, so no other thread can run
+   between the read and the write; a race in give only drops a query
+   to the GC *)
+let take p =
+  match p.pool with
+    | qry :: rest -> p.pool <- rest; qry
+    | [] -> build p
+
+let give p qry = p.pool <- qry :: p.pool
+
+let bind p qry params =
+  let rec loop i = function
+    | [] -> ()
+    | { arg = Param n } :: conds -> TDBQRY.setexpr qry i params.(n); loop (i + 1) conds
+    | { arg = Lit _ } :: conds -> loop (i + 1) conds in
+  loop 0 p.conds
+
+let run p params func =
+  let qry = take p in
+  let r =
+    try bind p qry params; func qry
+    with e -> give p qry; raise e in
+  p.last_hint <- TDBQRY.hint qry;
+  give p qry;
+  r
+
+let search p params = run p params TDBQRY.search
+let search_get p ?columns params = run p params (fun qry -> TDBQRY.search_get qry ?columns ())
+let hint p = p.last_hint
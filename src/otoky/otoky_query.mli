@@ -0,0 +1,61 @@
+open Tokyo_cabinet
+
+(* a continuation token for paged queries. with a numeric order it
+   records the order value and primary key of the last record returned
+   (keyset pagination), records sharing a value running in primary key
+   order, and its place among them, so the rest of the run is read a
+   page at a time; otherwise it records a skip count. numbers compare
+   as TC reads them, by their longest numeric prefix. *)
+type cursor
+
+val string_of_cursor : cursor -> string
+
+(* raises Invalid_argument on a malformed token *)
+val cursor_of_string : string -> cursor
+
+type page = {
+  keys : string list;
+  cols : (string * string) list array;
+  next : cursor option;
+}
+
+(* run one page of a query. prepare adds conditions to a fresh query;
+   order is a column (or "" for the primary key) and direction. with a
+   numeric order, a page after a cursor starts from a range condition on
+   the order column, so deep pages cost the same as the first one when
+   the column is indexed; a page may come up short where the limit cuts
+   a run of equal values. columns projects the returned records; the
+   order column is added to them if missing. next is None on the last
+   page. *)
+val page :
+  TDB.t -> (TDBQRY.t -> unit) -> ?order:(string * TDBQRY.qord) -> ?columns:string list ->
+  ?after:cursor -> int -> page
+
+(* stream all results in chunks of up to chunk records (default 1000);
+   func returns false to stop. *)
+val iter :
+  TDB.t -> (TDBQRY.t -> unit) -> ?order:(string * TDBQRY.qord) -> ?columns:string list ->
+  ?chunk:int -> (string list -> (string * string) list array -> bool) -> unit
+
+(* prepared queries: conditions are added once, with Param n taking its
+   expression from the n'th element of the parameters at each run. query
+   objects are kept in a pool so each run reuses a built query. otoky
+   itself does not need threads, so the pool has no mutex; under OCaml's
+   runtime lock, threads running the same prepared query still each
+   take their own, since taking one from the pool does not allocate. *)
+type arg = Lit of string | Param of int
+
+type cond
+
+val cond : ?negate:bool -> ?noidx:bool -> string -> TDBQRY.qcond -> arg -> cond
+
+type prepared
+
+val prepare :
+  TDB.t -> ?order:(string * TDBQRY.qord) -> ?max:int -> ?skip:int -> cond list -> prepared
+
+val search : prepared -> string array -> string list
+val search_get : prepared -> ?columns:string list -> string array -> string list * (string * string) list array
+
+(* the planner hint of the last run, showing which index was used *)
+val hint : prepared -> string
@@ -0,0 +1,437 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+module Type =
+struct
+  include Otoky_type
+
+  let type_desc_hash_key = "__otoky_type_desc_hash__"
+
+  let is_type_desc_hash_key k klen =
+    if klen <> String.length type_desc_hash_key
+    then false
+    else
+      let rec loop i =
+        if i = klen then true
+        else if String.unsafe_get k i <> String.unsafe_get type_desc_hash_key i then false
+        else loop (i + 1) in
+      loop 0
+
+  let marshall_key t k func =
+    let (k, klen) as mk = t.marshall k in
+    if is_type_desc_hash_key k klen
+    then raise (Error (Einvalid, func, "marshalled value is type_desc_hash key"))
+    else mk
+
+  let unmarshall_tclist t tclist =
+    try
+      let num = Tclist.num tclist in
+      let len = ref 0 in
+      let rec loop k =
+        if k = num
+        then []
+        else
+          let v = Tclist.val_ tclist k len in
+          if is_type_desc_hash_key v !len
+          then loop (k + 1)
+          else
+            let v = t.unmarshall (v, !len) in
+            v :: loop (k + 1) in
+      let r = loop 0 in
+      Tclist.del tclist;
+      r
+    with e -> Tclist.del tclist; raise e
+end
+
+module TDB_raw = TDB.Fun (Cstr_cstr) (Tclist_tclist) (Tcmap_tcmap)
+module TDBQRY_raw = TDBQRY.Fun (Tclist_tclist) (Tcmap_tcmap)
+
+(* how a record field is stored in its column *)
+type kind =
+  | K_int | K_int32 | K_int64 | K_float | K_bool | K_char | K_string
+  | K_unit (* no column *)
+  | K_marshal
+
+type column = {
+  name : string;
+  desc : Type_desc.s;
+  kind : kind;
+  optional : bool; (* an option of a scalar; None is an absent column *)
+}
+
+type schema = {
+  columns : column array;
+  flat : bool; (* all fields are float, so the record is a float array *)
+}
+
+type ('k, 'r) t = {
+  tdb : TDB.t;
+  ktype : 'k Type.t;
+  schema : schema;
+}
+
+type ('r, 'a) field = {
+  f_column : column;
+}
+
+type 'r row = {
+  r_schema : schema;
+  r_map : Tcmap.t;
+  r_columns : string list option; (* the columns fetched, if not all *)
+}
+
+type 'r cond = {
+  c_column : string;
+  c_negate : bool;
+  c_op : TDBQRY.qcond;
+  c_expr : string;
+}
+
+type 'r order = string * TDBQRY.qord
+
+module Td =
+struct
+  let unit : unit Type_desc.t = Type_desc.hide Type_desc.Unit
+  let int : int Type_desc.t = Type_desc.hide Type_desc.Int
+  let int32 : int32 Type_desc.t = Type_desc.hide Type_desc.Int32
+  let int64 : int64 Type_desc.t = Type_desc.hide Type_desc.Int64
+  let float : float Type_desc.t = Type_desc.hide Type_desc.Float
+  let bool : bool Type_desc.t = Type_desc.hide Type_desc.Bool
+  let char : char Type_desc.t = Type_desc.hide Type_desc.Char
+  let string : string Type_desc.t = Type_desc.hide Type_desc.String
+  let option (td : 'a Type_desc.t) : 'a option Type_desc.t =
+    Type_desc.hide (Type_desc.Option (Type_desc.show td))
+end
+
+let rec strip = function
+  | Type_desc.Project (i, Type_desc.Bundle ts) -> strip (List.nth ts i)
+  | s -> s
+
+let kind_of_desc = function
+  | Type_desc.Unit -> K_unit
+  | Type_desc.Int -> K_int
+  | Type_desc.Int32 -> K_int32
+  | Type_desc.Int64 -> K_int64
+  | Type_desc.Float -> K_float
+  | Type_desc.Bool -> K_bool
+  | Type_desc.Char -> K_char
+  | Type_desc.String -> K_string
+  | _ -> K_marshal
+
+let is_scalar = function
+  | K_unit | K_marshal -> false
+  | _ -> true
+
+let is_numeric = function
+  | K_int | K_int32 | K_int64 | K_float | K_bool -> true
+  | _ -> false
+
+let column_of_field (name, desc) =
+  match desc with
+    | Type_desc.Option d when is_scalar (kind_of_desc d) ->
+        { name = name; desc = desc; kind = kind_of_desc d; optional = true }
+    | _ ->
+        { name = name; desc = desc; kind = kind_of_desc desc; optional = false }
+
+let schema_of_desc func rtype =
+  match strip (Type_desc.show rtype) with
+    | Type_desc.Record fields ->
+        let columns = Array.of_list (List.map column_of_field fields) in
+        {
+          columns = columns;
+          flat =
+            Array.length columns > 0 &&
+            List.for_all (fun c -> c.desc = Type_desc.Float) (Array.to_list columns);
+        }
+    | _ -> raise (Error (Einvalid, func, "not a record type"))
+
+(* scalars are stored in a form TC can compare and index: numbers in
+   decimal, bools as 1/0, strings raw *)
+let encode_scalar kind (v : Obj.t) =
+  match kind with
+    | K_int -> string_of_int (Obj.obj v)
+    | K_int32 -> Int32.to_string (Obj.obj v)
+    | K_int64 -> Int64.to_string (Obj.obj v)
+    | K_float -> Printf.sprintf "%.17g" (Obj.obj v)
+    | K_bool -> if Obj.obj v then "1" else "0"
+    | K_char -> String.make 1 (Obj.obj v)
+    | K_string -> Obj.obj v
+    | K_unit -> ""
+    | K_marshal -> Marshal.to_string v []
+
+let decode_scalar func kind s : Obj.t =
+  try
+    match kind with
+      | K_int -> Obj.repr (int_of_string s)
+      | K_int32 -> Obj.repr (Int32.of_string s)
+      | K_int64 -> Obj.repr (Int64.of_string s)
+      | K_float -> Obj.repr (float_of_string s)
+      | K_bool -> Obj.repr (s = "1")
+      | K_char -> Obj.repr s.[0]
+      | K_string -> Obj.repr s
+      | K_unit -> Obj.repr ()
+      | K_marshal -> Marshal.from_string s 0
+  with Failure _ | Invalid_argument _ ->
+    raise (Error (Emisc, func, "bad column value"))
+
+let encode_column col v =
+  if col.optional
+  then (if Obj.is_int v then None else Some (encode_scalar col.kind (Obj.field v 0)))
+  else if col.kind = K_unit then None
+  else Some (encode_scalar col.kind v)
+
+let decode_column func col = function
+  | None when col.optional -> Obj.repr None
+  | None when col.kind = K_unit -> Obj.repr ()
+  | None -> raise (Error (Emisc, func, "missing column " ^ col.name))
+  | Some s when col.optional -> Obj.repr (Some (decode_scalar func col.kind s))
+  | Some s -> decode_scalar func col.kind s
+
+let get_field schema r i =
+  if schema.flat
+  then Obj.repr ((Obj.magic r : float array).(i))
+  else Obj.field (Obj.repr r) i
+
+let find_column tcmap col =
+  try Some (Tcmap.copy_get tcmap col.name (String.length col.name))
+  with Not_found -> None
+
+let tcmap_of_record schema r =
+  let tcmap = Tcmap.new_ () in
+  try
+    Array.iteri
+      (fun i col ->
+         match encode_column col (get_field schema r i) with
+           | Some s -> Tcmap.put tcmap col.name (String.length col.name) s (String.length s)
+           | None -> ())
+      schema.columns;
+    tcmap
+  with e -> Tcmap.del tcmap; raise e
+
+let record_of_tcmap func schema tcmap =
+  let n = Array.length schema.columns in
+  if schema.flat
+  then begin
+    let a = Array.make n 0. in
+    Array.iteri
+      (fun i col -> a.(i) <- Obj.obj (decode_column func col (find_column tcmap col)))
+      schema.columns;
+    Obj.magic a
+  end else begin
+    let b = Obj.new_block 0 n in
+    Array.iteri
+      (fun i col -> Obj.set_field b i (decode_column func col (find_column tcmap col)))
+      schema.columns;
+    Obj.obj b
+  end
+
+let open_ ?omode ktype rtype fn =
+  let schema = schema_of_desc "open_" rtype in
+  let tdb = TDB.new_ () in
+  TDB.open_ tdb ?omode fn;
+  let hash = Type.type_desc_hash ktype ^ Digest.to_hex (Digest.string (Type_desc.to_string rtype)) in
+  begin try
+    if hash <> List.assoc "hash" (TDB.get tdb Type.type_desc_hash_key)
+    then begin
+      TDB.close tdb;
+      raise (Error (Einvalid, "open_", "bad type_desc hash"))
+    end
+  with
+    | Error (Enorec, _, _) | Not_found ->
+        TDB.put tdb Type.type_desc_hash_key [ "hash", hash ]
+  end;
+  {
+    tdb = tdb;
+    ktype = ktype;
+    schema = schema;
+  }
+
+let close t = TDB.close t.tdb
+
+let field t name (td : 'a Type_desc.t) : ('r, 'a) field =
+  let columns = t.schema.columns in
+  let rec loop i =
+    if i = Array.length columns
+    then raise (Error (Einvalid, "field", "no field " ^ name))
+    else if columns.(i).name <> name then loop (i + 1)
+    else if not (Type_desc.equal (Type_desc.hide columns.(i).desc) td)
+    then raise (Error (Einvalid, "field", "wrong type for field " ^ name))
+    else { f_column = columns.(i) } in
+  loop 0
+
+let field_name f = f.f_column.name
+
+let get t k =
+  let tcmap = TDB_raw.get t.tdb (Type.marshall_key t.ktype k "get") in
+  try
+    let r = record_of_tcmap "get" t.schema tcmap in
+    Tcmap.del tcmap;
+    r
+  with e -> Tcmap.del tcmap; raise e
+
+let make_row schema columns tcmap =
+  let row = { r_schema = schema; r_map = tcmap; r_columns = columns } in
+  Gc.finalise (fun row -> Tcmap.del row.r_map) row;
+  row
+
+let get_row t k =
+  make_row t.schema None (TDB_raw.get t.tdb (Type.marshall_key t.ktype k "get_row"))
+
+(* an absent column of a row fetched without it is not a None *)
+let check_fetched func row col =
+  match row.r_columns with
+    | Some names when col.kind <> K_unit && not (List.mem col.name names) ->
+        raise (Error (Emisc, func, "column " ^ col.name ^ " not fetched"))
+    | _ -> ()
+
+let row_get row (f : ('r, 'a) field) : 'a =
+  check_fetched "row_get" row f.f_column;
+  Obj.obj (decode_column "row_get" f.f_column (find_column row.r_map f.f_column))
+
+let row_record row =
+  Array.iter (check_fetched "row_record" row) row.r_schema.columns;
+  record_of_tcmap "row_record" row.r_schema row.r_map
+
+let iterinit t = TDB.iterinit t.tdb
+
+let iternext t =
+  let (k, klen) as cstr = TDB_raw.iternext t.tdb in
+  let cstr =
+    if Type.is_type_desc_hash_key k klen
+    then (Cstr.del cstr; TDB_raw.iternext t.tdb)
+    else cstr in
+  let k = t.ktype.Type.unmarshall cstr in
+  Cstr.del cstr;
+  k
+
+let out t k = TDB_raw.out t.tdb (Type.marshall_key t.ktype k "out")
+let path t = TDB.path t.tdb
+
+let store func t k r =
+  let tcmap = tcmap_of_record t.schema r in
+  try
+    func t.tdb (Type.marshall_key t.ktype k "put") tcmap;
+    Tcmap.del tcmap
+  with e -> Tcmap.del tcmap; raise e
+
+let put t k r = store TDB_raw.put t k r
+let putkeep t k r = store TDB_raw.putkeep t k r
+
+let rnum t = TDB.rnum t.tdb
+let sync t = TDB.sync t.tdb
+let tranabort t = TDB.tranabort t.tdb
+let tranbegin t = TDB.tranbegin t.tdb
+let trancommit t = TDB.trancommit t.tdb
+
+let vanish t =
+  let hash = TDB.get t.tdb Type.type_desc_hash_key in
+  TDB.vanish t.tdb;
+  TDB.put t.tdb Type.type_desc_hash_key hash
+
+(* indexes *)
+
+let itype_of_column func col =
+  match col.kind with
+    | K_int | K_int32 | K_int64 | K_float | K_bool -> TDB.It_decimal
+    | K_char | K_string -> TDB.It_lexical
+    | K_unit | K_marshal -> raise (Error (Einvalid, func, "field " ^ col.name ^ " cannot be indexed"))
+
+let index t ?keep f = TDB.setindex t.tdb f.f_column.name ?keep (itype_of_column "index" f.f_column)
+
+let index_build t ?step ?progress f =
+  TDB.index_build t.tdb ?step ?progress f.f_column.name (itype_of_column "index_build" f.f_column)
+
+let drop_index t f = TDB.setindex t.tdb f.f_column.name TDB.It_void
+
+(* queries *)
+
+let expr func f (v : 'a) =
+  let col = f.f_column in
+  if not (is_scalar col.kind)
+  then raise (Error (Einvalid, func, "field " ^ col.name ^ " cannot be queried"));
+  match encode_column col (Obj.repr v) with
+    | Some s -> s
+    | None -> raise (Error (Einvalid, func, "no value to compare"))
+
+let numeric func f =
+  if not (is_numeric f.f_column.kind)
+  then raise (Error (Einvalid, func, "field " ^ f.f_column.name ^ " is not numeric"))
+
+let cond f op e = { c_column = f.f_column.name; c_negate = false; c_op = op; c_expr = e }
+
+let eq f v =
+  let e = expr "eq" f v in
+  cond f (if is_numeric f.f_column.kind then TDBQRY.Qc_numeq else TDBQRY.Qc_streq) e
+
+(* TC splits the values at commas and spaces *)
+let one_of f vs =
+  let value v =
+    let e = expr "one_of" f v in
+    if String.contains e ',' || String.contains e ' '
+    then raise (Error (Einvalid, "one_of", "value contains a comma or space"));
+    e in
+  let e = String.concat "," (List.map value vs) in
+  cond f (if is_numeric f.f_column.kind then TDBQRY.Qc_numoreq else TDBQRY.Qc_stroreq) e
+
+let compare_cond func op f v =
+  numeric func f;
+  cond f op (expr func f v)
+
+let lt f v = compare_cond "lt" TDBQRY.Qc_numlt f v
+let le f v = compare_cond "le" TDBQRY.Qc_numle f v
+let gt f v = compare_cond "gt" TDBQRY.Qc_numgt f v
+let ge f v = compare_cond "ge" TDBQRY.Qc_numge f v
+
+let between f lo hi =
+  numeric "between" f;
+  cond f TDBQRY.Qc_numbt (expr "between" f lo ^ " " ^ expr "between" f hi)
+
+let prefix f s =
+  if f.f_column.kind <> K_string
+  then raise (Error (Einvalid, "prefix", "field " ^ f.f_column.name ^ " is not a string"));
+  cond f TDBQRY.Qc_strbw s
+
+let not_ c = { c with c_negate = not c.c_negate }
+
+let asc f = (f.f_column.name, if is_numeric f.f_column.kind then TDBQRY.Qo_numasc else TDBQRY.Qo_strasc)
+let desc f = (f.f_column.name, if is_numeric f.f_column.kind then TDBQRY.Qo_numdesc else TDBQRY.Qo_strdesc)
+
+let query t ?order ?max ?skip conds =
+  let qry = TDBQRY.new_ t.tdb in
+  (* keep the type_desc hash record out of matches, negated conditions,
+     searchout and the counts of max and skip; "" is the primary key *)
+  TDBQRY.addcond qry "" ~negate:true TDBQRY.Qc_streq Type.type_desc_hash_key;
+  List.iter
+    (fun c -> TDBQRY.addcond qry c.c_column ~negate:c.c_negate c.c_op c.c_expr)
+    conds;
+  begin match order with
+    | Some (col, qord) -> TDBQRY.setorder qry ~qord col
+    | None -> ()
+  end;
+  TDBQRY.setlimit qry ?max ?skip ();
+  qry
+
+let search t ?order ?max ?skip conds =
+  Type.unmarshall_tclist t.ktype (TDBQRY_raw.search (query t ?order ?max ?skip conds))
+
+let search_rows t ?order ?max ?skip ?columns conds =
+  let (keys, maps) = TDBQRY_raw.search_get (query t ?order ?max ?skip conds) ?columns () in
+  (* rows own their maps from here on *)
+  let rows = Array.map (make_row t.schema columns) maps in
+  let len = ref 0 in
+  let rec loop i =
+    if i = Array.length rows then []
+    else
+      let k = Tclist.val_ keys i len in
+      if Type.is_type_desc_hash_key k !len
+      then loop (i + 1)
+      else
+        let k = t.ktype.Type.unmarshall (k, !len) in
+        (k, rows.(i)) :: loop (i + 1) in
+  let r =
+    try loop 0
+    with e -> Tclist.del keys; raise e in
+  Tclist.del keys;
+  r
+
+let searchout t conds = TDBQRY.searchout (query t conds)
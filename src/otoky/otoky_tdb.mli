@@ -0,0 +1,98 @@
+open Tokyo_cabinet
+
+(* a table database holding records of one OCaml record type. each field
+   is a column: ints, floats and bools are stored in decimal (bools as
+   1/0), chars and strings raw, an option of one of these as an absent
+   column when None, and any other field type marshalled. *)
+type ('k, 'r) t
+
+(* a field of records 'r with type 'a *)
+type ('r, 'a) field
+
+(* a stored record whose columns are decoded only when accessed *)
+type 'r row
+
+type 'r cond
+type 'r order
+
+(* the type_descs of field types, for field *)
+module Td :
+sig
+  val unit : unit Type_desc.t
+  val int : int Type_desc.t
+  val int32 : int32 Type_desc.t
+  val int64 : int64 Type_desc.t
+  val float : float Type_desc.t
+  val bool : bool Type_desc.t
+  val char : char Type_desc.t
+  val string : string Type_desc.t
+  val option : 'a Type_desc.t -> 'a option Type_desc.t
+end
+
+(* the record type_desc must describe a record type; raises Error
+   (Einvalid, ...) otherwise, or if the file holds another type *)
+val open_ : ?omode:omode list -> 'k Otoky_type.t -> 'r Type_desc.t -> string -> ('k, 'r) t
+
+val close : ('k, 'r) t -> unit
+
+(* look up a field by name, checking its type against the type_desc *)
+val field : ('k, 'r) t -> string -> 'a Type_desc.t -> ('r, 'a) field
+val field_name : ('r, 'a) field -> string
+
+val get : ('k, 'r) t -> 'k -> 'r
+val get_row : ('k, 'r) t -> 'k -> 'r row
+val iterinit : ('k, 'r) t -> unit
+val iternext : ('k, 'r) t -> 'k
+val out : ('k, 'r) t -> 'k -> unit
+val path : ('k, 'r) t -> string
+val put : ('k, 'r) t -> 'k -> 'r -> unit
+val putkeep : ('k, 'r) t -> 'k -> 'r -> unit
+val rnum : ('k, 'r) t -> int64
+val sync : ('k, 'r) t -> unit
+val tranabort : ('k, 'r) t -> unit
+val tranbegin : ('k, 'r) t -> unit
+val trancommit : ('k, 'r) t -> unit
+val vanish : ('k, 'r) t -> unit
+
+(* raises Error (Emisc, ...) for a field whose column the row was not
+   fetched with *)
+val row_get : 'r row -> ('r, 'a) field -> 'a
+
+(* decode the whole record; raises Error (Emisc, ...) if the row was
+   fetched with only some columns *)
+val row_record : 'r row -> 'r
+
+(* indexes take their type from the field: decimal for numbers and
+   bools, lexical for chars and strings. marshalled fields cannot be
+   indexed. index_build builds incrementally, as TDB.index_build. *)
+val index : ('k, 'r) t -> ?keep:bool -> ('r, 'a) field -> unit
+val index_build : ('k, 'r) t -> ?step:int -> ?progress:(int64 -> int64 -> unit) -> ('r, 'a) field -> unit
+val drop_index : ('k, 'r) t -> ('r, 'a) field -> unit
+
+(* conditions on scalar fields. TC compares numbers as doubles, so int64
+   values past 2^53 compare approximately. the comparisons need a
+   numeric field and prefix a string field; a None value raises Error
+   (Einvalid, ...). TC splits the values of one_of at commas and
+   spaces, so a value containing either raises Error (Einvalid, ...). *)
+val eq : ('r, 'a) field -> 'a -> 'r cond
+val one_of : ('r, 'a) field -> 'a list -> 'r cond
+val lt : ('r, 'a) field -> 'a -> 'r cond
+val le : ('r, 'a) field -> 'a -> 'r cond
+val gt : ('r, 'a) field -> 'a -> 'r cond
+val ge : ('r, 'a) field -> 'a -> 'r cond
+val between : ('r, 'a) field -> 'a -> 'a -> 'r cond
+val prefix : ('r, string) field -> string -> 'r cond
+val not_ : 'r cond -> 'r cond
+
+val asc : ('r, 'a) field -> 'r order
+val desc : ('r, 'a) field -> 'r order
+
+val search : ('k, 'r) t -> ?order:'r order -> ?max:int -> ?skip:int -> 'r cond list -> 'k list
+
+(* search returning the matching rows, with only the named columns if
+   columns is given *)
+val search_rows :
+  ('k, 'r) t -> ?order:'r order -> ?max:int -> ?skip:int -> ?columns:string list ->
+  'r cond list -> ('k * 'r row) list
+
+val searchout : ('k, 'r) t -> 'r cond list -> unit
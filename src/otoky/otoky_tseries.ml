@@ -0,0 +1,376 @@
+open Tokyo_cabinet
+
+(* keys are the series id and block start, each 8 bytes big-endian with
+   the sign bit flipped, so the default lexical order sorts them as
+   (int64, int64) *)
+let put_int64 s off v =
+  let v = Int64.logxor v Int64.min_int in
+  for i = 0 to 7 do
+    s.[off + i] <- Char.unsafe_chr (Int64.to_int (Int64.shift_right_logical v (56 - 8 * i)) land 0xff)
+  done
+
+let get_int64 s off =
+  let rec loop i v =
+    if i = 8 then Int64.logxor v Int64.min_int
+    else loop (i + 1) (Int64.logor (Int64.shift_left v 8) (Int64.of_int (Char.code s.[off + i]))) in
+  loop 0 0L
+
+let key id ts =
+  let s = String.create 16 in
+  put_int64 s 0 id;
+  put_int64 s 8 ts;
+  s
+
+(* blocks are a bit stream: the point count (32 bits), the last
+   timestamp and the first point (64 bits each), then each further
+   point as a delta-of-delta timestamp and a value XORed with the
+   previous one *)
+type bitw = {
+  b : Buffer.t;
+  mutable acc : int;
+  mutable nacc : int;
+}
+
+(* the low n bits of v, n <= 64 *)
+let write w v n =
+  let n = ref n in
+  while !n > 0 do
+    let k = min !n (8 - w.nacc) in
+    let bits = Int64.to_int (Int64.shift_right_logical v (!n - k)) land (1 lsl k - 1) in
+    w.acc <- (w.acc lsl k) lor bits;
+    w.nacc <- w.nacc + k;
+    n := !n - k;
+    if w.nacc = 8
+    then begin
+      Buffer.add_char w.b (Char.unsafe_chr w.acc);
+      w.acc <- 0;
+      w.nacc <- 0
+    end
+  done
+
+let write_int w v n = write w (Int64.of_int v) n
+
+let contents w =
+  if w.nacc > 0 then Buffer.add_char w.b (Char.unsafe_chr (w.acc lsl (8 - w.nacc)));
+  Buffer.contents w.b
+
+type bitr = {
+  s : string;
+  mutable bit : int;
+}
+
+let read r n =
+  let v = ref 0L and n = ref n in
+  while !n > 0 do
+    let off = r.bit land 7 in
+    let k = min !n (8 - off) in
+    let bits = (Char.code r.s.[r.bit lsr 3] lsr (8 - off - k)) land (1 lsl k - 1) in
+    v := Int64.logor (Int64.shift_left !v k) (Int64.of_int bits);
+    r.bit <- r.bit + k;
+    n := !n - k
+  done;
+  !v
+
+let read_int r n = Int64.to_int (read r n)
+
+let read_bit r =
+  let b = (Char.code r.s.[r.bit lsr 3] lsr (7 - r.bit land 7)) land 1 in
+  r.bit <- r.bit + 1;
+  b = 1
+
+let sign_extend v n = Int64.shift_right (Int64.shift_left v (64 - n)) (64 - n)
+
+let fits v n =
+  let half = Int64.shift_left 1L (n - 1) in
+  v >= Int64.neg half && v < half
+
+let clz x =
+  let rec loop n =
+    if n = 64 || Int64.logand x (Int64.shift_left 1L (63 - n)) <> 0L then n
+    else loop (n + 1) in
+  loop 0
+
+let ctz x =
+  let rec loop n =
+    if n = 64 || Int64.logand x (Int64.shift_left 1L n) <> 0L then n
+    else loop (n + 1) in
+  loop 0
+
+let encode ts vs n =
+  let w = { b = Buffer.create (16 + 2 * n); acc = 0; nacc = 0 } in
+  write_int w n 32;
+  write w ts.(n - 1) 64;
+  write w ts.(0) 64;
+  write w (Int64.bits_of_float vs.(0)) 64;
+  let delta = ref 0L in
+  let prev = ref (Int64.bits_of_float vs.(0)) in
+  let lead = ref (-1) and trail = ref 0 in
+  for i = 1 to n - 1 do
+    let d = Int64.sub ts.(i) ts.(i - 1) in
+    let dod = Int64.sub d !delta in
+    delta := d;
+    if dod = 0L then write_int w 0 1
+    else if fits dod 7 then (write_int w 0b10 2; write w dod 7)
+    else if fits dod 9 then (write_int w 0b110 3; write w dod 9)
+    else if fits dod 12 then (write_int w 0b1110 4; write w dod 12)
+    else (write_int w 0b1111 4; write w dod 64);
+    let bits = Int64.bits_of_float vs.(i) in
+    let x = Int64.logxor bits !prev in
+    prev := bits;
+    if x = 0L then write_int w 0 1
+    else begin
+      let l = min 31 (clz x) and t = ctz x in
+      if !lead >= 0 && l >= !lead && t >= !trail
+      then begin
+        write_int w 0b10 2;
+        write w (Int64.shift_right_logical x !trail) (64 - !lead - !trail)
+      end else begin
+        let len = 64 - l - t in
+        write_int w 0b11 2;
+        write_int w l 5;
+        write_int w (len - 1) 6;
+        write w (Int64.shift_right_logical x t) len;
+        lead := l;
+        trail := t
+      end
+    end
+  done;
+  contents w
+
+let last_of s = read { s = s; bit = 32 } 64
+
+let decode s =
+  let r = { s = s; bit = 0 } in
+  let n = read_int r 32 in
+  ignore (read r 64);
+  let ts = Array.make n 0L and vs = Array.make n 0. in
+  ts.(0) <- read r 64;
+  let prev = ref (read r 64) in
+  vs.(0) <- Int64.float_of_bits !prev;
+  let delta = ref 0L in
+  let lead = ref 0 and trail = ref 0 in
+  for i = 1 to n - 1 do
+    let dod =
+      if not (read_bit r) then 0L
+      else if not (read_bit r) then sign_extend (read r 7) 7
+      else if not (read_bit r) then sign_extend (read r 9) 9
+      else if not (read_bit r) then sign_extend (read r 12) 12
+      else read r 64 in
+    delta := Int64.add !delta dod;
+    ts.(i) <- Int64.add ts.(i - 1) !delta;
+    if read_bit r
+    then begin
+      if read_bit r
+      then begin
+        lead := read_int r 5;
+        trail := 64 - !lead - (read_int r 6 + 1)
+      end;
+      let x = Int64.shift_left (read r (64 - !lead - !trail)) !trail in
+      prev := Int64.logxor !prev x
+    end;
+    vs.(i) <- Int64.float_of_bits !prev
+  done;
+  (ts, vs)
+
+type series = {
+  id : int64;
+  mutable ts : int64 array; (* the open block, allocated at the first append *)
+  mutable vs : float array;
+  mutable n : int;
+  mutable started : bool;
+  mutable last : int64;
+  mutable dirty : bool; (* open block changed since the last flush *)
+  mutable active : bool; (* appended to since the last flush *)
+}
+
+type t = {
+  bdb : BDB.t;
+  block : int;
+  group : int;
+  series : (int64, series) Hashtbl.t;
+  mutable appended : series list; (* the series with active set *)
+  mutable full : (string * string) list; (* filled blocks to write, newest first *)
+  mutable npending : int;
+}
+
+let open_ ?omode ?(block = 1024) ?(group = 10000) fn =
+  if block < 1 then raise (Error (Einvalid, "open_", "block must be positive"));
+  let bdb = BDB.new_ () in
+  BDB.open_ bdb ?omode fn;
+  {
+    bdb = bdb;
+    block = block;
+    group = group;
+    series = Hashtbl.create 64;
+    appended = [];
+    full = [];
+    npending = 0;
+  }
+
+(* move cur to the last block of series id starting at or before ts *)
+let seek cur id ts =
+  let k = key id ts in
+  let found =
+    match (try BDBCUR.jump cur k; Some (BDBCUR.key cur) with Error (Enorec, _, _) -> None) with
+      | Some k' when k' = k -> true
+      | Some _ -> (try BDBCUR.prev cur; true with Error (Enorec, _, _) -> false)
+      | None -> (try BDBCUR.last cur; true with Error (Enorec, _, _) -> false) in
+  found && get_int64 (BDBCUR.key cur) 0 = id
+
+(* the series buffer, resuming the last stored block if it has room *)
+let load t id =
+  try Hashtbl.find t.series id
+  with Not_found ->
+    let s = {
+      id = id;
+      ts = [||];
+      vs = [||];
+      n = 0;
+      started = false;
+      last = 0L;
+      dirty = false;
+      active = false;
+    } in
+    let cur = BDBCUR.new_ t.bdb in
+    if seek cur id Int64.max_int
+    then begin
+      let (ts, vs) = decode (BDBCUR.val_ cur) in
+      let n = Array.length ts in
+      if n < t.block
+      then begin
+        s.ts <- Array.make t.block 0L;
+        s.vs <- Array.make t.block 0.;
+        Array.blit ts 0 s.ts 0 n;
+        Array.blit vs 0 s.vs 0 n;
+        s.n <- n
+      end;
+      s.started <- true;
+      s.last <- ts.(n - 1)
+    end;
+    Hashtbl.add t.series id s;
+    s
+
+(* series not appended to since the last flush are stored in full, so
+   they are dropped, to be loaded again by their next append *)
+let flush t =
+  if t.npending > 0
+  then begin
+    BDB.tranbegin t.bdb;
+    begin try
+      List.iter (fun (k, v) -> BDB.put t.bdb k v) (List.rev t.full);
+      List.iter
+        (fun s -> if s.dirty then BDB.put t.bdb (key s.id s.ts.(0)) (encode s.ts s.vs s.n))
+        t.appended
+    with e -> BDB.tranabort t.bdb; raise e end;
+    BDB.trancommit t.bdb;
+    let idle = Hashtbl.fold (fun id s ids -> if s.active then ids else id :: ids) t.series [] in
+    List.iter (Hashtbl.remove t.series) idle;
+    List.iter (fun s -> s.dirty <- false; s.active <- false) t.appended;
+    t.appended <- [];
+    t.full <- [];
+    t.npending <- 0
+  end
+
+let append t id ts v =
+  let s = load t id in
+  if s.started && ts <= s.last
+  then raise (Error (Einvalid, "append", "timestamp not after the last of the series"));
+  if Array.length s.ts = 0
+  then begin
+    s.ts <- Array.make t.block 0L;
+    s.vs <- Array.make t.block 0.
+  end;
+  if not s.active then t.appended <- s :: t.appended;
+  s.ts.(s.n) <- ts;
+  s.vs.(s.n) <- v;
+  s.n <- s.n + 1;
+  s.started <- true;
+  s.last <- ts;
+  s.dirty <- true;
+  s.active <- true;
+  if s.n = t.block
+  then begin
+    t.full <- (key id s.ts.(0), encode s.ts s.vs s.n) :: t.full;
+    s.n <- 0;
+    s.dirty <- false
+  end;
+  t.npending <- t.npending + 1;
+  if t.npending >= t.group then flush t
+
+let close t =
+  flush t;
+  BDB.close t.bdb
+
+let iter t id ?(lower = Int64.min_int) ?(upper = Int64.max_int) func =
+  let cur = BDBCUR.new_ t.bdb in
+  let start =
+    seek cur id lower ||
+      (* no block starts at or before lower; start from the first *)
+      (try BDBCUR.jump cur (key id lower); get_int64 (BDBCUR.key cur) 0 = id
+       with Error (Enorec, _, _) -> false) in
+  let rec loop () =
+    let k = BDBCUR.key cur in
+    if get_int64 k 0 = id && get_int64 k 8 <= upper
+    then begin
+      let blk = BDBCUR.val_ cur in
+      if last_of blk >= lower
+      then begin
+        let (ts, vs) = decode blk in
+        Array.iteri
+          (fun i ts -> if ts >= lower && ts <= upper then func ts vs.(i))
+          ts
+      end;
+      if (try BDBCUR.next cur; true with Error (Enorec, _, _) -> false) then loop ()
+    end in
+  if start then loop ()
+
+let range t id ?lower ?upper () =
+  let tss = ref [] and vss = ref [] in
+  iter t id ?lower ?upper (fun ts v -> tss := ts :: !tss; vss := v :: !vss);
+  (Array.of_list (List.rev !tss), Array.of_list (List.rev !vss))
+
+type agg = Count | Sum | Mean | Min | Max | First | Last
+
+let downsample t id ?lower ?upper ~step agg =
+  if step <= 0L then raise (Error (Einvalid, "downsample", "step must be positive"));
+  let bucket ts =
+    let q = Int64.div ts step in
+    Int64.mul (if Int64.rem ts step < 0L then Int64.pred q else q) step in
+  let starts = ref [] and vals = ref [] in
+  let cur = ref 0L and count = ref 0 and sum = ref 0. in
+  let min = ref 0. and max = ref 0. and first = ref 0. and last = ref 0. in
+  let emit () =
+    if !count > 0
+    then begin
+      let v =
+        match agg with
+          | Count -> float_of_int !count
+          | Sum -> !sum
+          | Mean -> !sum /. float_of_int !count
+          | Min -> !min
+          | Max -> !max
+          | First -> !first
+          | Last -> !last in
+      starts := !cur :: !starts;
+      vals := v :: !vals
+    end in
+  iter t id ?lower ?upper
+    (fun ts v ->
+       let b = bucket ts in
+       if !count = 0 || b <> !cur
+       then begin
+         emit ();
+         cur := b;
+         count := 0;
+         sum := 0.;
+         min := v;
+         max := v;
+         first := v
+       end;
+       incr count;
+       sum := !sum +. v;
+       if v < !min then min := v;
+       if v > !max then max := v;
+       last := v);
+  emit ();
+  (Array.of_list (List.rev !starts), Array.of_list (List.rev !vals))
@@ -0,0 +1,43 @@
+open Tokyo_cabinet
+
+(* float time series in a BDB, keyed by series id and timestamp. points
+   are stored in blocks of up to block points, one record per block,
+   with delta-of-delta timestamps and XORed floats as in Facebook's
+   Gorilla. timestamps must increase strictly within a series; their
+   unit is up to the caller. *)
+type t
+
+(* appends are buffered and written group (default 10000) points at a
+   time in one transaction; block defaults to 1024. a series appended
+   to keeps an open block of up to block points in memory until it
+   fills; a flush drops the series not appended to since the previous
+   one, and their next append reads the open block back. *)
+val open_ : ?omode:omode list -> ?block:int -> ?group:int -> string -> t
+
+(* flushes pending appends *)
+val close : t -> unit
+
+(* raises Error (Einvalid, ...) if ts is not after the last timestamp of
+   the series *)
+val append : t -> int64 -> int64 -> float -> unit
+
+(* write the filled blocks and open blocks *)
+val flush : t -> unit
+
+(* the points of a series with lower <= ts <= upper (default all), in
+   timestamp order. only blocks overlapping the range are read and
+   decoded. unflushed appends are not seen. *)
+val iter : t -> int64 -> ?lower:int64 -> ?upper:int64 -> (int64 -> float -> unit) -> unit
+val range : t -> int64 -> ?lower:int64 -> ?upper:int64 -> unit -> int64 array * float array
+
+(* the block codec, exposed for tests: encode ts vs n packs the first n
+   (at least 1) points, and decode unpacks them *)
+val encode : int64 array -> float array -> int -> string
+val decode : string -> int64 array * float array
+
+type agg = Count | Sum | Mean | Min | Max | First | Last
+
+(* aggregate the points of a range into buckets of step (multiples of
+   step from 0); returns the start and value of each nonempty bucket *)
+val downsample :
+  t -> int64 -> ?lower:int64 -> ?upper:int64 -> step:int64 -> agg -> int64 array * float array
@@ -0,0 +1,127 @@
+open Tokyo_common
+open Tokyo_cabinet
+
+(* deadlines are 8 bytes big-endian, with the bits of positive floats
+   sign-flipped and of negative ones inverted, so the lexical order of
+   the bytes is the order of the floats *)
+let put_deadline s off d =
+  let b = Int64.bits_of_float d in
+  let b = if b < 0L then Int64.lognot b else Int64.logxor b Int64.min_int in
+  for i = 0 to 7 do
+    s.[off + i] <- Char.unsafe_chr (Int64.to_int (Int64.shift_right_logical b (56 - 8 * i)) land 0xff)
+  done
+
+(* s may be a Cstr, so no bounds checks *)
+let get_deadline s off =
+  let rec loop i b =
+    if i = 8 then b
+    else loop (i + 1) (Int64.logor (Int64.shift_left b 8) (Int64.of_int (Char.code (String.unsafe_get s (off + i))))) in
+  let b = loop 0 0L in
+  Int64.float_of_bits (if b < 0L then Int64.logxor b Int64.min_int else Int64.lognot b)
+
+(* values carry their deadline after the marshalled 'v *)
+let entry_type vtype =
+  Otoky_type.make
+    ~type_desc:(Type_desc.hide (Type_desc.Tuple [ Type_desc.show vtype.Otoky_type.type_desc; Type_desc.Float ]))
+    ~marshall:(fun (v, d) ->
+                 let (s, len) = vtype.Otoky_type.marshall v in
+                 let r = String.create (len + 8) in
+                 String.blit s 0 r 0 len;
+                 put_deadline r len d;
+                 (r, len + 8))
+    ~unmarshall:(fun (s, len) ->
+                   let d = get_deadline s (len - 8) in
+                   (vtype.Otoky_type.unmarshall (s, len - 8), d))
+    ~compare:(fun (a, _) (b, _) -> vtype.Otoky_type.compare a b)
+
+type ('k, 'v) t = {
+  hdb : ('k, 'v * float) Otoky_hdb.t;
+  expiry : BDB.t; (* deadline ^ marshalled key -> "" *)
+  ktype : 'k Otoky_type.t;
+  clock : unit -> float;
+}
+
+let open_ ?omode ~clock ktype vtype fn =
+  let hdb = Otoky_hdb.open_ ?omode ktype (entry_type vtype) fn in
+  let expiry = BDB.new_ () in
+  begin try BDB.open_ expiry ?omode (fn ^ ".expiry")
+  with e -> Otoky_hdb.close hdb; raise e end;
+  { hdb = hdb; expiry = expiry; ktype = ktype; clock = clock }
+
+let close t =
+  Otoky_hdb.close t.hdb;
+  BDB.close t.expiry
+
+let expiry_key t k d =
+  let mk = Cstr.copy (t.ktype.Otoky_type.marshall k) in
+  let len = String.length mk in
+  let s = String.create (8 + len) in
+  put_deadline s 0 d;
+  String.blit mk 0 s 8 len;
+  s
+
+let put t ?ttl k v =
+  match ttl with
+    | None -> Otoky_hdb.put t.hdb k (v, infinity)
+    | Some ttl ->
+        let d = t.clock () +. ttl in
+        BDB.put t.expiry (expiry_key t k d) "";
+        Otoky_hdb.put t.hdb k (v, d)
+
+let live t func k =
+  let (v, d) = Otoky_hdb.get t.hdb k in
+  if d <= t.clock () then raise (Error (Enorec, func, "record expired"));
+  (v, d)
+
+let get t k = fst (live t "get" k)
+let deadline t k = snd (live t "deadline" k)
+let out t k = Otoky_hdb.out t.hdb k
+let sync t = Otoky_hdb.sync t.hdb; BDB.sync t.expiry
+
+let tranbegin t =
+  Otoky_hdb.tranbegin t.hdb;
+  try BDB.tranbegin t.expiry
+  with e -> Otoky_hdb.tranabort t.hdb; raise e
+
+let trancommit t =
+  Otoky_hdb.trancommit t.hdb;
+  BDB.trancommit t.expiry
+
+let tranabort t =
+  Otoky_hdb.tranabort t.hdb;
+  BDB.tranabort t.expiry
+
+let sweep t ?(max = 1000) () =
+  let now = t.clock () in
+  let cur = BDBCUR.new_ t.expiry in
+  let rec collect n acc =
+    if n = max then acc
+    else
+      let ek = BDBCUR.key cur in
+      if get_deadline ek 0 > now then acc
+      else if (try BDBCUR.next cur; true with Error (Enorec, _, _) -> false)
+      then collect (n + 1) (ek :: acc)
+      else ek :: acc in
+  let eks =
+    try BDBCUR.first cur; collect 0 []
+    with Error (Enorec, _, _) -> [] in
+  if eks = [] then 0
+  else begin
+    tranbegin t;
+    let removed = ref 0 in
+    begin try
+      List.iter
+        (fun ek ->
+           let k = t.ktype.Otoky_type.unmarshall (String.sub ek 8 (String.length ek - 8), String.length ek - 8) in
+           let d = try snd (Otoky_hdb.get t.hdb k) with Error (Enorec, _, _) -> infinity in
+           if d <= now
+           then begin
+             Otoky_hdb.out t.hdb k;
+             incr removed
+           end;
+           BDB.out t.expiry ek)
+        eks
+    with e -> tranabort t; raise e end;
+    trancommit t;
+    !removed
+  end
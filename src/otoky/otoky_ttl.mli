@@ -0,0 +1,42 @@
+open Tokyo_cabinet
+
+(* an HDB of 'k to 'v where records may expire. each value is stored
+   with its deadline, and records with a deadline are listed in a BDB
+   at the path ^ ".expiry" ordered by deadline, so expired records are
+   found without a scan. clock gives the current time in the unit of
+   ttls, e.g. Unix.gettimeofday. *)
+type ('k, 'v) t
+
+val open_ :
+  ?omode:omode list -> clock:(unit -> float) -> 'k Otoky_type.t -> 'v Otoky_type.t -> string ->
+  ('k, 'v) t
+
+val close : ('k, 'v) t -> unit
+
+(* a record without ttl never expires. the expiry entry is written
+   before the record, so a crash leaves at most a stray entry, which
+   sweep drops. *)
+val put : ('k, 'v) t -> ?ttl:float -> 'k -> 'v -> unit
+
+(* expired records are filtered out lazily: get and deadline raise
+   Error (Enorec, ...) for them until they are swept *)
+val get : ('k, 'v) t -> 'k -> 'v
+
+(* infinity for a record without ttl *)
+val deadline : ('k, 'v) t -> 'k -> float
+
+(* the expiry entry stays until sweep reaches it *)
+val out : ('k, 'v) t -> 'k -> unit
+
+(* delete expired records, taking up to max (default 1000) expiry
+   entries in deadline order in one transaction on both files; returns
+   the number of records deleted. entries of records since rewritten
+   with a later deadline or removed are dropped without deleting. *)
+val sweep : ('k, 'v) t -> ?max:int -> unit -> int
+
+val sync : ('k, 'v) t -> unit
+
+(* transactions span the records and the expiry index *)
+val tranabort : ('k, 'v) t -> unit
+val tranbegin : ('k, 'v) t -> unit
+val trancommit : ('k, 'v) t -> unit
@@ -35,6 +35,10 @@ type omode = Oreader | Owriter | Ocreat | Otrunc | Onolck | Olcknb | Otsync
 
 type opt = Tlarge | Tdeflate | Tbzip | Ttcbs
 
+type access = Acc_normal | Acc_sequential | Acc_random | Acc_willneed | Acc_dontneed
+
+type pages = string
+
 module ADB =
 struct
   type t
@@ -50,6 +54,7 @@ struct
     val addint : t -> cstr_t -> int -> int
     val close : t -> unit
     val copy : t -> string -> unit
+    val foreach : t -> ?batch:int -> (tclist_t -> tclist_t -> bool) -> unit
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val get : t -> cstr_t -> cstr_t
     val iterinit : t -> unit
@@ -88,6 +93,15 @@ struct
     external close : t -> unit = "otoky_adb_close"
     external copy : t -> string -> unit = "otoky_adb_copy"
 
+    external _foreach : t -> ?batch:int -> (Tclist.t -> Tclist.t -> bool) -> unit = "otoky_adb_foreach"
+    let foreach t ?batch func =
+      _foreach t ?batch begin fun keys vals ->
+        let ks = Tcl.of_tclist keys in
+        let vs = Tcl.of_tclist vals in
+        if Tcl.del then (Tclist.del keys; Tclist.del vals);
+        func ks vs
+      end
+
     external _fwmkeys : t -> ?max:int -> string -> int -> Tclist.t = "otoky_adb_fwmkeys"
     let fwmkeys t ?max prefix =
       let tclist = _fwmkeys t ?max (Cs.string prefix) (Cs.length prefix) in
@@ -175,16 +189,31 @@ struct
 
     val adddouble : t -> cstr_t -> float -> float
     val addint : t -> cstr_t -> int -> int
+    val advise : t -> ?off:int64 -> ?len:int64 -> access -> unit
+    val bnum : t -> int64
+    val bnumused : t -> int64
     val close : t -> unit
     val copy : t -> string -> unit
+    val defrag : t -> ?step:int64 -> unit -> unit
+    val defrag_start : t -> ?interval:float -> ?step:int64 -> ?threshold:float -> unit -> unit
+    val defrag_stop : t -> unit
+    val drop_pages : t -> pages -> unit
+    val foreach : t -> ?batch:int -> (tclist_t -> tclist_t -> bool) -> unit
+    val frag : t -> float
     val fsiz : t -> int64
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val get : t -> cstr_t -> cstr_t
     val getlist : t -> cstr_t -> tclist_t
+    val lmemb : t -> int32
+    val lnum : t -> int64
+    val nmemb : t -> int32
+    val nnum : t -> int64
     val open_ : t -> ?omode:omode list -> string -> unit
     val optimize : t -> ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    val opts : t -> opt list
     val out : t -> cstr_t -> unit
     val outlist : t -> cstr_t -> unit
+    val pages : t -> pages
     val path : t -> string
     val put : t -> cstr_t -> cstr_t -> unit
     val putcat : t -> cstr_t -> cstr_t -> unit
@@ -202,9 +231,11 @@ struct
     val tranbegin : t -> unit
     val trancommit : t -> unit
     val tune : t -> ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    val update : t -> cstr_t -> (cstr_t option -> cstr_t option) -> unit
     val vanish : t -> unit
     val vnum : t -> cstr_t -> int
     val vsiz : t -> cstr_t -> int
+    val warm : t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit
   end
 
   module Fun (Cs : Cstr_t) (Tcl : Tclist_t) =
@@ -220,8 +251,29 @@ struct
     external _addint : t -> string -> int -> int -> int = "otoky_bdb_addint"
     let addint t key num = _addint t (Cs.string key) (Cs.length key) num
 
+    external advise : t -> ?off:int64 -> ?len:int64 -> access -> unit = "otoky_bdb_advise"
+    external bnum : t -> int64 = "otoky_bdb_bnum"
+    external bnumused : t -> int64 = "otoky_bdb_bnumused"
     external close : t -> unit = "otoky_bdb_close"
     external copy : t -> string -> unit = "otoky_bdb_copy"
+
+    external defrag : t -> ?step:int64 -> unit -> unit = "otoky_bdb_defrag"
+    external _defrag_start : t -> float -> int64 -> float -> unit = "otoky_bdb_defrag_start"
+    let defrag_start t ?(interval = 1.0) ?(step = 1024L) ?(threshold = 0.1) () =
+      _defrag_start t interval step threshold
+    external defrag_stop : t -> unit = "otoky_bdb_defrag_stop"
+    external drop_pages : t -> pages -> unit = "otoky_bdb_drop_pages"
+
+    external _foreach : t -> ?batch:int -> (Tclist.t -> Tclist.t -> bool) -> unit = "otoky_bdb_foreach"
+    let foreach t ?batch func =
+      _foreach t ?batch begin fun keys vals ->
+        let ks = Tcl.of_tclist keys in
+        let vs = Tcl.of_tclist vals in
+        if Tcl.del then (Tclist.del keys; Tclist.del vals);
+        func ks vs
+      end
+
+    external frag : t -> float = "otoky_bdb_frag"
     external fsiz : t -> int64 = "otoky_bdb_fsiz"
 
     external _fwmkeys : t -> ?max:int -> string -> int -> Tclist.t = "otoky_bdb_fwmkeys"
@@ -245,17 +297,24 @@ struct
       if Tcl.del then Tclist.del tclist;
       r
 
+    external lmemb : t -> int32 = "otoky_bdb_lmemb"
+    external lnum : t -> int64 = "otoky_bdb_lnum"
+    external nmemb : t -> int32 = "otoky_bdb_nmemb"
+    external nnum : t -> int64 = "otoky_bdb_nnum"
     external open_ : t -> ?omode:omode list -> string -> unit = "otoky_bdb_open"
     external optimize :
       t -> ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit =
           "otoky_bdb_optimize_bc" "otoky_bdb_optimize"
 
+    external opts : t -> opt list = "otoky_bdb_opts"
+
     external _out : t -> string -> int -> unit = "otoky_bdb_out"
     let out t key = _out t (Cs.string key) (Cs.length key)
 
     external _outlist : t -> string -> int -> unit = "otoky_bdb_outlist"
     let outlist t key = _outlist t (Cs.string key) (Cs.length key)
 
+    external pages : t -> pages = "otoky_bdb_pages"
     external path : t -> string = "otoky_bdb_path"
 
     external _put : t -> string -> int -> string -> int -> unit = "otoky_bdb_put"
@@ -307,6 +366,22 @@ struct
     external tune :
       t -> ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit =
           "otoky_bdb_tune_bc" "otoky_bdb_tune"
+
+    external _update : t -> string -> int -> (Cstr.t option -> (string * int) option) -> unit = "otoky_bdb_update"
+    let update t key func =
+      _update t (Cs.string key) (Cs.length key) begin fun cstr ->
+        let v =
+          match cstr with
+            | None -> None
+            | Some cstr ->
+                let r = Cs.of_cstr cstr in
+                if Cs.del then Cstr.del cstr;
+                Some r in
+        match func v with
+          | None -> None
+          | Some v -> Some (Cs.string v, Cs.length v)
+      end
+
     external vanish : t -> unit = "otoky_bdb_vanish"
 
     external _vnum : t -> string -> int -> int = "otoky_bdb_vnum"
@@ -314,6 +389,8 @@ struct
 
     external _vsiz : t -> string -> int -> int = "otoky_bdb_vsiz"
     let vsiz t key = _vsiz t (Cs.string key) (Cs.length key)
+
+    external warm : t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit = "otoky_bdb_warm"
   end
 
   include Fun (Cstr_string) (Tclist_list)
@@ -386,6 +463,12 @@ struct
   let id_max = -3L
   let id_next = -4L
 
+  type kv = {
+    ids : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    offs : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    vals : Cstr.buf;
+  }
+
   type t
 
   module type Sig =
@@ -398,6 +481,7 @@ struct
     val addint : t -> int64 -> int -> int
     val close : t -> unit
     val copy : t -> string -> unit
+    val foreach : t -> ?batch:int -> (int64 array -> cstr_t array -> bool) -> unit
     val fsiz : t -> int64
     val get : t -> int64 -> cstr_t
     val iterinit : t -> unit
@@ -410,6 +494,7 @@ struct
     val putcat : t -> int64 -> cstr_t -> unit
     val putkeep : t -> int64 -> cstr_t -> unit
     val range : t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> int64 array
+    val range_kv : t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> kv
     val rnum : t -> int64
     val sync : t -> unit
     val tranabort : t -> unit
@@ -433,6 +518,15 @@ struct
 
     external close : t -> unit = "otoky_fdb_close"
     external copy : t -> string -> unit = "otoky_fdb_copy"
+
+    external _foreach : t -> ?batch:int -> (int64 array -> Cstr.t array -> bool) -> unit = "otoky_fdb_foreach"
+    let foreach t ?batch func =
+      _foreach t ?batch begin fun ids cstrs ->
+        let vals = Array.map Cs.of_cstr cstrs in
+        if Cs.del then Array.iter Cstr.del cstrs;
+        func ids vals
+      end
+
     external fsiz : t -> int64 = "otoky_fdb_fsiz"
 
     external _get : t -> int64 -> Cstr.t = "otoky_fdb_get"
@@ -459,6 +553,7 @@ struct
     let putkeep t key value = _putkeep t key (Cs.string value) (Cs.length value)
 
     external range : t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> int64 array = "otoky_fdb_range"
+    external range_kv : t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> kv = "otoky_fdb_range_kv"
     external rnum : t -> int64 = "otoky_fdb_rnum"
     external sync : t -> unit = "otoky_fdb_sync"
     external tranabort : t -> unit = "otoky_fdb_tranabort"
@@ -474,6 +569,81 @@ struct
   include Fun (Cstr_string)
 end
 
+module FDBVIEW =
+struct
+  type t = {
+    buf : Cstr.buf;
+    lower : int64;
+    upper : int64;
+    rsiz : int;
+    wsiz : int;
+    width : int;
+  }
+
+  external new_ : FDB.t -> ?lower:int64 -> ?upper:int64 -> unit -> t = "otoky_fdbview_new"
+  external _with_lock : FDB.t -> (bool -> 'a) -> 'a = "otoky_fdbview_with_lock"
+
+  (* with no records there is nothing to lock, so func gets an empty view *)
+  let with_lock fdb ?lower ?upper func =
+    _with_lock fdb
+      (fun locked ->
+         if locked
+         then func (new_ fdb ?lower ?upper ())
+         else func (new_ fdb ~lower:1L ~upper:0L ()))
+
+  let buf t = t.buf
+  let lower t = t.lower
+  let upper t = t.upper
+  let width t = t.width
+
+  let base t id func =
+    if id < t.lower || id > t.upper
+    then raise (Error (Einvalid, func, "id outside view"));
+    Int64.to_int (Int64.sub id t.lower) * t.rsiz
+
+  (* a record starts with its size in wsiz little-endian bytes; a zero
+     size followed by a zero byte is an empty slot, as in tcfdbget *)
+  let length t id =
+    let b = base t id "length" in
+    let rec size i n =
+      if i < 0 then n
+      else size (i - 1) ((n lsl 8) lor Char.code t.buf.{b + i}) in
+    let n = size (t.wsiz - 1) 0 in
+    if n = 0 && t.buf.{b + t.wsiz} = '\000' then -1 else n
+
+  let offset t id = base t id "offset" + t.wsiz
+
+  let slice t id =
+    let n = length t id in
+    if n < 0 then raise (Error (Enorec, "slice", "no record"));
+    Bigarray.Array1.sub t.buf (offset t id) n
+
+  type elt = El_int32 | El_int64 | El_float32 | El_float64
+
+  type layout = {
+    elt : elt;
+    off : int;
+    n : int; (* -1 for as many as fit in the width *)
+  }
+
+  let layout ?(off = 0) ?(count = -1) elt = { elt = elt; off = off; n = count }
+
+  type stats = {
+    records : int64;
+    sum : float array;
+    min : float array;
+    max : float array;
+  }
+
+  external stats : FDB.t -> layout -> ?lower:int64 -> ?upper:int64 -> unit -> stats = "otoky_fdbview_stats"
+  external histogram :
+    FDB.t -> layout -> ?lower:int64 -> ?upper:int64 -> ?pos:int -> bins:int -> float -> float -> int64 array =
+    "otoky_fdbview_histogram_bc" "otoky_fdbview_histogram"
+  external dot :
+    FDB.t -> layout -> float array -> ?lower:int64 -> ?upper:int64 -> unit ->
+    int64 * (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t = "otoky_fdbview_dot"
+end
+
 module HDB =
 struct
   type t
@@ -487,16 +657,30 @@ struct
 
     val adddouble : t -> cstr_t -> float -> float
     val addint : t -> cstr_t -> int -> int
+    val advise : t -> ?off:int64 -> ?len:int64 -> access -> unit
+    val bnum : t -> int64
+    val bnumused : t -> int64
     val close : t -> unit
     val copy : t -> string -> unit
+    val defrag : t -> ?step:int64 -> unit -> unit
+    val defrag_start : t -> ?interval:float -> ?step:int64 -> ?threshold:float -> unit -> unit
+    val defrag_stop : t -> unit
+    val drop_pages : t -> pages -> unit
+    val foreach : t -> ?batch:int -> (tclist_t -> tclist_t -> bool) -> unit
+    val frag : t -> float
     val fsiz : t -> int64
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val get : t -> cstr_t -> cstr_t
     val iterinit : t -> unit
+    val iterinit2 : t -> cstr_t -> unit
     val iternext : t -> cstr_t
+    val iteroffset : t -> cstr_t -> int64
+    val iterseek : t -> int64 -> unit
     val open_ : t -> ?omode:omode list -> string -> unit
     val optimize : t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    val opts : t -> opt list
     val out : t -> cstr_t -> unit
+    val pages : t -> pages
     val path : t -> string
     val put : t -> cstr_t -> cstr_t -> unit
     val putasync : t -> cstr_t -> cstr_t -> unit
@@ -511,8 +695,10 @@ struct
     val tranbegin : t -> unit
     val trancommit : t -> unit
     val tune : t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    val update : t -> cstr_t -> (cstr_t option -> cstr_t option) -> unit
     val vanish : t -> unit
     val vsiz : t -> cstr_t -> int
+    val warm : t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit
   end
 
   module Fun (Cs : Cstr_t) (Tcl : Tclist_t) =
@@ -528,8 +714,29 @@ struct
     external _addint : t -> string -> int -> int -> int = "otoky_hdb_addint"
     let addint t key num = _addint t (Cs.string key) (Cs.length key) num
 
+    external advise : t -> ?off:int64 -> ?len:int64 -> access -> unit = "otoky_hdb_advise"
+    external bnum : t -> int64 = "otoky_hdb_bnum"
+    external bnumused : t -> int64 = "otoky_hdb_bnumused"
     external close : t -> unit = "otoky_hdb_close"
     external copy : t -> string -> unit = "otoky_hdb_copy"
+
+    external defrag : t -> ?step:int64 -> unit -> unit = "otoky_hdb_defrag"
+    external _defrag_start : t -> float -> int64 -> float -> unit = "otoky_hdb_defrag_start"
+    let defrag_start t ?(interval = 1.0) ?(step = 1024L) ?(threshold = 0.1) () =
+      _defrag_start t interval step threshold
+    external defrag_stop : t -> unit = "otoky_hdb_defrag_stop"
+    external drop_pages : t -> pages -> unit = "otoky_hdb_drop_pages"
+
+    external _foreach : t -> ?batch:int -> (Tclist.t -> Tclist.t -> bool) -> unit = "otoky_hdb_foreach"
+    let foreach t ?batch func =
+      _foreach t ?batch begin fun keys vals ->
+        let ks = Tcl.of_tclist keys in
+        let vs = Tcl.of_tclist vals in
+        if Tcl.del then (Tclist.del keys; Tclist.del vals);
+        func ks vs
+      end
+
+    external frag : t -> float = "otoky_hdb_frag"
     external fsiz : t -> int64 = "otoky_hdb_fsiz"
 
     external _fwmkeys : t -> ?max:int -> string -> int -> Tclist.t = "otoky_hdb_fwmkeys"
@@ -548,6 +755,9 @@ struct
 
     external iterinit : t -> unit = "otoky_hdb_iterinit"
 
+    external _iterinit2 : t -> string -> int -> unit = "otoky_hdb_iterinit2"
+    let iterinit2 t key = _iterinit2 t (Cs.string key) (Cs.length key)
+
     external _iternext : t -> Cstr.t = "otoky_hdb_iternext"
     let iternext t =
       let cstr = _iternext t in
@@ -555,14 +765,22 @@ struct
       if Cs.del then Cstr.del cstr;
       r
 
+    external _iteroffset : t -> string -> int -> int64 = "otoky_hdb_iteroffset"
+    let iteroffset t key = _iteroffset t (Cs.string key) (Cs.length key)
+
+    external iterseek : t -> int64 -> unit = "otoky_hdb_iterseek"
+
     external open_ : t -> ?omode:omode list -> string -> unit = "otoky_hdb_open"
     external optimize :
       t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit =
           "otoky_hdb_optimize_bc" "otoky_hdb_optimize"
 
+    external opts : t -> opt list = "otoky_hdb_opts"
+
     external _out : t -> string -> int -> unit = "otoky_hdb_out"
     let out t key = _out t (Cs.string key) (Cs.length key)
 
+    external pages : t -> pages = "otoky_hdb_pages"
     external path : t -> string = "otoky_hdb_path"
 
     external _put : t -> string -> int -> string -> int -> unit = "otoky_hdb_put"
@@ -590,10 +808,28 @@ struct
     external tune :
       t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit =
           "otoky_hdb_tune_bc" "otoky_hdb_tune"
+
+    external _update : t -> string -> int -> (Cstr.t option -> (string * int) option) -> unit = "otoky_hdb_update"
+    let update t key func =
+      _update t (Cs.string key) (Cs.length key) begin fun cstr ->
+        let v =
+          match cstr with
+            | None -> None
+            | Some cstr ->
+                let r = Cs.of_cstr cstr in
+                if Cs.del then Cstr.del cstr;
+                Some r in
+        match func v with
+          | None -> None
+          | Some v -> Some (Cs.string v, Cs.length v)
+      end
+
     external vanish : t -> unit = "otoky_hdb_vanish"
 
     external _vsiz : t -> string -> int -> int = "otoky_hdb_vsiz"
     let vsiz t key = _vsiz t (Cs.string key) (Cs.length key)
+
+    external warm : t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit = "otoky_hdb_warm"
   end
 
   include Fun (Cstr_string) (Tclist_list)
@@ -603,6 +839,8 @@ module TDB =
 struct
   type itype = It_lexical | It_decimal | It_token | It_qgram | It_opt | It_void
 
+  type ctype = Ct_int64 | Ct_float | Ct_string
+
   type t
 
   module type Sig =
@@ -617,10 +855,18 @@ struct
     val addint : t -> cstr_t -> int -> int
     val close : t -> unit
     val copy : t -> string -> unit
+    val export : t -> ?keys:tclist_t -> ?pkey:bool -> string -> (string * ctype) list -> int64
+    val foreach : t -> ?batch:int -> (tclist_t -> tcmap_t array -> bool) -> unit
     val fsiz : t -> int64
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val genuid : t -> int64
     val get : t -> cstr_t -> tcmap_t
+    val index_abort : t -> unit
+    val index_build : t -> ?step:int -> ?progress:(int64 -> int64 -> unit) -> string -> itype -> unit
+    val index_finish : t -> unit
+    val index_progress : t -> int64 * int64
+    val index_start : t -> string -> itype -> unit
+    val index_step : t -> int -> bool
     val iterinit : t -> unit
     val iternext : t -> cstr_t
     val open_ : t -> ?omode:omode list -> string -> unit
@@ -660,6 +906,29 @@ struct
 
     external close : t -> unit = "otoky_tdb_close"
     external copy : t -> string -> unit = "otoky_tdb_copy"
+
+    external _export : t -> ?keys:Tclist.t -> ?pkey:bool -> string -> (string * ctype) list -> int64 = "otoky_tdb_export"
+    let export t ?keys ?pkey path columns =
+      match keys with
+        | None -> _export t ?pkey path columns
+        | Some keys ->
+            let tclist = Tcl.to_tclist keys in
+            let r =
+              try _export t ~keys:tclist ?pkey path columns
+              with e -> if Tcl.del then Tclist.del tclist; raise e in
+            if Tcl.del then Tclist.del tclist;
+            r
+
+    external _foreach : t -> ?batch:int -> (Tclist.t -> Tcmap.t array -> bool) -> unit = "otoky_tdb_foreach"
+    let foreach t ?batch func =
+      _foreach t ?batch begin fun keys tcmaps ->
+        let ks = Tcl.of_tclist keys in
+        let cols = Array.map Tcm.of_tcmap tcmaps in
+        if Tcl.del then Tclist.del keys;
+        if Tcm.del then Array.iter Tcmap.del tcmaps;
+        func ks cols
+      end
+
     external fsiz : t -> int64 = "otoky_tdb_fsiz"
 
     external _fwmkeys : t -> ?max:int -> string -> int -> Tclist.t = "otoky_tdb_fwmkeys"
@@ -678,6 +947,23 @@ struct
       if Tcm.del then Tcmap.del tcmap;
       r
 
+    external index_abort : t -> unit = "otoky_tdb_index_abort"
+    external index_finish : t -> unit = "otoky_tdb_index_finish"
+    external index_progress : t -> int64 * int64 = "otoky_tdb_index_progress"
+    external index_start : t -> string -> itype -> unit = "otoky_tdb_index_start"
+    external index_step : t -> int -> bool = "otoky_tdb_index_step"
+
+    let index_build t ?(step = 10000) ?progress name itype =
+      index_start t name itype;
+      begin try
+        while index_step t step do
+          match progress with
+            | Some f -> let (d, n) = index_progress t in f d n
+            | None -> ()
+        done
+      with e -> index_abort t; raise e end;
+      index_finish t
+
     external iterinit : t -> unit = "otoky_tdb_iterinit"
 
     external _iternext : t -> Cstr.t = "otoky_tdb_iternext"
@@ -775,6 +1061,8 @@ struct
 
   type kopt = Kw_mutab | Kw_muctrl | Kw_mubrct | Kw_noover | Kw_pulead
 
+  type agg = Ag_count | Ag_sum of string | Ag_min of string | Ag_max of string | Ag_avg of string
+
   type t
 
   module type Sig =
@@ -784,13 +1072,18 @@ struct
 
     val new_ : TDB.t -> t
     val metasearch : ?setop:msetop -> t list -> tclist_t
+    val parsearch : ?max:int -> t list -> tclist_t * int array
 
     val addcond : t -> string -> ?negate:bool -> ?noidx:bool -> qcond -> string -> unit
+    val aggregate : t -> ?group:string -> ?max_groups:int -> agg list -> (string * float array) list
     val hint : t -> string
     val kwic : t -> ?name:string -> ?width:int -> ?opts:kopt list -> tcmap_t -> tclist_t
     val proc : t -> (string -> tcmap_t ref -> qpost list) -> unit
+    val proc_batch : t -> ?batch:int -> (Tclist.t -> Tcmap.t array -> qpost list array) -> unit
     val search : t -> tclist_t
+    val search_get : t -> ?columns:string list -> unit -> tclist_t * tcmap_t array
     val searchout : t -> unit
+    val setexpr : t -> int -> string -> unit
     val setlimit : t -> ?max:int -> ?skip:int -> unit -> unit
     val setorder : t -> ?qord:qord -> string -> unit
   end
@@ -804,6 +1097,10 @@ struct
 
     external addcond : t -> string -> ?negate:bool -> ?noidx:bool -> qcond -> string -> unit =
         "otoky_tdbqry_addcond_bc" "otoky_tdbqry_addcond"
+    external _aggregate : t -> ?group:string -> ?max_groups:int -> agg list -> (string * float array) list =
+        "otoky_tdbqry_aggregate"
+    let aggregate t ?group ?max_groups aggs = List.rev (_aggregate t ?group ?max_groups aggs)
+
     external hint : t -> string = "otoky_tdbqry_hint"
 
     external _kwic : t -> ?name:string -> ?width:int -> ?opts:kopt list -> Tcmap.t -> Tclist.t = "otoky_tdbqry_kwic"
@@ -830,6 +1127,13 @@ struct
       if Tcl.del then Tclist.del tclist;
       r
 
+    external _parsearch : ?max:int -> t list -> Tclist.t * int array = "otoky_tdbqry_parsearch"
+    let parsearch ?max qrys =
+      let (tclist, from) = _parsearch ?max qrys in
+      let r = Tcl.of_tclist tclist in
+      if Tcl.del then Tclist.del tclist;
+      (r, from)
+
     external _proc : t -> (string -> Tcmap.t -> qpost list) -> unit = "otoky_tdbqry_proc"
     let proc t func =
       _proc t begin fun key tcmap ->
@@ -840,6 +1144,9 @@ struct
         qposts
       end
 
+    external proc_batch : t -> ?batch:int -> (Tclist.t -> Tcmap.t array -> qpost list array) -> unit =
+        "otoky_tdbqry_proc_batch"
+
     external _search : t -> Tclist.t = "otoky_tdbqry_search"
     let search t =
       let tclist = _search t in
@@ -847,10 +1154,128 @@ struct
       if Tcl.del then Tclist.del tclist;
       r
 
+    external _search_get : t -> ?columns:string list -> unit -> Tclist.t * Tcmap.t array = "otoky_tdbqry_search_get"
+    let search_get t ?columns () =
+      let (keys, tcmaps) = _search_get t ?columns () in
+      let ks = Tcl.of_tclist keys in
+      let cols = Array.map Tcm.of_tcmap tcmaps in
+      if Tcl.del then Tclist.del keys;
+      if Tcm.del then Array.iter Tcmap.del tcmaps;
+      (ks, cols)
+
     external searchout : t -> unit = "otoky_tdbqry_searchout"
+    external setexpr : t -> int -> string -> unit = "otoky_tdbqry_setexpr"
     external setlimit : t -> ?max:int -> ?skip:int -> unit -> unit = "otoky_tdbqry_setlimit"
     external setorder : t -> ?qord:qord -> string -> unit = "otoky_tdbqry_setorder"
   end
 
   include Fun (Tclist_list) (Tcmap_list)
 end
+
+module Colfile =
+struct
+  type bitmap = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  type column = {
+    name : string;
+    ctype : int; (* as enum ctype in the stubs; 3 is the primary key *)
+    ndict : int;
+    secs : (int64 * int64) array;
+  }
+
+  type t = {
+    path : string;
+    rows : int;
+    cols : column list;
+  }
+
+  (* kinds as enum ckind in the stubs *)
+  external _read : string -> string -> int -> int64 -> int64 -> ('a, 'b, Bigarray.c_layout) Bigarray.Array1.t =
+    "otoky_colfile_read"
+
+  let magic = "OTKYCOL1"
+
+  let open_ path =
+    let bad () = raise (Error (Emisc, "Colfile.open_", "bad columnar file " ^ path)) in
+    let ic = open_in_bin path in
+    let int n =
+      let rec loop i acc =
+        if i = n then acc
+        else
+          let b = Int64.of_int (input_byte ic) in
+          loop (i + 1) (Int64.logor acc (Int64.shift_left b (8 * i))) in
+      loop 0 0L in
+    let string n =
+      let s = String.create n in
+      really_input ic s 0 n;
+      s in
+    let column () =
+      let ctype = Int64.to_int (int 4) in
+      let nsiz = Int64.to_int (int 4) in
+      let name = string nsiz in
+      ignore (string (((nsiz + 7) land (lnot 7)) - nsiz));
+      let ndict = Int64.to_int (int 8) in
+      let secs = Array.init 4 (fun _ -> let off = int 8 in let len = int 8 in (off, len)) in
+      { name = name; ctype = ctype; ndict = ndict; secs = secs } in
+    try
+      if string 8 <> magic then bad ();
+      let ncols = Int64.to_int (int 4) in
+      ignore (int 4);
+      let rows = Int64.to_int (int 8) in
+      let rec loop i = if i = ncols then [] else let c = column () in c :: loop (i + 1) in
+      let cols = loop 0 in
+      close_in ic;
+      { path = path; rows = rows; cols = cols }
+    with
+      | End_of_file -> close_in ic; bad ()
+      | e -> close_in ic; raise e
+
+  let rows t = t.rows
+
+  let ctype_of_int = function
+    | 0 -> TDB.Ct_int64
+    | 1 -> TDB.Ct_float
+    | _ -> TDB.Ct_string
+
+  let columns t =
+    List.map (fun c -> (c.name, ctype_of_int c.ctype)) (List.filter (fun c -> c.ctype <> 3) t.cols)
+
+  let has_keys t = List.exists (fun c -> c.ctype = 3) t.cols
+
+  let find t func ctype name =
+    let c =
+      try List.find (fun c -> c.name = name && c.ctype <> 3) t.cols
+      with Not_found -> raise (Error (Einvalid, func, "no column " ^ name)) in
+    if ctype >= 0 && c.ctype <> ctype
+    then raise (Error (Einvalid, func, "wrong type for column " ^ name));
+    c
+
+  let section t func c i kind =
+    let (off, len) = c.secs.(i) in
+    _read t.path func kind off len
+
+  let strings (offs : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t) (data : bitmap) n =
+    Array.init n begin fun i ->
+      let a = Int64.to_int offs.{i} in
+      let s = String.create (Int64.to_int offs.{i + 1} - a) in
+      for j = 0 to String.length s - 1 do s.[j] <- data.{a + j} done;
+      s
+    end
+
+  let present t name : bitmap = section t "present" (find t "present" (-1) name) 0 0
+  let is_present (b : bitmap) i = Char.code b.{i lsr 3} land (1 lsl (i land 7)) <> 0
+
+  let int64s t name = section t "int64s" (find t "int64s" 0 name) 1 2
+  let floats t name = section t "floats" (find t "floats" 1 name) 1 3
+  let codes t name = section t "codes" (find t "codes" 2 name) 1 1
+
+  let dict t name =
+    let c = find t "dict" 2 name in
+    strings (section t "dict" c 2 2) (section t "dict" c 3 0) c.ndict
+
+  let keys t =
+    let c =
+      try List.find (fun c -> c.ctype = 3) t.cols
+      with Not_found -> raise (Error (Einvalid, "keys", "no key column")) in
+    strings (section t "keys" c 1 2) (section t "keys" c 2 0) t.rows
+end
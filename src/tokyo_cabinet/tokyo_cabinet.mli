@@ -33,6 +33,11 @@ type omode = Oreader | Owriter | Ocreat | Otrunc | Onolck | Olcknb | Otsync
 
 type opt = Tlarge | Tdeflate | Tbzip | Ttcbs
 
+type access = Acc_normal | Acc_sequential | Acc_random | Acc_willneed | Acc_dontneed
+
+(* which pages of a file were in the page cache at some point *)
+type pages
+
 module ADB :
 sig
   type t
@@ -48,6 +53,13 @@ sig
     val addint : t -> cstr_t -> int -> int
     val close : t -> unit
     val copy : t -> string -> unit
+
+    (* the function gets up to batch (default 4096) records per call.
+       it runs while TC holds the database's method lock (and for HDB
+       and TDB the record locks), so it must not write to the database,
+       or it deadlocks. *)
+    val foreach : t -> ?batch:int -> (tclist_t -> tclist_t -> bool) -> unit
+
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val get : t -> cstr_t -> cstr_t
     val iterinit : t -> unit
@@ -92,16 +104,42 @@ sig
 
     val adddouble : t -> cstr_t -> float -> float
     val addint : t -> cstr_t -> int -> int
+    val advise : t -> ?off:int64 -> ?len:int64 -> access -> unit
+    val bnum : t -> int64
+    val bnumused : t -> int64
     val close : t -> unit
     val copy : t -> string -> unit
+    val defrag : t -> ?step:int64 -> unit -> unit
+    val defrag_start : t -> ?interval:float -> ?step:int64 -> ?threshold:float -> unit -> unit
+    val defrag_stop : t -> unit
+
+    (* drop from the page cache the pages of the file that were not
+       cached at the snapshot and are now, leaving alone pages other users
+       had cached and pages TC has mapped *)
+    val drop_pages : t -> pages -> unit
+
+    (* as ADB.foreach *)
+    val foreach : t -> ?batch:int -> (tclist_t -> tclist_t -> bool) -> unit
+
+    (* as HDB.frag, of the hash database holding the tree *)
+    val frag : t -> float
+
     val fsiz : t -> int64
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val get : t -> cstr_t -> cstr_t
     val getlist : t -> cstr_t -> tclist_t
+    val lmemb : t -> int32
+    val lnum : t -> int64
+    val nmemb : t -> int32
+    val nnum : t -> int64
     val open_ : t -> ?omode:omode list -> string -> unit
     val optimize : t -> ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    val opts : t -> opt list
     val out : t -> cstr_t -> unit
     val outlist : t -> cstr_t -> unit
+
+    (* a snapshot of the pages of the file in the page cache *)
+    val pages : t -> pages
     val path : t -> string
     val put : t -> cstr_t -> cstr_t -> unit
     val putcat : t -> cstr_t -> cstr_t -> unit
@@ -119,9 +157,19 @@ sig
     val tranbegin : t -> unit
     val trancommit : t -> unit
     val tune : t -> ?lmemb:int32 -> ?nmemb:int32 -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    (* read-modify-write of one record: the function gets the old value
+       (None if absent) and returns the new one (None to remove). on a
+       present record it runs while TC holds the method and record
+       locks, so it must not use this database, from this or any other
+       thread, or it deadlocks. on an absent one it runs outside the
+       locks and its value is put only if the record is still absent,
+       retrying otherwise, so it may run more than once and must not
+       have effects beyond its result. *)
+    val update : t -> cstr_t -> (cstr_t option -> cstr_t option) -> unit
     val vanish : t -> unit
     val vnum : t -> cstr_t -> int
     val vsiz : t -> cstr_t -> int
+    val warm : t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit
   end
 
   include Sig with type cstr_t = string and type tclist_t = string list
@@ -164,6 +212,14 @@ sig
   val id_max : int64
   val id_next : int64
 
+  (* ids and values of a range, packed: value i runs from offs.{i} to
+     offs.{i + 1} in vals *)
+  type kv = {
+    ids : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    offs : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    vals : Cstr.buf;
+  }
+
   type t
 
   module type Sig =
@@ -176,6 +232,10 @@ sig
     val addint : t -> int64 -> int -> int
     val close : t -> unit
     val copy : t -> string -> unit
+
+    (* as ADB.foreach *)
+    val foreach : t -> ?batch:int -> (int64 array -> cstr_t array -> bool) -> unit
+
     val fsiz : t -> int64
     val get : t -> int64 -> cstr_t
     val iterinit : t -> unit
@@ -188,6 +248,7 @@ sig
     val putcat : t -> int64 -> cstr_t -> unit
     val putkeep : t -> int64 -> cstr_t -> unit
     val range : t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> int64 array
+    val range_kv : t -> ?lower:int64 -> ?upper:int64 -> ?max:int -> unit -> kv
     val rnum : t -> int64
     val sync : t -> unit
     val tranabort : t -> unit
@@ -205,6 +266,79 @@ sig
   module Fun (Cs : Cstr_t) : Sig with type cstr_t = Cs.t
 end
 
+(* read-only views of the records of an FDB id range, as offsets into
+   one Bigarray over the database's own memory map. the range defaults
+   to the lowest and highest ids in use and is clamped to the file as it
+   is when the view is made.
+
+   a view made with new_ is not locked: a record can change, or be read
+   half-written, while another thread puts it, and the view (and every
+   slice of it) is dangling once the FDB is closed, optimized or
+   vanished. with_lock runs func inside tcfdbforeach, so under the
+   method lock, with every record lock held for reading as well: records
+   are stable and the map stays put. writes from other threads wait, and
+   writes from func itself deadlock. on an FDB with no records func gets
+   an empty view.
+
+   views read TC's private layout, and raise Error (Emisc, _, _) unless
+   the library is from the 1.4 series, whose layout they mirror. *)
+module FDBVIEW :
+sig
+  type t
+
+  val new_ : FDB.t -> ?lower:int64 -> ?upper:int64 -> unit -> t
+  val with_lock : FDB.t -> ?lower:int64 -> ?upper:int64 -> (t -> 'a) -> 'a
+
+  val buf : t -> Cstr.buf
+  val lower : t -> int64
+  val upper : t -> int64
+  val width : t -> int
+
+  (* the size of the record at id, or -1 for an empty slot *)
+  val length : t -> int64 -> int
+
+  (* where the record at id starts in buf *)
+  val offset : t -> int64 -> int
+
+  (* the record at id, sharing buf's memory *)
+  val slice : t -> int64 -> Cstr.buf
+
+  (* reductions run in C over the records of an id range, under the same
+     locks as with_lock. a layout reads each record as a vector of count
+     elements (default as many as fit in the width) in host byte order,
+     starting off bytes in; shorter records give shorter vectors. *)
+  type elt = El_int32 | El_int64 | El_float32 | El_float64
+
+  type layout
+
+  val layout : ?off:int -> ?count:int -> elt -> layout
+
+  (* records counts the non-empty records; sum, min and max are per
+     element position, accumulated as doubles, so int64 sums are exact
+     only up to 2^53. a position no record reaches has min infinity and
+     max neg_infinity. *)
+  type stats = {
+    records : int64;
+    sum : float array;
+    min : float array;
+    max : float array;
+  }
+
+  val stats : FDB.t -> layout -> ?lower:int64 -> ?upper:int64 -> unit -> stats
+
+  (* counts of element pos (default 0) in bins equal-width bins
+     spanning [lo, hi]; values outside are dropped *)
+  val histogram :
+    FDB.t -> layout -> ?lower:int64 -> ?upper:int64 -> ?pos:int -> bins:int -> float -> float -> int64 array
+
+  (* the dot product of each record with the query, as the first id of
+     the clamped range and one score per id from it, nan for empty
+     slots *)
+  val dot :
+    FDB.t -> layout -> float array -> ?lower:int64 -> ?upper:int64 -> unit ->
+    int64 * (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t
+end
+
 module HDB :
 sig
   type t
@@ -218,16 +352,54 @@ sig
 
     val adddouble : t -> cstr_t -> float -> float
     val addint : t -> cstr_t -> int -> int
+    val advise : t -> ?off:int64 -> ?len:int64 -> access -> unit
+    val bnum : t -> int64
+    val bnumused : t -> int64
     val close : t -> unit
     val copy : t -> string -> unit
+    val defrag : t -> ?step:int64 -> unit -> unit
+
+    (* a background thread that runs a defrag step of step records
+       every interval seconds while the file is idle and frag is at
+       least threshold *)
+    val defrag_start : t -> ?interval:float -> ?step:int64 -> ?threshold:float -> unit -> unit
+    val defrag_stop : t -> unit
+
+    (* drop from the page cache the pages of the file that were not
+       cached at the snapshot and are now, leaving alone pages other users
+       had cached and pages TC has mapped *)
+    val drop_pages : t -> pages -> unit
+
+    (* as ADB.foreach *)
+    val foreach : t -> ?batch:int -> (tclist_t -> tclist_t -> bool) -> unit
+
+    (* the fraction of the file in TC's free block pool, read under
+       the database's locks. a lower bound, as the pool holds at most
+       2^fpow blocks; 0 for an empty database or a TC other than 1.4. *)
+    val frag : t -> float
+
     val fsiz : t -> int64
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val get : t -> cstr_t -> cstr_t
     val iterinit : t -> unit
+    val iterinit2 : t -> cstr_t -> unit
     val iternext : t -> cstr_t
+
+    (* the file offset of a key's record, and a move of the iterator to
+       an offset, after which iternext returns the records at or after
+       it in file order. offsets change when the file is optimized or
+       defragmented; iterseek raises Error (Einvalid, ...) at an offset
+       where no record or free block starts. both need TC 1.4, else
+       they raise Error (Emisc, ...). *)
+    val iteroffset : t -> cstr_t -> int64
+    val iterseek : t -> int64 -> unit
     val open_ : t -> ?omode:omode list -> string -> unit
     val optimize : t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    val opts : t -> opt list
     val out : t -> cstr_t -> unit
+
+    (* a snapshot of the pages of the file in the page cache *)
+    val pages : t -> pages
     val path : t -> string
     val put : t -> cstr_t -> cstr_t -> unit
     val putasync : t -> cstr_t -> cstr_t -> unit
@@ -242,8 +414,18 @@ sig
     val tranbegin : t -> unit
     val trancommit : t -> unit
     val tune : t -> ?bnum:int64 -> ?apow:int -> ?fpow:int -> ?opts:opt list -> unit -> unit
+    (* read-modify-write of one record: the function gets the old value
+       (None if absent) and returns the new one (None to remove). on a
+       present record it runs while TC holds the method and record
+       locks, so it must not use this database, from this or any other
+       thread, or it deadlocks. on an absent one it runs outside the
+       locks and its value is put only if the record is still absent,
+       retrying otherwise, so it may run more than once and must not
+       have effects beyond its result. *)
+    val update : t -> cstr_t -> (cstr_t option -> cstr_t option) -> unit
     val vanish : t -> unit
     val vsiz : t -> cstr_t -> int
+    val warm : t -> ?progress:(int64 -> int64 -> unit) -> unit -> unit
   end
 
   include Sig with type cstr_t = string and type tclist_t = string list
@@ -255,6 +437,9 @@ module TDB :
 sig
   type itype = It_lexical | It_decimal | It_token | It_qgram | It_opt | It_void
 
+  (* column types for export *)
+  type ctype = Ct_int64 | Ct_float | Ct_string
+
   type t
 
   module type Sig =
@@ -269,10 +454,43 @@ sig
     val addint : t -> cstr_t -> int -> int
     val close : t -> unit
     val copy : t -> string -> unit
+
+    (* write columns of the whole table, or of the records with the given
+       keys (say from a query), to a columnar file that Colfile reads.
+       pkey (default true) adds the primary keys as a column. columns are
+       built a chunk at a time, full chunks going to a scratch file
+       beside path. returns the number of rows written. *)
+    val export : t -> ?keys:tclist_t -> ?pkey:bool -> string -> (string * ctype) list -> int64
+
+    (* as ADB.foreach, with the columns of each record as a map *)
+    val foreach : t -> ?batch:int -> (tclist_t -> tcmap_t array -> bool) -> unit
+
     val fsiz : t -> int64
     val fwmkeys : t -> ?max:int -> cstr_t -> tclist_t
     val genuid : t -> int64
     val get : t -> cstr_t -> tcmap_t
+
+    (* build (or with It_void drop, or with It_opt rebuild) an index
+       without blocking the table: index_start begins rebuilding the
+       table and its indexes into path ^ ".idxbuild" while writes through
+       this handle are logged; index_step copies up to n records and
+       returns false when all are copied; index_finish replays logged
+       writes and swaps the files in, closing and reopening the handle.
+       writes from other threads wait while it replays the last writes
+       and swaps, but reads there fail with Error (Einvalid, _, _); other
+       index calls raise Error (Einvalid, _, _) while it runs. a proc
+       callback must not call it. index_step uses the handle's iterator,
+       resuming at the key after the last one copied. index_progress
+       gives records copied and the record count, which is taken again
+       if copying starts over; the first never exceeds the second.
+       index_build does all of it. *)
+    val index_abort : t -> unit
+    val index_build : t -> ?step:int -> ?progress:(int64 -> int64 -> unit) -> string -> itype -> unit
+    val index_finish : t -> unit
+    val index_progress : t -> int64 * int64
+    val index_start : t -> string -> itype -> unit
+    val index_step : t -> int -> bool
+
     val iterinit : t -> unit
     val iternext : t -> cstr_t
     val open_ : t -> ?omode:omode list -> string -> unit
@@ -317,6 +535,8 @@ sig
 
   type kopt = Kw_mutab | Kw_muctrl | Kw_mubrct | Kw_noover | Kw_pulead
 
+  type agg = Ag_count | Ag_sum of string | Ag_min of string | Ag_max of string | Ag_avg of string
+
   type t
 
   module type Sig =
@@ -327,12 +547,47 @@ sig
     val new_ : TDB.t -> t
     val metasearch : ?setop:msetop -> t list -> tclist_t
 
+    (* run queries on separate tables (shards) in parallel threads and
+       merge their hits in the order set on the first query, up to max
+       results; max also limits each query while it runs, leaving the
+       queries' own limits as they were. returns the keys and, for each,
+       the position of its query in the list. *)
+    val parsearch : ?max:int -> t list -> tclist_t * int array
+
     val addcond : t -> string -> ?negate:bool -> ?noidx:bool -> qcond -> string -> unit
+
+    (* run the query and fold the hits into one result per distinct value
+       of group (at most max_groups, default 10000; more raises Error),
+       each an array with one value per agg. records without the group
+       column fall in group "". groups come in first-seen order; min, max
+       and avg are nan for groups without the column. *)
+    val aggregate : t -> ?group:string -> ?max_groups:int -> agg list -> (string * float array) list
+
     val hint : t -> string
     val kwic : t -> ?name:string -> ?width:int -> ?opts:kopt list -> tcmap_t -> tclist_t
     val proc : t -> (string -> tcmap_t ref -> qpost list) -> unit
+
+    (* proc over up to batch (default 1024) records per callback. the raw
+       keys and maps are valid only during the callback; edit maps in
+       place and return one post list per record, or Invalid_argument is
+       raised. records are fetched after the search without holding a
+       lock, so one may no longer match the query; check the columns the
+       edit relies on. a put or out is skipped if the record was written
+       or removed after it was fetched, but a write landing between that
+       check and the put can still be lost. *)
+    val proc_batch : t -> ?batch:int -> (Tclist.t -> Tcmap.t array -> qpost list array) -> unit
+
     val search : t -> tclist_t
+    val search_get : t -> ?columns:string list -> unit -> tclist_t * tcmap_t array
     val searchout : t -> unit
+
+    (* replace the expression of the n'th condition added (from 0), to
+       run the query again with new parameters. raises Error (Einvalid,
+       _, _) for regex and full-text conditions, and Error (Emisc, _, _)
+       unless the library is from the 1.4 series, whose query layout it
+       edits. *)
+    val setexpr : t -> int -> string -> unit
+
     val setlimit : t -> ?max:int -> ?skip:int -> unit -> unit
     val setorder : t -> ?qord:qord -> string -> unit
   end
@@ -341,3 +596,32 @@ sig
 
   module Fun (Tcl : Tclist_t) (Tcm : Tcmap_t) : Sig with type tclist_t = Tcl.t and type tcmap_t = Tcm.t
 end
+
+(* reader for files written by TDB.export. each accessor reads one
+   column straight into a Bigarray; numeric columns hold 0 where a
+   record had no value, and string columns hold -1 codes. *)
+module Colfile :
+sig
+  type t
+
+  (* bit i is set when row i has the column *)
+  type bitmap = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  val open_ : string -> t
+
+  val rows : t -> int
+  val columns : t -> (string * TDB.ctype) list
+  val has_keys : t -> bool
+
+  val present : t -> string -> bitmap
+  val is_present : bitmap -> int -> bool
+
+  val int64s : t -> string -> (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t
+  val floats : t -> string -> (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  (* codes index the column's dictionary *)
+  val codes : t -> string -> (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+  val dict : t -> string -> string array
+
+  val keys : t -> string array
+end
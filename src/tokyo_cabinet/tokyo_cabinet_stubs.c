@@ -1,8 +1,18 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
+#include <caml/bigarray.h>
 #include <caml/callback.h>
 #include <caml/fail.h>
 #include <caml/memory.h>
@@ -111,6 +121,322 @@ static value make_cstr(const void *string, int len)
   return vpair;
 }
 
+/* TCPDPROC for the update functions: pass Some old value to the
+   OCaml function, return its new value, or -1 to remove the record.
+   on exception return NULL so the record is left alone. TC calls this
+   under its method and record locks, so the function must not touch
+   the database. */
+static void *update_proc(const void *vbuf, int vsiz, int *sp, value **func_exn)
+{
+  value vcstr, vsome, vr;
+  void *r;
+  caml_leave_blocking_section();
+  vcstr = make_cstr(tcmemdup(vbuf, vsiz), vsiz);
+  Begin_roots1(vcstr);
+  vsome = caml_alloc_small(1, 0);
+  Field(vsome, 0) = vcstr;
+  End_roots();
+  vr = caml_callback_exn(*func_exn[0], vsome);
+  if (Is_exception_result(vr)) {
+    *func_exn[1] = Extract_exception(vr);
+    r = NULL;
+  }
+  else if (vr == Val_int(0))
+    r = (void *)-1;
+  else {
+    *sp = Int_val(Field(Field(vr, 0), 1));
+    r = tcmemdup(String_val(Field(Field(vr, 0), 0)), *sp);
+  }
+  caml_enter_blocking_section();
+  return r;
+}
+
+/* foreach: records are collected into TCLISTs inside the blocking
+   section and handed to the OCaml function a batch at a time; deliver
+   converts the batch to OCaml arguments and makes the call. */
+typedef struct foreach_batch {
+  value *func;
+  value *exn;
+  int max;
+  bool stopped;
+  TCLIST *keys;
+  TCLIST *vals;
+  value (*deliver)(struct foreach_batch *);
+} foreach_batch;
+
+static void foreach_init(foreach_batch *fb, int max, value *func, value *exn, value (*deliver)(foreach_batch *))
+{
+  fb->func = func;
+  fb->exn = exn;
+  fb->max = max > 0 ? max : 4096;
+  fb->stopped = false;
+  fb->keys = tclistnew2(fb->max);
+  fb->vals = tclistnew2(fb->max);
+  fb->deliver = deliver;
+}
+
+static void foreach_free(foreach_batch *fb)
+{
+  tclistdel(fb->keys);
+  tclistdel(fb->vals);
+}
+
+static bool foreach_flush(foreach_batch *fb)
+{
+  value vr;
+  if (tclistnum(fb->keys) == 0) return true;
+  caml_leave_blocking_section();
+  vr = fb->deliver(fb);
+  if (Is_exception_result(vr)) {
+    *fb->exn = Extract_exception(vr);
+    fb->stopped = true;
+  }
+  else if (!Bool_val(vr))
+    fb->stopped = true;
+  caml_enter_blocking_section();
+  return !fb->stopped;
+}
+
+static bool foreach_iter(const void *kbuf, int ksiz, const void *vbuf, int vsiz, foreach_batch *fb)
+{
+  tclistpush(fb->keys, kbuf, ksiz);
+  tclistpush(fb->vals, vbuf, vsiz);
+  if (tclistnum(fb->keys) < fb->max) return true;
+  return foreach_flush(fb);
+}
+
+/* keys and values go to OCaml as TCLISTs, which it then owns */
+static value foreach_deliver_lists(foreach_batch *fb)
+{
+  TCLIST *keys = fb->keys, *vals = fb->vals;
+  fb->keys = tclistnew2(fb->max);
+  fb->vals = tclistnew2(fb->max);
+  return caml_callback2_exn(*fb->func, (value)keys, (value)vals);
+}
+
+/* FDB passes ids as decimal strings */
+static value foreach_deliver_fdb(foreach_batch *fb)
+{
+  CAMLparam0();
+  CAMLlocal3(vids, vvals, v);
+  int i, n = tclistnum(fb->keys), siz;
+  const char *buf;
+  vids = caml_alloc(n, 0);
+  for (i = 0; i < n; i++) {
+    v = caml_copy_int64(tcatoi(tclistval2(fb->keys, i)));
+    Store_field(vids, i, v);
+  }
+  vvals = caml_alloc(n, 0);
+  for (i = 0; i < n; i++) {
+    buf = tclistval(fb->vals, i, &siz);
+    v = make_cstr(tcmemdup(buf, siz), siz);
+    Store_field(vvals, i, v);
+  }
+  tclistclear(fb->keys);
+  tclistclear(fb->vals);
+  v = caml_callback2_exn(*fb->func, vids, vvals);
+  CAMLreturn (v);
+}
+
+/* tctdbforeach passes each record's columns as zero-separated
+   name/value pairs (the tcstrjoin4 format) */
+static value foreach_deliver_tdb(foreach_batch *fb)
+{
+  CAMLparam0();
+  CAMLlocal2(vcols, v);
+  TCLIST *keys = fb->keys;
+  int i, n = tclistnum(fb->keys), siz;
+  const char *buf;
+  vcols = caml_alloc(n, 0);
+  for (i = 0; i < n; i++) {
+    buf = tclistval(fb->vals, i, &siz);
+    Store_field(vcols, i, (value)tcstrsplit4(buf, siz));
+  }
+  tclistclear(fb->vals);
+  fb->keys = tclistnew2(fb->max);
+  v = caml_callback2_exn(*fb->func, (value)keys, vcols);
+  CAMLreturn (v);
+}
+
+/* TC has no public count of free space, so the fragmentation ratio
+   reads the free block pool, whose entries mirror HDBFB in tchdb.c.
+   that layout holds for the 1.4 series, checked at runtime. */
+typedef struct {
+  uint64 off;
+  uint32 rsiz;
+} hdb_fb;
+
+static bool tc_layout_known(void)
+{
+  return strncmp(tcversion, "1.4.", 4) == 0;
+}
+
+/* fsiz, rnum and the fraction of the file in the free block pool, read
+   in the first callback of a foreach: it holds the method lock (and
+   for HDB the record locks) that writers, and so changes to the pool,
+   wait on. the pool holds at most fbpmax blocks, so the fraction is a
+   lower bound. nothing is read from an empty database. */
+typedef struct {
+  TCHDB *hdb;
+  bool seen;
+  uint64 fsiz;
+  uint64 rnum;
+  double frag;
+} hdb_probe;
+
+static bool hdb_probe_iter(const void *kbuf, int ksiz, const void *vbuf, int vsiz, hdb_probe *p)
+{
+  TCHDB *hdb = p->hdb;
+  hdb_fb *fbpool = hdb->fbpool;
+  uint64 fsum = 0;
+  int i;
+  p->seen = true;
+  p->fsiz = hdb->fsiz;
+  p->rnum = hdb->rnum;
+  if (fbpool && hdb->fsiz > 0) {
+    for (i = 0; i < hdb->fbpnum; i++) fsum += fbpool[i].rsiz;
+    p->frag = (double)fsum / hdb->fsiz;
+  }
+  return false;
+}
+
+/* probe an HDB, or the HDB under a BDB through the BDB's foreach */
+static bool hdb_probe_run(void *db, bool isbdb, hdb_probe *p)
+{
+  p->hdb = isbdb ? ((TCBDB *)db)->hdb : (TCHDB *)db;
+  p->seen = false;
+  p->fsiz = 0;
+  p->rnum = 0;
+  p->frag = 0.0;
+  if (!tc_layout_known()) return false;
+  if (isbdb) (void)tcbdbforeach((TCBDB *)db, (TCITER)hdb_probe_iter, p);
+  else (void)tchdbforeach((TCHDB *)db, (TCITER)hdb_probe_iter, p);
+  return p->seen;
+}
+
+/* background defrag: every interval, if the file looks idle (fsiz and
+   rnum unchanged since the last tick) and is fragmented past the
+   threshold, run a bounded defrag step. */
+typedef struct defragger {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool stop;
+  void *db;
+  bool isbdb;
+  bool (*defrag)(void *, int64);
+  double interval;
+  int64 step;
+  double threshold;
+} defragger;
+
+static void *defragger_run(defragger *dfr)
+{
+  struct timeval tv;
+  struct timespec ts;
+  hdb_probe p;
+  uint64 fsiz, rnum;
+  long long nsec;
+
+  (void)hdb_probe_run(dfr->db, dfr->isbdb, &p);
+  fsiz = p.fsiz;
+  rnum = p.rnum;
+  pthread_mutex_lock(&dfr->mutex);
+  while (!dfr->stop) {
+    gettimeofday(&tv, NULL);
+    nsec = (long long)tv.tv_usec * 1000 + (long long)(dfr->interval * 1e9);
+    ts.tv_sec = tv.tv_sec + nsec / 1000000000;
+    ts.tv_nsec = nsec % 1000000000;
+    while (!dfr->stop && pthread_cond_timedwait(&dfr->cond, &dfr->mutex, &ts) != ETIMEDOUT);
+    if (dfr->stop) break;
+    pthread_mutex_unlock(&dfr->mutex);
+    if (hdb_probe_run(dfr->db, dfr->isbdb, &p) &&
+        p.fsiz == fsiz && p.rnum == rnum && p.frag >= dfr->threshold) {
+      (void)dfr->defrag(dfr->db, dfr->step);
+      (void)hdb_probe_run(dfr->db, dfr->isbdb, &p);
+    }
+    fsiz = p.fsiz;
+    rnum = p.rnum;
+    pthread_mutex_lock(&dfr->mutex);
+  }
+  pthread_mutex_unlock(&dfr->mutex);
+  return NULL;
+}
+
+static defragger *defragger_start(void *db, bool isbdb, bool (*defrag)(void *, int64),
+                                  double interval, int64 step, double threshold)
+{
+  defragger *dfr = caml_stat_alloc(sizeof(defragger));
+  dfr->stop = false;
+  dfr->db = db;
+  dfr->isbdb = isbdb;
+  dfr->defrag = defrag;
+  dfr->interval = interval;
+  dfr->step = step;
+  dfr->threshold = threshold;
+  pthread_mutex_init(&dfr->mutex, NULL);
+  pthread_cond_init(&dfr->cond, NULL);
+  if (pthread_create(&dfr->thread, NULL, (void *(*)(void *))defragger_run, dfr) != 0) {
+    pthread_cond_destroy(&dfr->cond);
+    pthread_mutex_destroy(&dfr->mutex);
+    caml_stat_free(dfr);
+    raise_error_exn(TCETHREAD, "defrag_start");
+  }
+  return dfr;
+}
+
+/* call inside the blocking section; the thread may be mid-step */
+static void defragger_stop(defragger *dfr)
+{
+  if (!dfr) return;
+  pthread_mutex_lock(&dfr->mutex);
+  dfr->stop = true;
+  pthread_cond_signal(&dfr->cond);
+  pthread_mutex_unlock(&dfr->mutex);
+  pthread_join(dfr->thread, NULL);
+  pthread_cond_destroy(&dfr->cond);
+  pthread_mutex_destroy(&dfr->mutex);
+  caml_stat_free(dfr);
+}
+
+/* warm: pull the mapped part of a hash database file (header, bucket
+   array, then records up to xmsiz) into the page cache, reporting
+   progress to an optional OCaml function every chunk. */
+#define WARM_CHUNK (16 * 1024 * 1024)
+
+static bool warm_progress(value *vprogress, value *vexn, uint64 done, uint64 total)
+{
+  value vdone, vr;
+  if (*vprogress == Val_int(0)) return true;
+  caml_leave_blocking_section();
+  vdone = caml_copy_int64(done);
+  Begin_roots1(vdone);
+  vr = caml_copy_int64(total);
+  End_roots();
+  vr = caml_callback2_exn(Field(*vprogress, 0), vdone, vr);
+  if (Is_exception_result(vr)) *vexn = Extract_exception(vr);
+  caml_enter_blocking_section();
+  return !Is_exception_result(vr);
+}
+
+static bool warm_map(TCHDB *hdb, value *vprogress, value *vexn)
+{
+  long pagesiz = sysconf(_SC_PAGESIZE);
+  uint64 len = hdb->msiz < hdb->fsiz ? hdb->msiz : hdb->fsiz;
+  uint64 off = 0, end;
+  volatile char sink;
+  if (!hdb->map || len == 0) return true;
+  (void)madvise(hdb->map, len, MADV_WILLNEED);
+  while (off < len) {
+    end = off + WARM_CHUNK < len ? off + WARM_CHUNK : len;
+    for (; off < end; off += pagesiz) sink = hdb->map[off];
+    off = end;
+    if (!warm_progress(vprogress, vexn, end, len)) return false;
+  }
+  (void)sink;
+  return true;
+}
+
 enum omode {
   Oreader, Owriter, Ocreat, Otrunc, Onolck, Olcknb, Otsync
 };
@@ -160,6 +486,134 @@ static int opt_int_of_list(value v)
   }
 }
 
+static value opt_list_of_int(int opt)
+{
+  static const int flags[] = { HDBTLARGE, HDBTDEFLATE, HDBTBZIP, HDBTTCBS };
+  int i;
+  CAMLparam0();
+  CAMLlocal2(vlist, vcons);
+  vlist = Val_int(0);
+  for (i = 3; i >= 0; i--) {
+    if (opt & flags[i]) {
+      vcons = caml_alloc_small(2, 0);
+      Field(vcons, 0) = Val_int(i);
+      Field(vcons, 1) = vlist;
+      vlist = vcons;
+    }
+  }
+  CAMLreturn (vlist);
+}
+
+enum access {
+  Acc_normal, Acc_sequential, Acc_random, Acc_willneed, Acc_dontneed
+};
+
+/* advise: apply an access hint to a byte range of a hash database file,
+   both to the part that is mapped (madvise) and to the file itself
+   (posix_fadvise), which covers records read with pread past xmsiz.
+   DONTNEED is not passed to madvise: the kernel does not drop pages that
+   are still mapped, so fadvise drops only what was read through the fd
+   and leaves the mapped bucket array and hot records alone. Hints are
+   advisory, so only a closed database is an error. */
+static bool advise_hdb(TCHDB *hdb, int acc, uint64 off, uint64 len)
+{
+  static const int madv[] = {
+    MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, -1
+  };
+  static const int fadv[] = {
+    POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+    POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED
+  };
+  long pagesiz = sysconf(_SC_PAGESIZE);
+  uint64 mlen = hdb->msiz < hdb->fsiz ? hdb->msiz : hdb->fsiz;
+  uint64 moff;
+  if (hdb->fd < 0) return false;
+  if (len == 0 || off + len > hdb->fsiz) len = off < hdb->fsiz ? hdb->fsiz - off : 0;
+  if (madv[acc] >= 0 && hdb->map && off < mlen) {
+    moff = off - off % pagesiz;
+    (void)madvise(hdb->map + moff, (off + len < mlen ? off + len : mlen) - moff, madv[acc]);
+  }
+  (void)posix_fadvise(hdb->fd, off, len, fadv[acc]);
+  return true;
+}
+
+/* pages: a byte per page of a hash database file, from mincore on a
+   fresh read-only mapping of it (which faults nothing in), so a scan
+   can later drop just the pages it pulled into the page cache. NULL
+   with *npages 0 for a closed or empty file, or if the mapping fails. */
+static unsigned char *pages_hdb(TCHDB *hdb, uint64 *npages)
+{
+  long pagesiz = sysconf(_SC_PAGESIZE);
+  uint64 fsiz = hdb->fsiz;
+  uint64 n = (fsiz + pagesiz - 1) / pagesiz;
+  unsigned char *vec;
+  void *map;
+  *npages = 0;
+  if (hdb->fd < 0 || n == 0) return NULL;
+  map = mmap(NULL, fsiz, PROT_READ, MAP_SHARED, hdb->fd, 0);
+  if (map == MAP_FAILED) return NULL;
+  vec = malloc(n);
+  if (vec && mincore(map, fsiz, vec) == 0) *npages = n;
+  else {
+    free(vec);
+    vec = NULL;
+  }
+  munmap(map, fsiz);
+  return vec;
+}
+
+/* drop_pages: fadvise DONTNEED over each run of pages cached now and
+   not in the snapshot. pages past the snapshot were written since,
+   not read, and pages in TC's map would not be dropped anyway. */
+static void drop_pages_hdb(TCHDB *hdb, const unsigned char *before, uint64 nbefore)
+{
+  long pagesiz = sysconf(_SC_PAGESIZE);
+  uint64 mlen = hdb->map ? (hdb->msiz < hdb->fsiz ? hdb->msiz : hdb->fsiz) : 0;
+  uint64 n, i, start;
+  unsigned char *now = pages_hdb(hdb, &n);
+  if (!now) return;
+  if (n > nbefore) n = nbefore;
+  i = mlen / pagesiz;
+  while (i < n) {
+    if (!(now[i] & 1) || (before[i] & 1)) {
+      i++;
+      continue;
+    }
+    for (start = i; i < n && (now[i] & 1) && !(before[i] & 1); i++);
+    (void)posix_fadvise(hdb->fd, start * pagesiz, (i - start) * pagesiz, POSIX_FADV_DONTNEED);
+  }
+  free(now);
+}
+
+static value pages_stub(TCHDB *hdb)
+{
+  value vpages;
+  unsigned char *vec;
+  uint64 n;
+  caml_enter_blocking_section();
+  vec = pages_hdb(hdb, &n);
+  caml_leave_blocking_section();
+  vpages = caml_alloc_string(n);
+  if (n) memcpy(String_val(vpages), vec, n);
+  free(vec);
+  return vpages;
+}
+
+static void drop_pages_stub(TCHDB *hdb, value vpages)
+{
+  /* copied out, since the string may move while we run unlocked */
+  uint64 n = caml_string_length(vpages);
+  unsigned char *before;
+  if (n == 0) return;
+  before = malloc(n);
+  if (!before) caml_raise_out_of_memory();
+  memcpy(before, String_val(vpages), n);
+  caml_enter_blocking_section();
+  drop_pages_hdb(hdb, before, n);
+  free(before);
+  caml_leave_blocking_section();
+}
+
 
 
 typedef struct adb_wrap {
@@ -244,6 +698,26 @@ value otoky_adb_copy(value vadb, value vpath)
   return Val_unit;
 }
 
+CAMLprim
+value otoky_adb_foreach(value vadb, value vbatch, value vfunc)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal1(vexn);
+  adb_wrap *adbw = adb_wrap_val(vadb);
+  foreach_batch fb;
+  bool r;
+  vexn = Val_unit;
+  foreach_init(&fb, int_option(vbatch), &vfunc, &vexn, foreach_deliver_lists);
+  caml_enter_blocking_section();
+  r = tcadbforeach(adbw->adb, (TCITER)foreach_iter, &fb);
+  if (r && !fb.stopped) foreach_flush(&fb);
+  caml_leave_blocking_section();
+  foreach_free(&fb);
+  if (vexn != Val_unit) caml_raise(vexn);
+  if (!r) adb_error(adbw, "foreach");
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 TCLIST *otoky_adb_fwmkeys(value vadb, value vmax, value vprefix, value vlen)
 {
@@ -492,6 +966,7 @@ typedef struct bdb_wrap {
   TCBDB *bdb;
   int ref_count;
   value cmpfunc;
+  defragger *dfr;
 } bdb_wrap;
 
 #define bdb_wrap_val(v) (*((bdb_wrap **)(Data_custom_val(v))))
@@ -515,6 +990,7 @@ static void bdb_decr_ref_count(bdb_wrap *bdbw)
 {
   if (--bdbw->ref_count == 0) {
     caml_enter_blocking_section();
+    defragger_stop(bdbw->dfr);
     (void)tcbdbclose(bdbw->bdb);
     caml_leave_blocking_section();
     bdb_clear_cmpfunc(bdbw);
@@ -545,6 +1021,7 @@ value otoky_bdb_new(value unit)
   bdbw->bdb = bdb;
   bdbw->ref_count = 1;
   bdbw->cmpfunc = Val_unit;
+  bdbw->dfr = NULL;
   bdb_wrap_val(vbdb) = bdbw;
   return vbdb;
 }
@@ -573,12 +1050,50 @@ value otoky_bdb_addint(value vbdb, value vkey, value vlen, value vnum)
   return Val_int (num);
 }
 
+CAMLprim
+value otoky_bdb_advise(value vbdb, value voff, value vlen, value vacc)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  int64 off = int64_option(voff), len = int64_option(vlen);
+  bool r;
+  caml_enter_blocking_section();
+  r = advise_hdb(bdbw->bdb->hdb, Int_val(vacc), off < 0 ? 0 : off, len < 0 ? 0 : len);
+  caml_leave_blocking_section();
+  if (!r) raise_error_exn(TCEINVALID, "advise");
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_bdb_bnum(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  uint64_t r;
+  caml_enter_blocking_section();
+  r = tcbdbbnum(bdbw->bdb);
+  caml_leave_blocking_section();
+  if (!r) bdb_error(bdbw, "bnum");
+  return caml_copy_int64(r);
+}
+
+CAMLprim
+value otoky_bdb_bnumused(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  uint64_t r;
+  caml_enter_blocking_section();
+  r = tcbdbbnumused(bdbw->bdb);
+  caml_leave_blocking_section();
+  return caml_copy_int64(r);
+}
+
 CAMLprim
 value otoky_bdb_close(value vbdb)
 {
   bdb_wrap *bdbw = bdb_wrap_val(vbdb);
   bool r;
   caml_enter_blocking_section();
+  defragger_stop(bdbw->dfr);
+  bdbw->dfr = NULL;
   r = tcbdbclose(bdbw->bdb);
   caml_leave_blocking_section();
   bdb_clear_cmpfunc(bdbw);
@@ -598,6 +1113,69 @@ value otoky_bdb_copy(value vbdb, value vpath)
   return Val_unit;
 }
 
+CAMLprim
+value otoky_bdb_defrag(value vbdb, value vstep, value vunit)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  bool r;
+  caml_enter_blocking_section();
+  r = tcbdbdefrag(bdbw->bdb, int64_option(vstep));
+  caml_leave_blocking_section();
+  if (!r) bdb_error(bdbw, "defrag");
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_bdb_defrag_start(value vbdb, value vinterval, value vstep, value vthreshold)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  caml_enter_blocking_section();
+  defragger_stop(bdbw->dfr);
+  bdbw->dfr = NULL;
+  caml_leave_blocking_section();
+  bdbw->dfr = defragger_start(bdbw->bdb, true, (bool (*)(void *, int64))tcbdbdefrag,
+                               Double_val(vinterval), Int64_val(vstep), Double_val(vthreshold));
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_bdb_defrag_stop(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  caml_enter_blocking_section();
+  defragger_stop(bdbw->dfr);
+  bdbw->dfr = NULL;
+  caml_leave_blocking_section();
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_bdb_drop_pages(value vbdb, value vpages)
+{
+  drop_pages_stub(bdb_wrap_val(vbdb)->bdb->hdb, vpages);
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_bdb_foreach(value vbdb, value vbatch, value vfunc)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal1(vexn);
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  foreach_batch fb;
+  bool r;
+  vexn = Val_unit;
+  foreach_init(&fb, int_option(vbatch), &vfunc, &vexn, foreach_deliver_lists);
+  caml_enter_blocking_section();
+  r = tcbdbforeach(bdbw->bdb, (TCITER)foreach_iter, &fb);
+  if (r && !fb.stopped) foreach_flush(&fb);
+  caml_leave_blocking_section();
+  foreach_free(&fb);
+  if (vexn != Val_unit) caml_raise(vexn);
+  if (!r) bdb_error(bdbw, "foreach");
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 value otoky_bdb_fsiz(value vbdb)
 {
@@ -610,6 +1188,17 @@ value otoky_bdb_fsiz(value vbdb)
   return caml_copy_int64(r);
 }
 
+CAMLprim
+value otoky_bdb_frag(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  hdb_probe p;
+  caml_enter_blocking_section();
+  (void)hdb_probe_run(bdbw->bdb, true, &p);
+  caml_leave_blocking_section();
+  return caml_copy_double(p.frag);
+}
+
 CAMLprim
 TCLIST *otoky_bdb_fwmkeys(value vbdb, value vmax, value vprefix, value vlen)
 {
@@ -647,6 +1236,52 @@ TCLIST *otoky_bdb_getlist(value vbdb, value vkey, value vlen)
   return tclist;
 }
 
+CAMLprim
+value otoky_bdb_lmemb(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  uint32_t r;
+  caml_enter_blocking_section();
+  r = tcbdblmemb(bdbw->bdb);
+  caml_leave_blocking_section();
+  if (!r) bdb_error(bdbw, "lmemb");
+  return caml_copy_int32(r);
+}
+
+CAMLprim
+value otoky_bdb_lnum(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  uint64_t r;
+  caml_enter_blocking_section();
+  r = tcbdblnum(bdbw->bdb);
+  caml_leave_blocking_section();
+  return caml_copy_int64(r);
+}
+
+CAMLprim
+value otoky_bdb_nmemb(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  uint32_t r;
+  caml_enter_blocking_section();
+  r = tcbdbnmemb(bdbw->bdb);
+  caml_leave_blocking_section();
+  if (!r) bdb_error(bdbw, "nmemb");
+  return caml_copy_int32(r);
+}
+
+CAMLprim
+value otoky_bdb_nnum(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  uint64_t r;
+  caml_enter_blocking_section();
+  r = tcbdbnnum(bdbw->bdb);
+  caml_leave_blocking_section();
+  return caml_copy_int64(r);
+}
+
 CAMLprim
 value otoky_bdb_open(value vbdb, value vmode, value vname)
 {
@@ -679,6 +1314,17 @@ value otoky_bdb_optimize_bc(value *argv, int argn)
   return otoky_bdb_optimize(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
 }
 
+CAMLprim
+value otoky_bdb_opts(value vbdb)
+{
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  int r;
+  caml_enter_blocking_section();
+  r = tcbdbopts(bdbw->bdb);
+  caml_leave_blocking_section();
+  return opt_list_of_int(r);
+}
+
 CAMLprim
 value otoky_bdb_out(value vbdb, value vkey, value vlen)
 {
@@ -703,6 +1349,12 @@ value otoky_bdb_outlist(value vbdb, value vkey, value vlen)
   return Val_unit;
 }
 
+CAMLprim
+value otoky_bdb_pages(value vbdb)
+{
+  return pages_stub(bdb_wrap_val(vbdb)->bdb->hdb);
+}
+
 CAMLprim
 value otoky_bdb_path(value vbdb)
 {
@@ -979,6 +1631,45 @@ value otoky_bdb_tune_bc(value *argv, int argn)
   return otoky_bdb_tune(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
 }
 
+CAMLprim
+value otoky_bdb_update(value vbdb, value vkey, value vlen, value vfunc)
+{
+  CAMLparam2(vbdb, vfunc);
+  CAMLlocal2(vexn, vr);
+  value *func_exn[] = { &vfunc, &vexn };
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  int ksiz = Int_val(vlen), vsiz, ecode;
+  /* the OCaml callback may move vkey, so work on a copy */
+  char *kbuf = tcmemdup(String_val(vkey), ksiz), *vbuf;
+  bool r;
+  vexn = Val_unit;
+  for (;;) {
+    caml_enter_blocking_section();
+    r = tcbdbputproc(bdbw->bdb, kbuf, ksiz, NULL, 0, (TCPDPROC)update_proc, func_exn);
+    caml_leave_blocking_section();
+    if (vexn != Val_unit) { tcfree(kbuf); caml_raise(vexn); }
+    if (r) break;
+    ecode = tcbdbecode(bdbw->bdb);
+    if (ecode != TCENOREC) { tcfree(kbuf); raise_error_exn(ecode, "update"); }
+
+    /* no record: ask for a fresh value and putkeep it, retrying if we race with another writer */
+    vr = caml_callback_exn(vfunc, Val_int(0));
+    if (Is_exception_result(vr)) { tcfree(kbuf); caml_raise(Extract_exception(vr)); }
+    if (vr == Val_int(0)) break;
+    vsiz = Int_val(Field(Field(vr, 0), 1));
+    vbuf = tcmemdup(String_val(Field(Field(vr, 0), 0)), vsiz);
+    caml_enter_blocking_section();
+    r = tcbdbputkeep(bdbw->bdb, kbuf, ksiz, vbuf, vsiz);
+    caml_leave_blocking_section();
+    tcfree(vbuf);
+    if (r) break;
+    ecode = tcbdbecode(bdbw->bdb);
+    if (ecode != TCEKEEP) { tcfree(kbuf); raise_error_exn(ecode, "update"); }
+  }
+  tcfree(kbuf);
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 value otoky_bdb_vanish(value vbdb)
 {
@@ -1015,6 +1706,49 @@ value otoky_bdb_vsiz(value vbdb, value vkey, value vlen)
   return Val_int(r);
 }
 
+/* after the map, walk the first leaves, as many as the leaf cache
+   holds, so the walk does not evict what it loaded; jumping a second
+   cursor to the first key of each leaf loads the non-leaf nodes on its
+   path into the cache. progress is reported for the map only, in
+   bytes. */
+CAMLprim
+value otoky_bdb_warm(value vbdb, value vprogress, value vunit)
+{
+  CAMLparam1(vprogress);
+  CAMLlocal1(vexn);
+  bdb_wrap *bdbw = bdb_wrap_val(vbdb);
+  BDBCUR *cur, *jcur;
+  uint64 lastid = 0, n = 0, lmax;
+  const void *kbuf;
+  void *kcopy;
+  int ksiz;
+  if (!bdbw->bdb->open) raise_error_exn(TCEINVALID, "warm");
+  vexn = Val_unit;
+  caml_enter_blocking_section();
+  if (warm_map(bdbw->bdb->hdb, &vprogress, &vexn)) {
+    lmax = bdbw->bdb->lcnum;
+    cur = tcbdbcurnew(bdbw->bdb);
+    jcur = tcbdbcurnew(bdbw->bdb);
+    if (tcbdbcurfirst(cur)) {
+      do {
+        if (cur->id == lastid) continue;
+        if (n++ == lmax) break;
+        lastid = cur->id;
+        if ((kbuf = tcbdbcurkey3(cur, &ksiz))) {
+          kcopy = tcmemdup(kbuf, ksiz);
+          (void)tcbdbcurjump(jcur, kcopy, ksiz);
+          tcfree(kcopy);
+        }
+      } while (tcbdbcurnext(cur));
+    }
+    tcbdbcurdel(jcur);
+    tcbdbcurdel(cur);
+  }
+  caml_leave_blocking_section();
+  if (vexn != Val_unit) caml_raise(vexn);
+  CAMLreturn (Val_unit);
+}
+
 
 
 typedef struct bdbcur_wrap {
@@ -1262,11 +1996,31 @@ value otoky_fdb_copy(value vfdb, value vpath)
 }
 
 CAMLprim
-value otoky_fdb_fsiz(value vfdb)
+value otoky_fdb_foreach(value vfdb, value vbatch, value vfunc)
 {
+  CAMLparam1(vfunc);
+  CAMLlocal1(vexn);
   fdb_wrap *fdbw = fdb_wrap_val(vfdb);
-  uint64_t r;
-  caml_enter_blocking_section();
+  foreach_batch fb;
+  bool r;
+  vexn = Val_unit;
+  foreach_init(&fb, int_option(vbatch), &vfunc, &vexn, foreach_deliver_fdb);
+  caml_enter_blocking_section();
+  r = tcfdbforeach(fdbw->fdb, (TCITER)foreach_iter, &fb);
+  if (r && !fb.stopped) foreach_flush(&fb);
+  caml_leave_blocking_section();
+  foreach_free(&fb);
+  if (vexn != Val_unit) caml_raise(vexn);
+  if (!r) fdb_error(fdbw, "foreach");
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim
+value otoky_fdb_fsiz(value vfdb)
+{
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  uint64_t r;
+  caml_enter_blocking_section();
   r = tcfdbfsiz(fdbw->fdb);
   caml_leave_blocking_section();
   if (!r) fdb_error(fdbw, "fsiz");
@@ -1420,6 +2174,48 @@ value otoky_fdb_range(value vfdb, value vlower, value vupper, value vmax, value
   CAMLreturn(vkeys);
 }
 
+/* ids and values of a range in one call, packed into Bigarrays that own
+   the malloc'd buffers; each value is copied once, straight into place */
+CAMLprim
+value otoky_fdb_range_kv(value vfdb, value vlower, value vupper, value vmax, value vunit)
+{
+  CAMLparam0();
+  CAMLlocal4(vres, vids, voffs, vvals);
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  uint64 *keys;
+  int64 *offs = NULL;
+  char *data = NULL;
+  int i, j = 0, n, siz, width = fdbw->fdb->width;
+  caml_enter_blocking_section();
+  keys = tcfdbrange(fdbw->fdb,
+                    ((vlower == Val_int(0)) ? FDBIDMIN : Int64_val(Field(vlower, 0))),
+                    ((vupper == Val_int(0)) ? FDBIDMAX : Int64_val(Field(vupper, 0))),
+                    int_option(vmax),
+                    &n);
+  if (keys) {
+    offs = tcmalloc(sizeof(int64) * (n + 1));
+    data = tcmalloc((size_t)n * width + 1);
+    offs[0] = 0;
+    for (i = 0; i < n; i++) {
+      /* a record removed since the range scan is left out */
+      if ((siz = tcfdbget4(fdbw->fdb, keys[i], data + offs[j], width)) < 0) continue;
+      keys[j] = keys[i];
+      offs[j + 1] = offs[j] + siz;
+      j++;
+    }
+  }
+  caml_leave_blocking_section();
+  if (!keys) fdb_error(fdbw, "range_kv");
+  vids = caml_ba_alloc_dims(CAML_BA_INT64 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, keys, (intnat)j);
+  voffs = caml_ba_alloc_dims(CAML_BA_INT64 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, offs, (intnat)(j + 1));
+  vvals = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, data, (intnat)offs[j]);
+  vres = caml_alloc_small(3, 0);
+  Field(vres, 0) = vids;
+  Field(vres, 1) = voffs;
+  Field(vres, 2) = vvals;
+  CAMLreturn (vres);
+}
+
 CAMLprim
 value otoky_fdb_rnum(value vfdb)
 {
@@ -1526,9 +2322,413 @@ value otoky_fdb_width(value vfdb)
 }
 
 
+/* FDBVIEW */
+
+/* views read the FDB's map directly and the locked passes take its
+   record locks, whose count mirrors FDBRMTXNUM in tcfdb.c. that holds
+   for the 1.4 series, checked at runtime as for the HDB free block
+   pool. */
+#define FDB_RMTXNUM 127
+
+static void fdb_check_layout(const char *fn_name)
+{
+  if (!tc_layout_known()) raise_error_exn(TCEMISC, fn_name);
+}
+
+/* the last id the file has room for: the records start at array, past
+   the header */
+static int64 fdb_last_id(TCFDB *fdb)
+{
+  return (int64)(fdb->fsiz - (fdb->array - (unsigned char *)fdb->map)) / fdb->rsiz;
+}
+
+/* a view is a Bigarray over the records of an id range in the FDB's own
+   map, which TC sizes to limsiz at open, so it is stable until the
+   handle is closed or reopened. the range is clamped to the current
+   file size, since touching the map past it faults. */
+CAMLprim
+value otoky_fdbview_new(value vfdb, value vlower, value vupper, value vunit)
+{
+  CAMLparam0();
+  CAMLlocal3(vbuf, vlo, vhi);
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  TCFDB *fdb = fdbw->fdb;
+  value vview;
+  int64 lower, upper, last;
+  fdb_check_layout("FDBVIEW.new_");
+  if (!fdb->map) raise_error_exn(TCEINVALID, "FDBVIEW.new_");
+  lower = (vlower == Val_int(0)) ? (int64)fdb->min : Int64_val(Field(vlower, 0));
+  upper = (vupper == Val_int(0)) ? (int64)fdb->max : Int64_val(Field(vupper, 0));
+  last = fdb_last_id(fdb);
+  if (lower < 1) lower = 1;
+  if (upper > last) upper = last;
+  if (upper < lower)
+    vbuf = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, (intnat)0);
+  else
+    vbuf = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL, 1,
+                              fdb->array + (lower - 1) * fdb->rsiz,
+                              (intnat)((upper - lower + 1) * fdb->rsiz));
+  vlo = caml_copy_int64(lower);
+  vhi = caml_copy_int64(upper);
+  vview = caml_alloc_small(6, 0);
+  Field(vview, 0) = vbuf;
+  Field(vview, 1) = vlo;
+  Field(vview, 2) = vhi;
+  Field(vview, 3) = Val_int(fdb->rsiz);
+  Field(vview, 4) = Val_int(fdb->wsiz);
+  Field(vview, 5) = Val_int(fdb->width);
+  CAMLreturn (vview);
+}
+
+/* run body in the first callback of tcfdbforeach, which holds the
+   method lock that optimize, vanish and close wait on, with every
+   record lock taken for reading on top so no record changes. false,
+   without running body, when the FDB has no records to visit. */
+typedef struct {
+  TCFDB *fdb;
+  void (*body)(void *);
+  void *arg;
+  bool ran;
+} fdb_locked;
+
+static bool fdb_locked_iter(const void *kbuf, int ksiz, const void *vbuf, int vsiz, fdb_locked *fl)
+{
+  int i;
+  for (i = 0; i < FDB_RMTXNUM; i++)
+    pthread_rwlock_rdlock((pthread_rwlock_t *)fl->fdb->rmtxs + i);
+  fl->body(fl->arg);
+  for (i = FDB_RMTXNUM - 1; i >= 0; i--)
+    pthread_rwlock_unlock((pthread_rwlock_t *)fl->fdb->rmtxs + i);
+  fl->ran = true;
+  return false;
+}
+
+/* call with the runtime released */
+static bool fdb_run_locked(TCFDB *fdb, void (*body)(void *), void *arg)
+{
+  fdb_locked fl;
+  fl.fdb = fdb;
+  fl.body = body;
+  fl.arg = arg;
+  fl.ran = false;
+  (void)tcfdbforeach(fdb, (TCITER)fdb_locked_iter, &fl);
+  return fl.ran;
+}
+
+typedef struct {
+  value *vfunc;
+  value *vr;
+  bool exn;
+} fdb_with_lock_call;
+
+static void fdb_with_lock_body(void *arg)
+{
+  fdb_with_lock_call *c = arg;
+  value vr;
+  caml_leave_blocking_section();
+  vr = caml_callback_exn(*c->vfunc, Val_true);
+  c->exn = Is_exception_result(vr);
+  *c->vr = c->exn ? Extract_exception(vr) : vr;
+  caml_enter_blocking_section();
+}
+
+/* vfunc gets true when it runs under the locks, false when the FDB had
+   no records, in which case it runs without them */
+CAMLprim
+value otoky_fdbview_with_lock(value vfdb, value vfunc)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal1(vr);
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  fdb_with_lock_call c;
+  bool ran;
+  fdb_check_layout("FDBVIEW.with_lock");
+  if (!fdbw->fdb->mmtx) raise_error_exn(TCETHREAD, "FDBVIEW.with_lock");
+  c.vfunc = &vfunc;
+  c.vr = &vr;
+  c.exn = false;
+  caml_enter_blocking_section();
+  ran = fdb_run_locked(fdbw->fdb, fdb_with_lock_body, &c);
+  caml_leave_blocking_section();
+  if (!ran) {
+    vr = caml_callback_exn(vfunc, Val_false);
+    if (Is_exception_result(vr)) caml_raise(Extract_exception(vr));
+  }
+  else if (c.exn) caml_raise(vr);
+  CAMLreturn (vr);
+}
+
+/* reductions over an id range. each record is read as a vector of
+   elements of one type, in host byte order, starting off bytes in; the
+   loops are specialised per element type so the compiler can keep them
+   tight. the pass runs under fdb_run_locked, and the range is clamped
+   there, against the file as it is under the locks. */
+
+enum elt { El_int32, El_int64, El_float32, El_float64 };
+
+static const int elt_size[] = { 4, 8, 4, 8 };
+
+typedef struct {
+  int elt;
+  int off;
+  int n;
+} fdb_layout;
+
+static void fdb_layout_of_val(TCFDB *fdb, value vlayout, fdb_layout *l)
+{
+  l->elt = Int_val(Field(vlayout, 0));
+  l->off = Int_val(Field(vlayout, 1));
+  l->n = Int_val(Field(vlayout, 2));
+  if (l->n < 0) l->n = l->off < fdb->width ? (fdb->width - l->off) / elt_size[l->elt] : 0;
+}
+
+/* clamp [lower, upper] to the records in the file, as otoky_fdbview_new */
+static void fdb_range_bounds(TCFDB *fdb, value vlower, value vupper, int64 *lower, int64 *upper)
+{
+  int64 last = fdb_last_id(fdb);
+  *lower = (vlower == Val_int(0)) ? (int64)fdb->min : Int64_val(Field(vlower, 0));
+  *upper = (vupper == Val_int(0)) ? (int64)fdb->max : Int64_val(Field(vupper, 0));
+  if (*lower < 1) *lower = 1;
+  if (*upper > last) *upper = last;
+}
+
+/* the elements of the record at id, or NULL for an empty slot */
+static const unsigned char *fdb_rec_elts(TCFDB *fdb, int64 id, fdb_layout *l, int *n)
+{
+  const unsigned char *rp = fdb->array + (id - 1) * fdb->rsiz;
+  uint32_t size = 0;
+  int i;
+  for (i = fdb->wsiz - 1; i >= 0; i--) size = (size << 8) | rp[i];
+  rp += fdb->wsiz;
+  if (size == 0 && *rp == 0) return NULL;
+  *n = size > l->off ? (size - l->off) / elt_size[l->elt] : 0;
+  if (*n > l->n) *n = l->n;
+  return rp + l->off;
+}
+
+/* the arguments and results of one reduction pass */
+typedef struct {
+  TCFDB *fdb;
+  fdb_layout l;
+  int64 lower, upper;
+  int64 count;
+  double *sum, *min, *max;
+  int64 *hist;
+  int bins, pos;
+  double lo, hi;
+  double *q, *scores;
+} fdb_pass;
+
+#define FDB_STATS_LOOP(T) {                                     \
+    T x;                                                        \
+    for (j = 0; j < n; j++) {                                   \
+      memcpy(&x, p + j * sizeof(T), sizeof(T));                 \
+      sum[j] += x;                                              \
+      if (x < min[j]) min[j] = x;                               \
+      if (x > max[j]) max[j] = x;                               \
+    }                                                           \
+  }
+
+static void fdb_stats_pass(void *arg)
+{
+  fdb_pass *ps = arg;
+  double *sum = ps->sum, *min = ps->min, *max = ps->max;
+  const unsigned char *p;
+  int64 id, upper = ps->upper, last = fdb_last_id(ps->fdb);
+  int j, n;
+  if (upper > last) upper = last;
+  for (id = ps->lower; id <= upper; id++) {
+    if (!(p = fdb_rec_elts(ps->fdb, id, &ps->l, &n))) continue;
+    ps->count++;
+    switch (ps->l.elt) {
+    case El_int32:   FDB_STATS_LOOP(int32_t); break;
+    case El_int64:   FDB_STATS_LOOP(int64_t); break;
+    case El_float32: FDB_STATS_LOOP(float);   break;
+    case El_float64: FDB_STATS_LOOP(double);  break;
+    }
+  }
+}
+
+CAMLprim
+value otoky_fdbview_stats(value vfdb, value vlayout, value vlower, value vupper, value vunit)
+{
+  CAMLparam0();
+  CAMLlocal5(vres, vcount, vsum, vmin, vmax);
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  TCFDB *fdb = fdbw->fdb;
+  fdb_pass ps;
+  int j;
+  fdb_check_layout("FDBVIEW.stats");
+  if (!fdb->map || !fdb->mmtx) raise_error_exn(TCEINVALID, "FDBVIEW.stats");
+  ps.fdb = fdb;
+  fdb_layout_of_val(fdb, vlayout, &ps.l);
+  fdb_range_bounds(fdb, vlower, vupper, &ps.lower, &ps.upper);
+  ps.count = 0;
+  ps.sum = tcmalloc(sizeof(double) * (ps.l.n + 1));
+  ps.min = tcmalloc(sizeof(double) * (ps.l.n + 1));
+  ps.max = tcmalloc(sizeof(double) * (ps.l.n + 1));
+  for (j = 0; j < ps.l.n; j++) {
+    ps.sum[j] = 0.0;
+    ps.min[j] = INFINITY;
+    ps.max[j] = -INFINITY;
+  }
+  caml_enter_blocking_section();
+  (void)fdb_run_locked(fdb, fdb_stats_pass, &ps);
+  caml_leave_blocking_section();
+  vsum = caml_alloc(ps.l.n * Double_wosize, Double_array_tag);
+  vmin = caml_alloc(ps.l.n * Double_wosize, Double_array_tag);
+  vmax = caml_alloc(ps.l.n * Double_wosize, Double_array_tag);
+  for (j = 0; j < ps.l.n; j++) {
+    Store_double_field(vsum, j, ps.sum[j]);
+    Store_double_field(vmin, j, ps.min[j]);
+    Store_double_field(vmax, j, ps.max[j]);
+  }
+  tcfree(ps.sum);
+  tcfree(ps.min);
+  tcfree(ps.max);
+  vcount = caml_copy_int64(ps.count);
+  vres = caml_alloc_small(4, 0);
+  Field(vres, 0) = vcount;
+  Field(vres, 1) = vsum;
+  Field(vres, 2) = vmin;
+  Field(vres, 3) = vmax;
+  CAMLreturn (vres);
+}
+
+#define FDB_HIST_LOOP(T) {                                              \
+    T x;                                                                \
+    memcpy(&x, p + pos * sizeof(T), sizeof(T));                         \
+    v = x;                                                              \
+  }
+
+static void fdb_histogram_pass(void *arg)
+{
+  fdb_pass *ps = arg;
+  double lo = ps->lo, hi = ps->hi, scale = ps->bins / (ps->hi - ps->lo), v = 0.0;
+  const unsigned char *p;
+  int64 id, upper = ps->upper, last = fdb_last_id(ps->fdb);
+  int b, n, pos = ps->pos;
+  if (upper > last) upper = last;
+  for (id = ps->lower; id <= upper; id++) {
+    if (!(p = fdb_rec_elts(ps->fdb, id, &ps->l, &n)) || pos >= n) continue;
+    switch (ps->l.elt) {
+    case El_int32:   FDB_HIST_LOOP(int32_t); break;
+    case El_int64:   FDB_HIST_LOOP(int64_t); break;
+    case El_float32: FDB_HIST_LOOP(float);   break;
+    case El_float64: FDB_HIST_LOOP(double);  break;
+    }
+    if (!(v >= lo && v <= hi)) continue;
+    b = (int)((v - lo) * scale);
+    ps->hist[b < ps->bins ? b : ps->bins - 1]++;
+  }
+}
+
+CAMLprim
+value otoky_fdbview_histogram(value vfdb, value vlayout, value vlower, value vupper,
+                              value vpos, value vbins, value vlo, value vhi)
+{
+  CAMLparam0();
+  CAMLlocal1(vres);
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  TCFDB *fdb = fdbw->fdb;
+  fdb_pass ps;
+  int b;
+  fdb_check_layout("FDBVIEW.histogram");
+  ps.fdb = fdb;
+  ps.bins = Int_val(vbins);
+  ps.pos = (vpos == Val_int(0)) ? 0 : Int_val(Field(vpos, 0));
+  ps.lo = Double_val(vlo);
+  ps.hi = Double_val(vhi);
+  if (!fdb->map || !fdb->mmtx) raise_error_exn(TCEINVALID, "FDBVIEW.histogram");
+  if (ps.bins < 1 || !(ps.hi > ps.lo) || ps.pos < 0) raise_error_exn(TCEINVALID, "FDBVIEW.histogram");
+  fdb_layout_of_val(fdb, vlayout, &ps.l);
+  fdb_range_bounds(fdb, vlower, vupper, &ps.lower, &ps.upper);
+  ps.hist = tcmalloc(sizeof(int64) * ps.bins);
+  memset(ps.hist, 0, sizeof(int64) * ps.bins);
+  caml_enter_blocking_section();
+  (void)fdb_run_locked(fdb, fdb_histogram_pass, &ps);
+  caml_leave_blocking_section();
+  vres = caml_alloc(ps.bins, 0);
+  for (b = 0; b < ps.bins; b++) Store_field(vres, b, caml_copy_int64(ps.hist[b]));
+  tcfree(ps.hist);
+  CAMLreturn (vres);
+}
+
+CAMLprim
+value otoky_fdbview_histogram_bc(value *argv, int argn)
+{
+  return otoky_fdbview_histogram(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
+}
+
+#define FDB_DOT_LOOP(T) {                                       \
+    T x;                                                        \
+    for (j = 0; j < n; j++) {                                   \
+      memcpy(&x, p + j * sizeof(T), sizeof(T));                 \
+      d += x * q[j];                                            \
+    }                                                           \
+  }
+
+/* scores past the file as it is under the locks stay nan */
+static void fdb_dot_pass(void *arg)
+{
+  fdb_pass *ps = arg;
+  double *q = ps->q, d;
+  const unsigned char *p;
+  int64 id, upper = ps->upper, last = fdb_last_id(ps->fdb);
+  int j, n;
+  if (upper > last) upper = last;
+  for (id = ps->lower; id <= upper; id++) {
+    if (!(p = fdb_rec_elts(ps->fdb, id, &ps->l, &n))) continue;
+    d = 0.0;
+    switch (ps->l.elt) {
+    case El_int32:   FDB_DOT_LOOP(int32_t); break;
+    case El_int64:   FDB_DOT_LOOP(int64_t); break;
+    case El_float32: FDB_DOT_LOOP(float);   break;
+    case El_float64: FDB_DOT_LOOP(double);  break;
+    }
+    ps->scores[id - ps->lower] = d;
+  }
+}
+
+/* one score per id in the clamped range, nan for empty slots */
+CAMLprim
+value otoky_fdbview_dot(value vfdb, value vlayout, value vquery, value vlower, value vupper)
+{
+  CAMLparam1(vquery);
+  CAMLlocal3(vres, vscores, vlo);
+  fdb_wrap *fdbw = fdb_wrap_val(vfdb);
+  TCFDB *fdb = fdbw->fdb;
+  fdb_pass ps;
+  int64 i, len;
+  int j, nq = Wosize_val(vquery) / Double_wosize;
+  fdb_check_layout("FDBVIEW.dot");
+  if (!fdb->map || !fdb->mmtx) raise_error_exn(TCEINVALID, "FDBVIEW.dot");
+  ps.fdb = fdb;
+  fdb_layout_of_val(fdb, vlayout, &ps.l);
+  fdb_range_bounds(fdb, vlower, vupper, &ps.lower, &ps.upper);
+  if (ps.l.n > nq) ps.l.n = nq;
+  ps.q = tcmalloc(sizeof(double) * (nq + 1));
+  for (j = 0; j < nq; j++) ps.q[j] = Double_field(vquery, j);
+  len = ps.upper >= ps.lower ? ps.upper - ps.lower + 1 : 0;
+  vscores = caml_ba_alloc_dims(CAML_BA_FLOAT64 | CAML_BA_C_LAYOUT, 1, NULL, (intnat)len);
+  ps.scores = Caml_ba_data_val(vscores);
+  for (i = 0; i < len; i++) ps.scores[i] = NAN;
+  caml_enter_blocking_section();
+  (void)fdb_run_locked(fdb, fdb_dot_pass, &ps);
+  caml_leave_blocking_section();
+  tcfree(ps.q);
+  vlo = caml_copy_int64(ps.lower);
+  vres = caml_alloc_small(2, 0);
+  Field(vres, 0) = vlo;
+  Field(vres, 1) = vscores;
+  CAMLreturn (vres);
+}
+
+
 
 typedef struct hdb_wrap {
   TCHDB *hdb;
+  defragger *dfr;
 } hdb_wrap;
 
 #define hdb_wrap_val(v) (*((hdb_wrap **)(Data_custom_val(v))))
@@ -1537,6 +2737,7 @@ static void hdb_finalize(value vhdb)
 {
   hdb_wrap *hdbw = hdb_wrap_val(vhdb);
   caml_enter_blocking_section();
+  defragger_stop(hdbw->dfr);
   (void)tchdbclose(hdbw->hdb);
   caml_leave_blocking_section();
   tchdbdel(hdbw->hdb);
@@ -1557,6 +2758,7 @@ value otoky_hdb_new(value unit)
   tchdbsetmutex(hdb); /* XXX does this affect performance for single-threaded code? */
   hdbw = caml_stat_alloc(sizeof(hdb_wrap));
   hdbw->hdb = hdb;
+  hdbw->dfr = NULL;
   hdb_wrap_val(vhdb) = hdbw;
   return vhdb;
 }
@@ -1585,12 +2787,50 @@ value otoky_hdb_addint(value vhdb, value vkey, value vlen, value vnum)
   return Val_int (num);
 }
 
+CAMLprim
+value otoky_hdb_advise(value vhdb, value voff, value vlen, value vacc)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  int64 off = int64_option(voff), len = int64_option(vlen);
+  bool r;
+  caml_enter_blocking_section();
+  r = advise_hdb(hdbw->hdb, Int_val(vacc), off < 0 ? 0 : off, len < 0 ? 0 : len);
+  caml_leave_blocking_section();
+  if (!r) raise_error_exn(TCEINVALID, "advise");
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_hdb_bnum(value vhdb)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  uint64_t r;
+  caml_enter_blocking_section();
+  r = tchdbbnum(hdbw->hdb);
+  caml_leave_blocking_section();
+  if (!r) hdb_error(hdbw, "bnum");
+  return caml_copy_int64(r);
+}
+
+CAMLprim
+value otoky_hdb_bnumused(value vhdb)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  uint64_t r;
+  caml_enter_blocking_section();
+  r = tchdbbnumused(hdbw->hdb);
+  caml_leave_blocking_section();
+  return caml_copy_int64(r);
+}
+
 CAMLprim
 value otoky_hdb_close(value vhdb)
 {
   hdb_wrap *hdbw = hdb_wrap_val(vhdb);
   bool r;
   caml_enter_blocking_section();
+  defragger_stop(hdbw->dfr);
+  hdbw->dfr = NULL;
   r = tchdbclose(hdbw->hdb);
   caml_leave_blocking_section();
   if (!r) hdb_error(hdbw, "close");
@@ -1609,6 +2849,69 @@ value otoky_hdb_copy(value vhdb, value vpath)
   return Val_unit;
 }
 
+CAMLprim
+value otoky_hdb_defrag(value vhdb, value vstep, value vunit)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  bool r;
+  caml_enter_blocking_section();
+  r = tchdbdefrag(hdbw->hdb, int64_option(vstep));
+  caml_leave_blocking_section();
+  if (!r) hdb_error(hdbw, "defrag");
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_hdb_defrag_start(value vhdb, value vinterval, value vstep, value vthreshold)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  caml_enter_blocking_section();
+  defragger_stop(hdbw->dfr);
+  hdbw->dfr = NULL;
+  caml_leave_blocking_section();
+  hdbw->dfr = defragger_start(hdbw->hdb, false, (bool (*)(void *, int64))tchdbdefrag,
+                               Double_val(vinterval), Int64_val(vstep), Double_val(vthreshold));
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_hdb_defrag_stop(value vhdb)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  caml_enter_blocking_section();
+  defragger_stop(hdbw->dfr);
+  hdbw->dfr = NULL;
+  caml_leave_blocking_section();
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_hdb_drop_pages(value vhdb, value vpages)
+{
+  drop_pages_stub(hdb_wrap_val(vhdb)->hdb, vpages);
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_hdb_foreach(value vhdb, value vbatch, value vfunc)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal1(vexn);
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  foreach_batch fb;
+  bool r;
+  vexn = Val_unit;
+  foreach_init(&fb, int_option(vbatch), &vfunc, &vexn, foreach_deliver_lists);
+  caml_enter_blocking_section();
+  r = tchdbforeach(hdbw->hdb, (TCITER)foreach_iter, &fb);
+  if (r && !fb.stopped) foreach_flush(&fb);
+  caml_leave_blocking_section();
+  foreach_free(&fb);
+  if (vexn != Val_unit) caml_raise(vexn);
+  if (!r) hdb_error(hdbw, "foreach");
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 value otoky_hdb_fsiz(value vhdb)
 {
@@ -1621,6 +2924,17 @@ value otoky_hdb_fsiz(value vhdb)
   return caml_copy_int64(r);
 }
 
+CAMLprim
+value otoky_hdb_frag(value vhdb)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  hdb_probe p;
+  caml_enter_blocking_section();
+  (void)hdb_probe_run(hdbw->hdb, false, &p);
+  caml_leave_blocking_section();
+  return caml_copy_double(p.frag);
+}
+
 CAMLprim
 TCLIST *otoky_hdb_fwmkeys(value vhdb, value vmax, value vprefix, value vlen)
 {
@@ -1658,6 +2972,18 @@ value otoky_hdb_iterinit(value vhdb)
   return Val_unit;
 }
 
+CAMLprim
+value otoky_hdb_iterinit2(value vhdb, value vkey, value vlen)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  bool r;
+  caml_enter_blocking_section();
+  r = tchdbiterinit2(hdbw->hdb, String_val(vkey), Int_val(vlen));
+  caml_leave_blocking_section();
+  if (!r) hdb_error(hdbw, "iterinit2");
+  return Val_unit;
+}
+
 CAMLprim
 value otoky_hdb_iternext(value vhdb)
 {
@@ -1671,6 +2997,57 @@ value otoky_hdb_iternext(value vhdb)
   return make_cstr(key, len);
 }
 
+/* the iterator walks records in file order from the offset in
+   hdb->iter, skipping free blocks. iteroffset reads the offset of a
+   key's record through iterinit2, putting back the iterator's place;
+   iterseek moves the iterator to an offset once it has checked that a
+   record or free block starts there (magic bytes HDBMAGICREC and
+   HDBMAGICFB in tchdb.c). */
+#define HDB_MAGICREC 0xc8
+#define HDB_MAGICFB 0xb0
+
+CAMLprim
+value otoky_hdb_iteroffset(value vhdb, value vkey, value vlen)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  TCHDB *hdb = hdbw->hdb;
+  uint64 iter, off;
+  bool r;
+  if (!tc_layout_known()) raise_error_exn(TCEMISC, "iteroffset");
+  caml_enter_blocking_section();
+  iter = hdb->iter;
+  r = tchdbiterinit2(hdb, String_val(vkey), Int_val(vlen));
+  off = hdb->iter;
+  hdb->iter = iter;
+  caml_leave_blocking_section();
+  if (!r) hdb_error(hdbw, "iteroffset");
+  return caml_copy_int64(off);
+}
+
+CAMLprim
+value otoky_hdb_iterseek(value vhdb, value voff)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  TCHDB *hdb = hdbw->hdb;
+  uint64 off = Int64_val(voff);
+  unsigned char magic = 0;
+  bool ok;
+  if (!tc_layout_known()) raise_error_exn(TCEMISC, "iterseek");
+  if (hdb->fd < 0) raise_error_exn(TCEINVALID, "iterseek");
+  caml_enter_blocking_section();
+  if (off < hdb->frec) off = hdb->frec;
+  ok = off >= hdb->fsiz;
+  if (!ok) {
+    if (off < hdb->msiz) magic = ((unsigned char *)hdb->map)[off];
+    else if (pread(hdb->fd, &magic, 1, off) != 1) magic = 0;
+    ok = magic == HDB_MAGICREC || magic == HDB_MAGICFB;
+  }
+  if (ok) hdb->iter = off;
+  caml_leave_blocking_section();
+  if (!ok) raise_error_exn(TCEINVALID, "iterseek");
+  return Val_unit;
+}
+
 CAMLprim
 value otoky_hdb_open(value vhdb, value vmode, value vname)
 {
@@ -1702,6 +3079,17 @@ value otoky_hdb_optimize_bc(value *argv, int argn)
   return otoky_hdb_optimize(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
 }
 
+CAMLprim
+value otoky_hdb_opts(value vhdb)
+{
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  int r;
+  caml_enter_blocking_section();
+  r = tchdbopts(hdbw->hdb);
+  caml_leave_blocking_section();
+  return opt_list_of_int(r);
+}
+
 CAMLprim
 value otoky_hdb_out(value vhdb, value vkey, value vlen)
 {
@@ -1714,6 +3102,12 @@ value otoky_hdb_out(value vhdb, value vkey, value vlen)
   return Val_unit;
 }
 
+CAMLprim
+value otoky_hdb_pages(value vhdb)
+{
+  return pages_stub(hdb_wrap_val(vhdb)->hdb);
+}
+
 CAMLprim
 value otoky_hdb_path(value vhdb)
 {
@@ -1889,6 +3283,45 @@ value otoky_hdb_tune_bc(value *argv, int argn)
   return otoky_hdb_tune(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
 }
 
+CAMLprim
+value otoky_hdb_update(value vhdb, value vkey, value vlen, value vfunc)
+{
+  CAMLparam2(vhdb, vfunc);
+  CAMLlocal2(vexn, vr);
+  value *func_exn[] = { &vfunc, &vexn };
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  int ksiz = Int_val(vlen), vsiz, ecode;
+  /* the OCaml callback may move vkey, so work on a copy */
+  char *kbuf = tcmemdup(String_val(vkey), ksiz), *vbuf;
+  bool r;
+  vexn = Val_unit;
+  for (;;) {
+    caml_enter_blocking_section();
+    r = tchdbputproc(hdbw->hdb, kbuf, ksiz, NULL, 0, (TCPDPROC)update_proc, func_exn);
+    caml_leave_blocking_section();
+    if (vexn != Val_unit) { tcfree(kbuf); caml_raise(vexn); }
+    if (r) break;
+    ecode = tchdbecode(hdbw->hdb);
+    if (ecode != TCENOREC) { tcfree(kbuf); raise_error_exn(ecode, "update"); }
+
+    /* no record: ask for a fresh value and putkeep it, retrying if we race with another writer */
+    vr = caml_callback_exn(vfunc, Val_int(0));
+    if (Is_exception_result(vr)) { tcfree(kbuf); caml_raise(Extract_exception(vr)); }
+    if (vr == Val_int(0)) break;
+    vsiz = Int_val(Field(Field(vr, 0), 1));
+    vbuf = tcmemdup(String_val(Field(Field(vr, 0), 0)), vsiz);
+    caml_enter_blocking_section();
+    r = tchdbputkeep(hdbw->hdb, kbuf, ksiz, vbuf, vsiz);
+    caml_leave_blocking_section();
+    tcfree(vbuf);
+    if (r) break;
+    ecode = tchdbecode(hdbw->hdb);
+    if (ecode != TCEKEEP) { tcfree(kbuf); raise_error_exn(ecode, "update"); }
+  }
+  tcfree(kbuf);
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 value otoky_hdb_vanish(value vhdb)
 {
@@ -1913,23 +3346,137 @@ value otoky_hdb_vsiz(value vhdb, value vkey, value vlen)
   return Val_int(r);
 }
 
+CAMLprim
+value otoky_hdb_warm(value vhdb, value vprogress, value vunit)
+{
+  CAMLparam1(vprogress);
+  CAMLlocal1(vexn);
+  hdb_wrap *hdbw = hdb_wrap_val(vhdb);
+  if (hdbw->hdb->fd < 0) raise_error_exn(TCEINVALID, "warm");
+  vexn = Val_unit;
+  caml_enter_blocking_section();
+  (void)warm_map(hdbw->hdb, &vprogress, &vexn);
+  caml_leave_blocking_section();
+  if (vexn != Val_unit) caml_raise(vexn);
+  CAMLreturn (Val_unit);
+}
+
 
 
+/* background index build: rather than setindex on the live table, which
+   holds its lock for the whole scan, rebuild the table into path ^
+   ".idxbuild" with the new set of indexes, copying a bounded number of
+   records per step, while writes to the live table log their keys.
+   finish replays the logged keys and swaps the rebuilt files in, so the
+   planner only sees the index once it is complete. */
+typedef struct idx_build {
+  TCTDB *dst;
+  TCMAP *dirty;
+  char *last; /* the last key copied */
+  int lsiz;
+  char *next; /* the key after it, not yet copied */
+  int nsiz;
+  bool eof;
+  bool finishing; /* index_finish is running; other build calls are refused */
+  uint64 done;
+  uint64 total;
+} idx_build;
+
+/* ib_mutex guards ib itself, which writers on other threads test while
+   the build is set up and torn down, along with its dirty map, progress
+   counts and finishing flag. writes through the handle hold write_lock
+   shared from the write to the logging of its key, so index_finish,
+   holding it exclusive, sees every write in the old table logged. */
 typedef struct tdb_wrap {
   TCTDB *tdb;
   int ref_count;
+  int omode;
+  pthread_mutex_t ib_mutex;
+  pthread_rwlock_t write_lock;
+  idx_build *ib;
 } tdb_wrap;
 
 #define tdb_wrap_val(v) (*((tdb_wrap **)(Data_custom_val(v))))
 
-static void tdb_decr_ref_count(tdb_wrap *tdbw)
+static void tdb_dirty(tdb_wrap *tdbw, const void *kbuf, int ksiz)
 {
-  if (--tdbw->ref_count == 0) {
-    caml_enter_blocking_section();
-    (void)tctdbclose(tdbw->tdb);
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  if (tdbw->ib) tcmapputkeep(tdbw->ib->dirty, kbuf, ksiz, "", 0);
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+}
+
+static bool tdb_building(tdb_wrap *tdbw)
+{
+  bool r;
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  r = tdbw->ib != NULL;
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+  return r;
+}
+
+/* the build, unless there is none or index_finish is running */
+static idx_build *tdb_idx_build(tdb_wrap *tdbw)
+{
+  idx_build *ib;
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  ib = tdbw->ib && !tdbw->ib->finishing ? tdbw->ib : NULL;
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+  return ib;
+}
+
+#define tdb_write_begin(tdbw) pthread_rwlock_rdlock(&(tdbw)->write_lock)
+#define tdb_write_end(tdbw) pthread_rwlock_unlock(&(tdbw)->write_lock)
+
+/* paths of a table's index files, which are BDBs named after the table */
+static TCLIST *idx_paths(TCTDB *tdb)
+{
+  TCLIST *paths = tclistnew();
+  const char *path;
+  int i;
+  for (i = 0; i < tdb->inum; i++) {
+    if (tdb->idxs[i].db && (path = tcbdbpath(tdb->idxs[i].db)))
+      tclistpush2(paths, path);
+  }
+  return paths;
+}
+
+static void idx_build_free(tdb_wrap *tdbw)
+{
+  idx_build *ib = tdbw->ib;
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  tdbw->ib = NULL;
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+  tcmapdel(ib->dirty);
+  if (ib->last) tcfree(ib->last);
+  if (ib->next) tcfree(ib->next);
+  tctdbdel(ib->dst);
+  free(ib);
+}
+
+static void idx_build_abort(tdb_wrap *tdbw)
+{
+  TCLIST *paths = idx_paths(tdbw->ib->dst);
+  char *path = tcstrdup(tctdbpath(tdbw->ib->dst));
+  int i;
+  (void)tctdbclose(tdbw->ib->dst);
+  unlink(path);
+  for (i = 0; i < tclistnum(paths); i++) unlink(tclistval2(paths, i));
+  tclistdel(paths);
+  tcfree(path);
+  idx_build_free(tdbw);
+}
+
+static void tdb_decr_ref_count(tdb_wrap *tdbw)
+{
+  if (--tdbw->ref_count == 0) {
+    caml_enter_blocking_section();
+    if (tdbw->ib) idx_build_abort(tdbw);
+    (void)tctdbclose(tdbw->tdb);
     caml_leave_blocking_section();
     tctdbdel(tdbw->tdb);
-    free(tdbw);
+    pthread_mutex_destroy(&tdbw->ib_mutex);
+    pthread_rwlock_destroy(&tdbw->write_lock);
+    caml_stat_free(tdbw);
   }
 }
 
@@ -1954,17 +3501,38 @@ value otoky_tdb_new(value unit)
   tdbw = caml_stat_alloc(sizeof(tdb_wrap));
   tdbw->tdb = tdb;
   tdbw->ref_count = 1;
+  tdbw->omode = 0;
+  pthread_mutex_init(&tdbw->ib_mutex, NULL);
+  pthread_rwlock_init(&tdbw->write_lock, NULL);
+  tdbw->ib = NULL;
   tdb_wrap_val(vtdb) = tdbw;
   return vtdb;
 }
 
+enum itype { It_lexical, It_decimal, It_token, It_qgram, It_opt, It_void };
+
+static int itype_int_of_val(value vitype)
+{
+  switch (Int_val(vitype)) {
+  case It_lexical: return TDBITLEXICAL;
+  case It_decimal: return TDBITDECIMAL;
+  case It_token:   return TDBITTOKEN;
+  case It_qgram:   return TDBITQGRAM;
+  case It_opt:     return TDBITOPT;
+  default:         return TDBITVOID;
+  }
+}
+
 CAMLprim
 value otoky_tdb_adddouble(value vtdb, value vkey, value vlen, value vnum)
 {
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   double num;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbw);
   num = tctdbadddouble(tdbw->tdb, String_val(vkey), Int_val(vlen), Double_val(vnum));
+  tdb_dirty(tdbw, String_val(vkey), Int_val(vlen));
+  tdb_write_end(tdbw);
   caml_leave_blocking_section();
   if (isnan(num)) tdb_error(tdbw, "adddouble");
   return caml_copy_double(num);
@@ -1976,7 +3544,10 @@ value otoky_tdb_addint(value vtdb, value vkey, value vlen, value vnum)
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   int num;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbw);
   num = tctdbaddint(tdbw->tdb, String_val(vkey), Int_val(vlen), Int_val(vnum));
+  tdb_dirty(tdbw, String_val(vkey), Int_val(vlen));
+  tdb_write_end(tdbw);
   caml_leave_blocking_section();
   if (num == INT_MIN) tdb_error(tdbw, "addint");
   return Val_int (num);
@@ -1988,6 +3559,7 @@ value otoky_tdb_close(value vtdb)
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
   caml_enter_blocking_section();
+  if (tdbw->ib) idx_build_abort(tdbw);
   r = tctdbclose(tdbw->tdb);
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "close");
@@ -2006,6 +3578,328 @@ value otoky_tdb_copy(value vtdb, value vpath)
   return Val_unit;
 }
 
+/* columnar export. the file is a header (magic, column count, flags,
+   row count), a directory entry per column (type, name, dictionary
+   size and four section offsets and lengths), then the sections, each
+   8-byte aligned. numbers are little-endian. a column's first section
+   is a bitmap with bit i set when row i has the column; numeric columns
+   keep their values in the second, string columns their int32 codes,
+   with dictionary offsets (int64, one more than the dictionary size)
+   and bytes in the third and fourth. the primary key column, if
+   exported, is first, named "", with offsets and bytes in the second
+   and third sections. */
+
+#define COLFILE_MAGIC "OTKYCOL1"
+#define COLFILE_SECS 4
+
+/* sections are built in memory a chunk at a time; a full chunk moves to
+   a spill file next to the export, and the file is assembled from the
+   spilled chunks at the end, so memory stays bounded by the chunk size
+   per section (plus string dictionaries) however big the table */
+#define COLEXPORT_CHUNK (1 << 20)
+
+enum ctype { Ct_int64, Ct_float, Ct_string, Ct_key };
+
+typedef struct {
+  char *name;
+  int nsiz;
+  int type;
+  TCXSTR *secs[COLFILE_SECS]; /* bytes not yet spilled */
+  TCXSTR *chunks[COLFILE_SECS]; /* spill offset and length pairs */
+  uint64_t slen[COLFILE_SECS]; /* bytes spilled */
+  TCMAP *dict;
+  int64_t ndict;
+  unsigned char bits;
+} colexp;
+
+typedef struct {
+  colexp *cols;
+  int ncols;
+  int64_t nrows;
+  const char *path;
+  FILE *spill;
+  uint64_t spilled;
+  bool failed;
+} colexport;
+
+static void put_le(TCXSTR *xstr, uint64_t v, int n)
+{
+  unsigned char buf[8];
+  int i;
+  for (i = 0; i < n; i++) { buf[i] = v & 0xff; v >>= 8; }
+  tcxstrcat(xstr, buf, n);
+}
+
+static void colexp_add(colexp *c, int64_t row, const char *vbuf, int vsiz)
+{
+  const int32_t *code;
+  int32_t newcode;
+  int sp;
+  double d;
+  uint64_t u;
+  if (vbuf) c->bits |= 1 << (row & 7);
+  switch (c->type) {
+  case Ct_int64:
+    put_le(c->secs[1], vbuf ? (uint64_t)strtoll(vbuf, NULL, 10) : 0, 8);
+    break;
+  case Ct_float:
+    d = vbuf ? strtod(vbuf, NULL) : 0.0;
+    memcpy(&u, &d, sizeof(u));
+    put_le(c->secs[1], u, 8);
+    break;
+  case Ct_string:
+    if (!vbuf) newcode = -1;
+    else if ((code = tcmapget(c->dict, vbuf, vsiz, &sp))) newcode = *code;
+    else {
+      newcode = c->ndict++;
+      tcmapput(c->dict, vbuf, vsiz, &newcode, sizeof(newcode));
+      tcxstrcat(c->secs[3], vbuf, vsiz);
+      put_le(c->secs[2], c->slen[3] + tcxstrsize(c->secs[3]), 8);
+    }
+    put_le(c->secs[1], (uint32_t)newcode, 4);
+    break;
+  case Ct_key:
+    tcxstrcat(c->secs[2], vbuf, vsiz);
+    put_le(c->secs[1], c->slen[2] + tcxstrsize(c->secs[2]), 8);
+    break;
+  }
+  if ((row & 7) == 7) {
+    tcxstrcat(c->secs[0], &c->bits, 1);
+    c->bits = 0;
+  }
+}
+
+/* move a section's pending bytes to the spill file, recording where */
+static void colexp_spill(colexport *ce, colexp *c, int j)
+{
+  uint64_t chunk[2];
+  size_t siz = tcxstrsize(c->secs[j]);
+  char *spath;
+  if (siz == 0 || ce->failed) return;
+  if (!ce->spill) {
+    /* unlinked at once; the data lives until the spill is closed */
+    spath = tcsprintf("%s.spill", ce->path);
+    if ((ce->spill = fopen(spath, "w+b"))) unlink(spath);
+    tcfree(spath);
+  }
+  if (!ce->spill || fwrite(tcxstrptr(c->secs[j]), 1, siz, ce->spill) != siz) {
+    ce->failed = true;
+    return;
+  }
+  chunk[0] = ce->spilled;
+  chunk[1] = siz;
+  tcxstrcat(c->chunks[j], chunk, sizeof(chunk));
+  ce->spilled += siz;
+  c->slen[j] += siz;
+  tcxstrclear(c->secs[j]);
+}
+
+static void colexport_row(colexport *ce, const void *kbuf, int ksiz, TCMAP *cols)
+{
+  colexp *c;
+  const char *vbuf;
+  int i, j, vsiz;
+  for (i = 0; i < ce->ncols; i++) {
+    c = &ce->cols[i];
+    if (c->type == Ct_key) colexp_add(c, ce->nrows, kbuf, ksiz);
+    else {
+      vbuf = tcmapget(cols, c->name, c->nsiz, &vsiz);
+      colexp_add(c, ce->nrows, vbuf, vsiz);
+    }
+    for (j = 0; j < COLFILE_SECS; j++) {
+      if (tcxstrsize(c->secs[j]) >= COLEXPORT_CHUNK) colexp_spill(ce, c, j);
+    }
+  }
+  ce->nrows++;
+}
+
+/* foreach hands over the stored record, whose columns are
+   zero-separated name and value pairs */
+static bool colexport_iter(const void *kbuf, int ksiz, const void *vbuf, int vsiz, colexport *ce)
+{
+  TCMAP *cols = tcstrsplit4(vbuf, vsiz);
+  colexport_row(ce, kbuf, ksiz, cols);
+  tcmapdel(cols);
+  return !ce->failed;
+}
+
+static void colexport_free(colexport *ce)
+{
+  int i, j;
+  for (i = 0; i < ce->ncols; i++) {
+    for (j = 0; j < COLFILE_SECS; j++) {
+      tcxstrdel(ce->cols[i].secs[j]);
+      tcxstrdel(ce->cols[i].chunks[j]);
+    }
+    tcmapdel(ce->cols[i].dict);
+    tcfree(ce->cols[i].name);
+  }
+  tcfree(ce->cols);
+  if (ce->spill) fclose(ce->spill);
+}
+
+/* copy a section to f: its spilled chunks, then what is left in memory */
+static bool colexp_copy(colexport *ce, colexp *c, int j, char *buf, FILE *f)
+{
+  const char *chunks = tcxstrptr(c->chunks[j]);
+  int k, nchunks = tcxstrsize(c->chunks[j]) / (2 * sizeof(uint64_t));
+  uint64_t chunk[2];
+  size_t n;
+  for (k = 0; k < nchunks; k++) {
+    memcpy(chunk, chunks + k * sizeof(chunk), sizeof(chunk));
+    while (chunk[1] > 0) {
+      n = chunk[1] < COLEXPORT_CHUNK ? chunk[1] : COLEXPORT_CHUNK;
+      if (pread(fileno(ce->spill), buf, n, chunk[0]) != (ssize_t)n || fwrite(buf, 1, n, f) != n)
+        return false;
+      chunk[0] += n;
+      chunk[1] -= n;
+    }
+  }
+  return fwrite(tcxstrptr(c->secs[j]), 1, tcxstrsize(c->secs[j]), f) == tcxstrsize(c->secs[j]);
+}
+
+static bool colexport_write(colexport *ce, const char *path)
+{
+  static const char zeros[8] = { 0 };
+  TCXSTR *hdr;
+  FILE *f;
+  colexp *c;
+  char *buf;
+  uint64_t off, siz;
+  int i, j, pad;
+  bool r;
+  if (ce->failed || (ce->spill && fflush(ce->spill) != 0)) return false;
+  hdr = tcxstrnew();
+  for (i = 0; i < ce->ncols; i++) {
+    c = &ce->cols[i];
+    if (ce->nrows & 7) tcxstrcat(c->secs[0], &c->bits, 1);
+  }
+  off = 24;
+  for (i = 0; i < ce->ncols; i++)
+    off += 8 + ((ce->cols[i].nsiz + 7) & ~7) + 8 + 16 * COLFILE_SECS;
+  tcxstrcat(hdr, COLFILE_MAGIC, 8);
+  put_le(hdr, ce->ncols, 4);
+  put_le(hdr, 0, 4);
+  put_le(hdr, ce->nrows, 8);
+  for (i = 0; i < ce->ncols; i++) {
+    c = &ce->cols[i];
+    put_le(hdr, c->type, 4);
+    put_le(hdr, c->nsiz, 4);
+    tcxstrcat(hdr, c->name, c->nsiz);
+    tcxstrcat(hdr, zeros, ((c->nsiz + 7) & ~7) - c->nsiz);
+    put_le(hdr, c->ndict, 8);
+    for (j = 0; j < COLFILE_SECS; j++) {
+      siz = c->slen[j] + tcxstrsize(c->secs[j]);
+      put_le(hdr, off, 8);
+      put_le(hdr, siz, 8);
+      off += (siz + 7) & ~7;
+    }
+  }
+  if (!(f = fopen(path, "wb"))) {
+    tcxstrdel(hdr);
+    return false;
+  }
+  r = fwrite(tcxstrptr(hdr), 1, tcxstrsize(hdr), f) == tcxstrsize(hdr);
+  tcxstrdel(hdr);
+  buf = ce->spill ? tcmalloc(COLEXPORT_CHUNK) : NULL;
+  for (i = 0; r && i < ce->ncols; i++) {
+    for (j = 0; r && j < COLFILE_SECS; j++) {
+      c = &ce->cols[i];
+      siz = c->slen[j] + tcxstrsize(c->secs[j]);
+      pad = ((siz + 7) & ~7) - siz;
+      r = colexp_copy(ce, c, j, buf, f) && fwrite(zeros, 1, pad, f) == pad;
+    }
+  }
+  if (buf) tcfree(buf);
+  if (fclose(f) != 0) r = false;
+  if (!r) unlink(path);
+  return r;
+}
+
+CAMLprim
+value otoky_tdb_export(value vtdb, value vkeys, value vpkey, value vpath, value vcolumns)
+{
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  TCLIST *keys = (vkeys == Val_int(0)) ? NULL : (TCLIST *)Field(vkeys, 0);
+  TCMAP *cols;
+  colexport ce;
+  colexp *c;
+  value v;
+  char *path;
+  const char *kbuf;
+  int i, j, ksiz, ecode = TCESUCCESS;
+  bool pkey = (vpkey == Val_int(0)) ? true : Bool_val(Field(vpkey, 0));
+  ce.ncols = pkey ? 1 : 0;
+  for (v = vcolumns; v != Val_int(0); v = Field(v, 1)) ce.ncols++;
+  ce.cols = tcmalloc(sizeof(colexp) * (ce.ncols + 1));
+  ce.nrows = 0;
+  ce.spill = NULL;
+  ce.spilled = 0;
+  ce.failed = false;
+  for (i = 0, v = vcolumns; i < ce.ncols; i++) {
+    c = &ce.cols[i];
+    if (i == 0 && pkey) {
+      c->name = tcstrdup("");
+      c->type = Ct_key;
+    }
+    else {
+      c->name = tcstrdup(String_val(Field(Field(v, 0), 0)));
+      c->type = Int_val(Field(Field(v, 0), 1));
+      v = Field(v, 1);
+    }
+    c->nsiz = strlen(c->name);
+    for (j = 0; j < COLFILE_SECS; j++) {
+      c->secs[j] = tcxstrnew();
+      c->chunks[j] = tcxstrnew();
+      c->slen[j] = 0;
+    }
+    c->dict = tcmapnew();
+    c->ndict = 0;
+    c->bits = 0;
+    if (c->type == Ct_string || c->type == Ct_key) put_le(c->secs[c->type == Ct_key ? 1 : 2], 0, 8);
+  }
+  path = tcstrdup(String_val(vpath));
+  ce.path = path;
+  caml_enter_blocking_section();
+  if (keys) {
+    for (i = 0; !ce.failed && i < tclistnum(keys); i++) {
+      kbuf = tclistval(keys, i, &ksiz);
+      /* a record deleted since the query is left out */
+      if (!(cols = tctdbget(tdbw->tdb, kbuf, ksiz))) continue;
+      colexport_row(&ce, kbuf, ksiz, cols);
+      tcmapdel(cols);
+    }
+  }
+  else if (!tctdbforeach(tdbw->tdb, (TCITER)colexport_iter, &ce) && !ce.failed)
+    ecode = tctdbecode(tdbw->tdb);
+  if (ecode == TCESUCCESS && !colexport_write(&ce, path)) ecode = TCEWRITE;
+  colexport_free(&ce);
+  caml_leave_blocking_section();
+  tcfree(path);
+  if (ecode != TCESUCCESS) raise_error_exn(ecode, "export");
+  return caml_copy_int64(ce.nrows);
+}
+
+CAMLprim
+value otoky_tdb_foreach(value vtdb, value vbatch, value vfunc)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal1(vexn);
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  foreach_batch fb;
+  bool r;
+  vexn = Val_unit;
+  foreach_init(&fb, int_option(vbatch), &vfunc, &vexn, foreach_deliver_tdb);
+  caml_enter_blocking_section();
+  r = tctdbforeach(tdbw->tdb, (TCITER)foreach_iter, &fb);
+  if (r && !fb.stopped) foreach_flush(&fb);
+  caml_leave_blocking_section();
+  foreach_free(&fb);
+  if (vexn != Val_unit) caml_raise(vexn);
+  if (!r) tdb_error(tdbw, "foreach");
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 value otoky_tdb_fsiz(value vtdb)
 {
@@ -2054,6 +3948,289 @@ TCMAP *otoky_tdb_get(value vtdb, value vkey, value vlen)
   return tcmap;
 }
 
+CAMLprim
+value otoky_tdb_index_abort(value vtdb)
+{
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  bool building;
+  caml_enter_blocking_section();
+  /* exclusive, so no step is copying into the rebuilt table */
+  pthread_rwlock_wrlock(&tdbw->write_lock);
+  if ((building = tdb_idx_build(tdbw) != NULL)) idx_build_abort(tdbw);
+  pthread_rwlock_unlock(&tdbw->write_lock);
+  caml_leave_blocking_section();
+  if (!building) raise_error_exn(TCEINVALID, "index_abort");
+  return Val_unit;
+}
+
+/* replay logged keys until none are left */
+static bool idx_build_drain(tdb_wrap *tdbw)
+{
+  idx_build *ib = tdbw->ib;
+  TCMAP *dirty, *cols;
+  const char *kbuf;
+  int ksiz;
+  bool ok = true;
+  while (ok) {
+    pthread_mutex_lock(&tdbw->ib_mutex);
+    dirty = ib->dirty;
+    ib->dirty = tcmapnew();
+    pthread_mutex_unlock(&tdbw->ib_mutex);
+    if (tcmaprnum(dirty) == 0) {
+      tcmapdel(dirty);
+      break;
+    }
+    tcmapiterinit(dirty);
+    while (ok && (kbuf = tcmapiternext(dirty, &ksiz))) {
+      if ((cols = tctdbget(tdbw->tdb, kbuf, ksiz))) {
+        ok = tctdbput(ib->dst, kbuf, ksiz, cols);
+        tcmapdel(cols);
+      }
+      else if (!tctdbout(ib->dst, kbuf, ksiz) && tctdbecode(ib->dst) != TCENOREC)
+        ok = false;
+    }
+    tcmapdel(dirty);
+  }
+  return ok;
+}
+
+/* replay logged keys alongside writers, then hold them off while
+   replaying the rest, closing both tables, moving the rebuilt files
+   over the live ones (dropping index files the rebuilt table no longer
+   has) and reopening */
+static bool idx_build_finish(tdb_wrap *tdbw, int *ecode)
+{
+  idx_build *ib = tdbw->ib;
+  TCLIST *dpaths, *lpaths;
+  char *path, *dpath, *tpath;
+  int i, j, plen, dlen;
+  bool kept;
+  if (!idx_build_drain(tdbw)) {
+    *ecode = tctdbecode(ib->dst);
+    return false;
+  }
+  pthread_rwlock_wrlock(&tdbw->write_lock);
+  if (!idx_build_drain(tdbw)) {
+    pthread_rwlock_unlock(&tdbw->write_lock);
+    *ecode = tctdbecode(ib->dst);
+    return false;
+  }
+  path = tcstrdup(tctdbpath(tdbw->tdb));
+  dpath = tcstrdup(tctdbpath(ib->dst));
+  plen = strlen(path);
+  dlen = strlen(dpath);
+  dpaths = idx_paths(ib->dst);
+  lpaths = idx_paths(tdbw->tdb);
+  if (!tctdbclose(ib->dst)) *ecode = tctdbecode(ib->dst);
+  else if (!tctdbclose(tdbw->tdb)) *ecode = tctdbecode(tdbw->tdb);
+  else {
+    if (rename(dpath, path) != 0) *ecode = TCERENAME;
+    for (i = 0; *ecode == TCESUCCESS && i < tclistnum(dpaths); i++) {
+      /* the rebuilt index files are named dpath ^ suffix */
+      tpath = tcsprintf("%s%s", path, tclistval2(dpaths, i) + dlen);
+      if (rename(tclistval2(dpaths, i), tpath) != 0) *ecode = TCERENAME;
+      tcfree(tpath);
+    }
+    for (i = 0; *ecode == TCESUCCESS && i < tclistnum(lpaths); i++) {
+      kept = false;
+      for (j = 0; j < tclistnum(dpaths); j++) {
+        if (!strcmp(tclistval2(lpaths, i) + plen, tclistval2(dpaths, j) + dlen)) kept = true;
+      }
+      if (!kept) unlink(tclistval2(lpaths, i));
+    }
+    /* reopen whatever is there, so the handle stays usable */
+    if (!tctdbopen(tdbw->tdb, path, tdbw->omode & ~(HDBOCREAT | HDBOTRUNC)) && *ecode == TCESUCCESS)
+      *ecode = tctdbecode(tdbw->tdb);
+  }
+  tclistdel(dpaths);
+  tclistdel(lpaths);
+  tcfree(dpath);
+  tcfree(path);
+  idx_build_free(tdbw);
+  pthread_rwlock_unlock(&tdbw->write_lock);
+  return *ecode == TCESUCCESS;
+}
+
+/* writes from other threads wait while the files are swapped; other
+   build calls are refused from the start */
+CAMLprim
+value otoky_tdb_index_finish(value vtdb)
+{
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  idx_build *ib;
+  int ecode = TCESUCCESS;
+  bool r;
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  if ((ib = tdbw->ib) && !ib->finishing) ib->finishing = true;
+  else ib = NULL;
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+  if (!ib) raise_error_exn(TCEINVALID, "index_finish");
+  caml_enter_blocking_section();
+  r = idx_build_finish(tdbw, &ecode);
+  if (!r) {
+    pthread_mutex_lock(&tdbw->ib_mutex);
+    if (tdbw->ib) tdbw->ib->finishing = false;
+    pthread_mutex_unlock(&tdbw->ib_mutex);
+  }
+  caml_leave_blocking_section();
+  if (!r) raise_error_exn(ecode, "index_finish");
+  return Val_unit;
+}
+
+CAMLprim
+value otoky_tdb_index_progress(value vtdb)
+{
+  CAMLparam0();
+  CAMLlocal3(vdone, vtotal, vres);
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  uint64 done = 0, total = 0;
+  bool building;
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  if ((building = tdbw->ib != NULL)) {
+    done = tdbw->ib->done;
+    total = tdbw->ib->total;
+  }
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+  if (!building) raise_error_exn(TCEINVALID, "index_progress");
+  /* records added since the count can take done past it */
+  vdone = caml_copy_int64(done < total ? done : total);
+  vtotal = caml_copy_int64(total);
+  vres = caml_alloc_small(2, 0);
+  Field(vres, 0) = vdone;
+  Field(vres, 1) = vtotal;
+  CAMLreturn (vres);
+}
+
+CAMLprim
+value otoky_tdb_index_start(value vtdb, value vname, value vitype)
+{
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  TCTDB *tdb = tdbw->tdb, *dst;
+  idx_build *ib;
+  const char *path, *name = String_val(vname);
+  char *dpath;
+  int itype = itype_int_of_val(vitype), i, ecode = TCESUCCESS;
+  bool ok, found = false;
+  if (tdbw->ib || !(tdbw->omode & HDBOWRITER)) raise_error_exn(TCEINVALID, "index_start");
+  if (!(path = tctdbpath(tdb))) tdb_error(tdbw, "index_start");
+  for (i = 0; i < tdb->inum; i++) {
+    if (!strcmp(tdb->idxs[i].name, name)) {
+      found = true;
+      if (itype == TDBITOPT) itype = tdb->idxs[i].type;
+    }
+  }
+  if (itype == TDBITOPT || (itype == TDBITVOID && !found)) raise_error_exn(TCEINVALID, "index_start");
+  dpath = tcsprintf("%s.idxbuild", path);
+  caml_enter_blocking_section();
+  dst = tctdbnew();
+  tctdbsetmutex(dst);
+  ok = tctdbtune(dst, tctdbrnum(tdb) * 2, -1, -1, tdb->opts) &&
+    tctdbopen(dst, dpath, HDBOWRITER | HDBOCREAT | HDBOTRUNC);
+  for (i = 0; ok && i < tdb->inum; i++) {
+    if (strcmp(tdb->idxs[i].name, name))
+      ok = tctdbsetindex(dst, tdb->idxs[i].name, tdb->idxs[i].type);
+  }
+  if (ok && itype != TDBITVOID) ok = tctdbsetindex(dst, name, itype);
+  if (!ok) {
+    ecode = tctdbecode(dst);
+    (void)tctdbclose(dst);
+    tctdbdel(dst);
+    unlink(dpath);
+  }
+  caml_leave_blocking_section();
+  tcfree(dpath);
+  if (!ok) raise_error_exn(ecode, "index_start");
+  ib = malloc(sizeof(idx_build));
+  ib->dst = dst;
+  ib->dirty = tcmapnew();
+  ib->last = NULL;
+  ib->lsiz = 0;
+  ib->next = NULL;
+  ib->nsiz = 0;
+  ib->eof = false;
+  ib->finishing = false;
+  ib->done = 0;
+  ib->total = tctdbrnum(tdb);
+  pthread_mutex_lock(&tdbw->ib_mutex);
+  tdbw->ib = ib;
+  pthread_mutex_unlock(&tdbw->ib_mutex);
+  return Val_unit;
+}
+
+/* copy up to n records, resuming at the key after the last one copied,
+   which each step looks up ahead; this uses the handle's iterator. if
+   that key has since been removed, copying resumes after the last key
+   copied, and if that one is gone too, it starts over, which is safe
+   since later copies overwrite; the progress counts start over with
+   it. */
+CAMLprim
+value otoky_tdb_index_step(value vtdb, value vn)
+{
+  tdb_wrap *tdbw = tdb_wrap_val(vtdb);
+  idx_build *ib;
+  TCTDB *tdb = tdbw->tdb;
+  TCMAP *cols;
+  char *kbuf;
+  int n = Int_val(vn), i = 0, ksiz, ecode = TCESUCCESS;
+  bool ok, restart = false, eof = true;
+  caml_enter_blocking_section();
+  /* held shared so index_finish waits for the copy before closing the
+     rebuilt table */
+  tdb_write_begin(tdbw);
+  ib = tdb_idx_build(tdbw);
+  if (ib && !ib->eof) {
+    if (ib->next && tctdbiterinit2(tdb, ib->next, ib->nsiz)) ok = true;
+    else if (ib->last && tctdbiterinit2(tdb, ib->last, ib->lsiz)) {
+      ok = true;
+      tcfree(tctdbiternext(tdb, &ksiz));
+    }
+    else {
+      restart = ib->last != NULL;
+      ok = tctdbiterinit(tdb);
+    }
+    pthread_mutex_lock(&tdbw->ib_mutex);
+    if (restart) {
+      ib->done = 0;
+      ib->total = tctdbrnum(tdb);
+    }
+    pthread_mutex_unlock(&tdbw->ib_mutex);
+    for (i = 0; ok && i < n; i++) {
+      if (!(kbuf = tctdbiternext(tdb, &ksiz))) {
+        ib->eof = true;
+        break;
+      }
+      if ((cols = tctdbget(tdb, kbuf, ksiz))) {
+        ok = tctdbput(ib->dst, kbuf, ksiz, cols);
+        tcmapdel(cols);
+        if (!ok) ecode = tctdbecode(ib->dst);
+      }
+      if (ib->last) tcfree(ib->last);
+      ib->last = kbuf;
+      ib->lsiz = ksiz;
+    }
+    if (ib->next) tcfree(ib->next);
+    ib->next = NULL;
+    if (ok && !ib->eof) {
+      if ((kbuf = tctdbiternext(tdb, &ksiz))) {
+        ib->next = kbuf;
+        ib->nsiz = ksiz;
+      }
+      else ib->eof = true;
+    }
+    pthread_mutex_lock(&tdbw->ib_mutex);
+    ib->done += i;
+    if (ib->eof) ib->total = ib->done;
+    pthread_mutex_unlock(&tdbw->ib_mutex);
+    if (!ok && ecode == TCESUCCESS) ecode = tctdbecode(tdb);
+  }
+  if (ib) eof = ib->eof;
+  tdb_write_end(tdbw);
+  caml_leave_blocking_section();
+  if (!ib) raise_error_exn(TCEINVALID, "index_step");
+  if (ecode != TCESUCCESS) raise_error_exn(ecode, "index_step");
+  return Val_bool(!eof);
+}
+
 CAMLprim
 value otoky_tdb_iterinit(value vtdb)
 {
@@ -2084,8 +4261,9 @@ value otoky_tdb_open(value vtdb, value vmode, value vname)
 {
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
+  tdbw->omode = omode_int_of_list(vmode);
   caml_enter_blocking_section();
-  r = tctdbopen(tdbw->tdb, String_val(vname), omode_int_of_list(vmode));
+  r = tctdbopen(tdbw->tdb, String_val(vname), tdbw->omode);
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "open");
   return Val_unit;
@@ -2116,7 +4294,10 @@ value otoky_tdb_out(value vtdb, value vkey, value vlen)
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbw);
   r = tctdbout(tdbw->tdb, String_val(vkey), Int_val(vlen));
+  tdb_dirty(tdbw, String_val(vkey), Int_val(vlen));
+  tdb_write_end(tdbw);
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "out");
   return Val_unit;
@@ -2140,7 +4321,10 @@ value otoky_tdb_put(value vtdb, value vkey, value vkeylen, TCMAP *tcmap)
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbw);
   r = tctdbput(tdbw->tdb, String_val(vkey), Int_val(vkeylen), tcmap);
+  tdb_dirty(tdbw, String_val(vkey), Int_val(vkeylen));
+  tdb_write_end(tdbw);
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "put");
   return Val_unit;
@@ -2152,7 +4336,10 @@ value otoky_tdb_putcat(value vtdb, value vkey, value vkeylen, TCMAP *tcmap)
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbw);
   r = tctdbputcat(tdbw->tdb, String_val(vkey), Int_val(vkeylen), tcmap);
+  tdb_dirty(tdbw, String_val(vkey), Int_val(vkeylen));
+  tdb_write_end(tdbw);
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "putcat");
   return Val_unit;
@@ -2164,7 +4351,10 @@ value otoky_tdb_putkeep(value vtdb, value vkey, value vkeylen, TCMAP *tcmap)
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbw);
   r = tctdbputkeep(tdbw->tdb, String_val(vkey), Int_val(vkeylen), tcmap);
+  tdb_dirty(tdbw, String_val(vkey), Int_val(vkeylen));
+  tdb_write_end(tdbw);
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "putkeep");
   return Val_unit;
@@ -2206,22 +4396,13 @@ value otoky_tdb_setdfunit(value vtdb, value vdfunit)
   return Val_unit;
 }
 
-enum itype { It_lexical, It_decimal, It_token, It_qgram, It_opt, It_void };
 
 CAMLprim
 value otoky_tdb_setindex(value vtdb, value vname, value vkeep, value vitype)
 {
   tdb_wrap *tdbw = tdb_wrap_val(vtdb);
   bool r;
-  int itype = 0;
-  switch (Int_val(vitype)) {
-  case It_lexical: itype = TDBITLEXICAL; break;
-  case It_decimal: itype = TDBITDECIMAL; break;
-  case It_token:   itype = TDBITTOKEN;   break;
-  case It_qgram:   itype = TDBITQGRAM;   break;
-  case It_opt:     itype = TDBITOPT;     break;
-  case It_void:    itype = TDBITVOID;    break;
-  }
+  int itype = itype_int_of_val(vitype);
   if (bool_option(vkeep)) itype |= TDBITKEEP;
   caml_enter_blocking_section();
   r = tctdbsetindex(tdbw->tdb, String_val(vname), itype);
@@ -2316,6 +4497,17 @@ value otoky_tdb_vanish(value vtdb)
   bool r;
   caml_enter_blocking_section();
   r = tctdbvanish(tdbw->tdb);
+  if (r) {
+    /* nothing left to copy; only writes from here on matter */
+    pthread_mutex_lock(&tdbw->ib_mutex);
+    if (tdbw->ib) {
+      r = tctdbvanish(tdbw->ib->dst);
+      tcmapclear(tdbw->ib->dirty);
+      tdbw->ib->eof = true;
+      tdbw->ib->total = tdbw->ib->done;
+    }
+    pthread_mutex_unlock(&tdbw->ib_mutex);
+  }
   caml_leave_blocking_section();
   if (!r) tdb_error(tdbw, "vanish");
   return Val_unit;
@@ -2382,7 +4574,7 @@ value otoky_tdbqry_addcond(value vtdbqry, value vname, value vnegate, value vnoi
 {
   tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
   int op = 0;
-  switch (Int_val(op)) {
+  switch (Int_val(vop)) {
   case Qc_streq:   op = TDBQCSTREQ;   break;
   case Qc_strinc:  op = TDBQCSTRINC;  break;
   case Qc_strbw:   op = TDBQCSTRBW;   break;
@@ -2417,6 +4609,134 @@ value otoky_tdbqry_addcond_bc(value *argv, int argn)
   return otoky_tdbqry_addcond(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
 }
 
+/* Ag_count is a constant constructor; the others carry a column name */
+enum agg { Ag_sum, Ag_min, Ag_max, Ag_avg };
+#define AG_COUNT (-1)
+
+/* aggregate: search, then fold each hit's record into per-group
+   accumulators in C, so only the results cross into OCaml. acc and cnt
+   hold one slot per (group, aggregate). a count with no group needs no
+   records at all. */
+CAMLprim
+value otoky_tdbqry_aggregate(value vtdbqry, value vgroup, value vmaxgroups, value vaggs)
+{
+  CAMLparam0();
+  CAMLlocal4(vres, vcons, vpair, vvals);
+  tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
+  int maxgroups = int_option(vmaxgroups);
+  char *group = NULL;
+  int *ops, nagg = 0, ngroups = 0, cap = 16, i, a, g, pksiz, gsiz, vsiz;
+  TCLIST *names = tclistnew(), *pkeys;
+  TCMAP *groups = tcmapnew(), *cols;
+  double *acc, *cnt, num;
+  const char *pkbuf, *gbuf, *vbuf;
+  const int *gidx;
+  bool toomany = false, fetch = false;
+  value v;
+  if (maxgroups < 0) maxgroups = 10000;
+  if (vgroup != Val_int(0)) group = tcstrdup(String_val(Field(vgroup, 0)));
+  for (v = vaggs; v != Val_int(0); v = Field(v, 1)) nagg++;
+  ops = tcmalloc(sizeof(int) * (nagg + 1));
+  for (a = 0, v = vaggs; v != Val_int(0); a++, v = Field(v, 1)) {
+    if (Is_long(Field(v, 0))) {
+      ops[a] = AG_COUNT;
+      tclistpush2(names, "");
+    }
+    else {
+      ops[a] = Tag_val(Field(v, 0));
+      tclistpush2(names, String_val(Field(Field(v, 0), 0)));
+      fetch = true;
+    }
+  }
+  if (group) fetch = true;
+  acc = tcmalloc(sizeof(double) * cap * (nagg + 1));
+  cnt = tcmalloc(sizeof(double) * cap * (nagg + 1));
+  caml_enter_blocking_section();
+  pkeys = tctdbqrysearch(tdbqryw->tdbqry);
+  if (pkeys && !fetch) {
+    g = 0;
+    ngroups = 1;
+    tcmapput(groups, "", 0, &g, sizeof(g));
+    for (a = 0; a < nagg; a++) acc[a] = cnt[a] = tclistnum(pkeys);
+  }
+  else if (pkeys) {
+    for (i = 0; i < tclistnum(pkeys) && !toomany; i++) {
+      pkbuf = tclistval(pkeys, i, &pksiz);
+      if (!(cols = tctdbget(tdbqryw->tdbw->tdb, pkbuf, pksiz))) continue;
+      gbuf = group ? tcmapget(cols, group, strlen(group), &gsiz) : "";
+      if (!gbuf) {
+        gbuf = "";
+        gsiz = 0;
+      }
+      else if (!group) gsiz = 0;
+      if ((gidx = tcmapget(groups, gbuf, gsiz, &vsiz))) g = *gidx;
+      else if (ngroups >= maxgroups) toomany = true;
+      else {
+        g = ngroups++;
+        tcmapput(groups, gbuf, gsiz, &g, sizeof(g));
+        if (ngroups > cap) {
+          cap *= 2;
+          acc = tcrealloc(acc, sizeof(double) * cap * (nagg + 1));
+          cnt = tcrealloc(cnt, sizeof(double) * cap * (nagg + 1));
+        }
+        for (a = 0; a < nagg; a++) acc[g * nagg + a] = cnt[g * nagg + a] = 0;
+      }
+      for (a = 0; a < nagg && !toomany; a++) {
+        if (ops[a] == AG_COUNT) {
+          acc[g * nagg + a] += 1;
+          continue;
+        }
+        if (!(vbuf = tcmapget2(cols, tclistval2(names, a)))) continue;
+        num = tcatof(vbuf);
+        switch (ops[a]) {
+        case Ag_sum: case Ag_avg: acc[g * nagg + a] += num; break;
+        case Ag_min: if (!cnt[g * nagg + a] || num < acc[g * nagg + a]) acc[g * nagg + a] = num; break;
+        case Ag_max: if (!cnt[g * nagg + a] || num > acc[g * nagg + a]) acc[g * nagg + a] = num; break;
+        }
+        cnt[g * nagg + a] += 1;
+      }
+      tcmapdel(cols);
+    }
+  }
+  if (pkeys) tclistdel(pkeys);
+  caml_leave_blocking_section();
+  if (group) tcfree(group);
+  tclistdel(names);
+  if (!pkeys || toomany) {
+    tcmapdel(groups);
+    tcfree(ops);
+    tcfree(acc);
+    tcfree(cnt);
+    if (toomany) raise_error_exn(TCEMISC, "aggregate");
+    tdbqry_error(tdbqryw, "aggregate");
+  }
+  /* the list comes out in reverse; the caller puts it back in order */
+  vres = Val_int(0);
+  tcmapiterinit(groups);
+  while ((gbuf = tcmapiternext(groups, &gsiz))) {
+    g = *(const int *)tcmapiterval(gbuf, &vsiz);
+    vvals = caml_alloc(nagg * Double_wosize, Double_array_tag);
+    for (a = 0; a < nagg; a++) {
+      num = acc[g * nagg + a];
+      if (ops[a] != AG_COUNT && cnt[g * nagg + a] == 0) num = ops[a] == Ag_sum ? 0 : NAN;
+      else if (ops[a] == Ag_avg) num /= cnt[g * nagg + a];
+      Store_double_field(vvals, a, num);
+    }
+    vpair = caml_alloc_tuple(2);
+    Store_field(vpair, 0, copy_string_length(gbuf, gsiz));
+    Store_field(vpair, 1, vvals);
+    vcons = caml_alloc_small(2, 0);
+    Field(vcons, 0) = vpair;
+    Field(vcons, 1) = vres;
+    vres = vcons;
+  }
+  tcmapdel(groups);
+  tcfree(ops);
+  tcfree(acc);
+  tcfree(cnt);
+  CAMLreturn (vres);
+}
+
 CAMLprim
 value otoky_tdbqry_hint(value vtdbqry)
 {
@@ -2463,15 +4783,17 @@ TCLIST *otoky_tdbqry_metasearch(value vsetop, value vqrys)
   int num;
   TCLIST *tclist;
   int setop = TDBMSUNION;
-  switch (Int_val(vsetop)) {
-  case Ms_union: setop = TDBMSUNION; break;
-  case Ms_isect: setop = TDBMSISECT; break;
-  case Ms_diff:  setop = TDBMSDIFF;  break;
+  if (vsetop != Val_int(0)) {
+    switch (Int_val(Field(vsetop, 0))) {
+    case Ms_union: setop = TDBMSUNION; break;
+    case Ms_isect: setop = TDBMSISECT; break;
+    case Ms_diff:  setop = TDBMSDIFF;  break;
+    }
   }
   for (num = 0, vqrysp = vqrys; vqrysp != Val_int(0); vqrysp = Field(vqrysp, 1))
     num++;
   qrys = tcmalloc(sizeof(TDBQRY *) * num);
-  for (num = 0; vqrysp != Val_int(0); vqrysp = Field(vqrysp, 1))
+  for (num = 0, vqrysp = vqrys; vqrysp != Val_int(0); vqrysp = Field(vqrysp, 1))
     qrys[num++] = tdbqry_wrap_val(Field(vqrysp, 0))->tdbqry;
   caml_enter_blocking_section();
   tclist = tctdbmetasearch(qrys, num, setop);
@@ -2482,8 +4804,154 @@ TCLIST *otoky_tdbqry_metasearch(value vsetop, value vqrys)
   return tclist;
 }
 
+/* parsearch: run each query (typically one per shard of a table) in its
+   own thread, then merge. with an order on the queries, each thread also
+   fetches the order column of its hits, and the merge takes the best
+   head of the shards until max results. max also becomes each query's
+   limit for the run, so no shard returns more than the merge can use;
+   the caller's limit and skip are put back afterwards. */
+typedef struct {
+  pthread_t thread;
+  TDBQRY *qry;
+  TCLIST *res;
+  TCLIST *vals;
+  int cur;
+  int max;
+  int skip;
+} par_shard;
+
+static void *parsearch_run(void *arg)
+{
+  par_shard *sh = arg;
+  TCMAP *cols;
+  const char *pkbuf, *vbuf;
+  int i, pksiz, vsiz;
+  sh->res = tctdbqrysearch(sh->qry);
+  if (!sh->res || !sh->qry->oname || !sh->qry->oname[0]) return NULL;
+  sh->vals = tclistnew2(tclistnum(sh->res));
+  for (i = 0; i < tclistnum(sh->res); i++) {
+    pkbuf = tclistval(sh->res, i, &pksiz);
+    vbuf = NULL;
+    if ((cols = tctdbget(sh->qry->tdb, pkbuf, pksiz)))
+      vbuf = tcmapget(cols, sh->qry->oname, strlen(sh->qry->oname), &vsiz);
+    if (vbuf) tclistpush(sh->vals, vbuf, vsiz);
+    else tclistpush2(sh->vals, "");
+    if (cols) tcmapdel(cols);
+  }
+  return NULL;
+}
+
+/* compare the heads of two shards in the order of the queries */
+static int parsearch_cmp(par_shard *a, par_shard *b, int otype)
+{
+  TCLIST *av = a->vals ? a->vals : a->res, *bv = b->vals ? b->vals : b->res;
+  const char *abuf, *bbuf;
+  int asiz, bsiz;
+  double anum, bnum;
+  abuf = tclistval(av, a->cur, &asiz);
+  bbuf = tclistval(bv, b->cur, &bsiz);
+  switch (otype) {
+  case TDBQOSTRASC:  return tccmplexical(abuf, asiz, bbuf, bsiz, NULL);
+  case TDBQOSTRDESC: return -tccmplexical(abuf, asiz, bbuf, bsiz, NULL);
+  }
+  anum = tcatof(abuf);
+  bnum = tcatof(bbuf);
+  if (otype == TDBQONUMDESC) return anum > bnum ? -1 : anum < bnum;
+  return anum < bnum ? -1 : anum > bnum;
+}
+
+CAMLprim
+value otoky_tdbqry_parsearch(value vmax, value vqrys)
+{
+  CAMLparam1(vqrys);
+  CAMLlocal2(vfrom, vres);
+  value vqrysp;
+  par_shard *shards;
+  TCLIST *keys;
+  int *from;
+  int max = int_option(vmax), num, i, best, n = 0, otype, ksiz, failed = -1;
+  const char *kbuf;
+  bool ordered;
+  for (num = 0, vqrysp = vqrys; vqrysp != Val_int(0); vqrysp = Field(vqrysp, 1))
+    num++;
+  if (num == 0) raise_error_exn(TCEINVALID, "parsearch");
+  shards = tcmalloc(sizeof(par_shard) * num);
+  for (num = 0, vqrysp = vqrys; vqrysp != Val_int(0); vqrysp = Field(vqrysp, 1), num++) {
+    shards[num].qry = tdbqry_wrap_val(Field(vqrysp, 0))->tdbqry;
+    shards[num].res = shards[num].vals = NULL;
+    shards[num].cur = 0;
+    shards[num].max = shards[num].qry->max;
+    shards[num].skip = shards[num].qry->skip;
+    if (max >= 0) tctdbqrysetlimit(shards[num].qry, max, 0);
+  }
+  ordered = shards[0].qry->oname != NULL;
+  otype = shards[0].qry->otype;
+  if (max < 0) max = INT_MAX;
+  keys = tclistnew();
+  from = tcmalloc(sizeof(int) * 64);
+  caml_enter_blocking_section();
+  for (i = 0; i < num; i++) {
+    /* if no thread can be had, run the shard here */
+    if (pthread_create(&shards[i].thread, NULL, parsearch_run, shards + i) != 0) {
+      shards[i].thread = pthread_self();
+      parsearch_run(shards + i);
+    }
+  }
+  for (i = 0; i < num; i++) {
+    if (!pthread_equal(shards[i].thread, pthread_self())) pthread_join(shards[i].thread, NULL);
+    if (!shards[i].res && failed < 0) failed = i;
+    tctdbqrysetlimit(shards[i].qry, shards[i].max, shards[i].skip);
+  }
+  while (failed < 0 && n < max) {
+    best = -1;
+    for (i = 0; i < num; i++) {
+      if (shards[i].cur >= tclistnum(shards[i].res)) continue;
+      if (best < 0) best = i;
+      else if (parsearch_cmp(shards + i, shards + best, otype) < 0) best = i;
+      if (!ordered) break;
+    }
+    if (best < 0) break;
+    kbuf = tclistval(shards[best].res, shards[best].cur++, &ksiz);
+    tclistpush(keys, kbuf, ksiz);
+    if (n % 64 == 0) from = tcrealloc(from, sizeof(int) * (n + 64));
+    from[n++] = best;
+  }
+  for (i = 0; i < num; i++) {
+    if (shards[i].res) tclistdel(shards[i].res);
+    if (shards[i].vals) tclistdel(shards[i].vals);
+  }
+  caml_leave_blocking_section();
+  tcfree(shards);
+  if (failed >= 0) {
+    tcfree(from);
+    tclistdel(keys);
+    for (vqrysp = vqrys; failed > 0; failed--) vqrysp = Field(vqrysp, 1);
+    tdbqry_error(tdbqry_wrap_val(Field(vqrysp, 0)), "parsearch");
+  }
+  vfrom = caml_alloc(n, 0);
+  for (i = 0; i < n; i++) Store_field(vfrom, i, Val_int(from[i]));
+  tcfree(from);
+  vres = caml_alloc_small(2, 0);
+  Field(vres, 0) = (value)keys;
+  Field(vres, 1) = vfrom;
+  CAMLreturn (vres);
+}
+
 enum qpost { Qp_put, Qp_out, Qp_stop };
 
+static int qposts_int_of_list(value vqposts)
+{
+  int qposts = 0;
+  for (; vqposts != Val_int(0); vqposts = Field(vqposts, 1)) {
+    switch (Int_val(Field(vqposts, 0))) {
+    case Qp_put:  qposts |= TDBQPPUT;  break;
+    case Qp_out:  qposts |= TDBQPOUT;  break;
+    case Qp_stop: qposts |= TDBQPSTOP; break;
+    }
+  }
+  return qposts;
+}
+
 static int tdbqry_proc(const void *pkbuf, int pksiz, TCMAP *cols, value **func_exn)
 {
   value vqposts;
@@ -2494,16 +4962,9 @@ static int tdbqry_proc(const void *pkbuf, int pksiz, TCMAP *cols, value **func_e
     *func_exn[1] = Extract_exception(vqposts);
     qposts = TDBQPSTOP;
   }
-  else {
-    for (; vqposts != Val_int(0); vqposts = Field(vqposts, 1)) {
-      switch (Int_val(Field(vqposts, 0))) {
-      case Qp_put:  qposts |= TDBQPPUT;  break;
-      case Qp_out:  qposts |= TDBQPOUT;  break;
-      case Qp_stop: qposts |= TDBQPSTOP; break;
-      }
-    }
-  }
+  else qposts = qposts_int_of_list(vqposts);
   caml_enter_blocking_section();
+  if (qposts & (TDBQPPUT | TDBQPOUT)) tdb_dirty((tdb_wrap *)func_exn[2], pkbuf, pksiz);
   return qposts;
 }
 
@@ -2512,18 +4973,127 @@ value otoky_tdbqry_proc(value vtdbqry, value vfunc)
 {
   CAMLparam1(vfunc);
   CAMLlocal1(vexn);
-  value *func_exn[] = { &vfunc, &vexn };
   tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
+  /* the table rides along for index build logging */
+  value *func_exn[] = { &vfunc, &vexn, (value *)tdbqryw->tdbw };
   bool r;
   vexn = Val_unit;
   caml_enter_blocking_section();
+  tdb_write_begin(tdbqryw->tdbw);
   r = tctdbqryproc(tdbqryw->tdbqry, (TDBQRYPROC)tdbqry_proc, func_exn);
+  tdb_write_end(tdbqryw->tdbw);
   caml_leave_blocking_section();
   if (vexn != Val_unit) caml_raise (vexn);
   if (!r) tdbqry_error(tdbqryw, "proc");
   CAMLreturn (Val_unit);
 }
 
+/* whether two records have the same columns and values */
+static bool tcmap_same(TCMAP *a, TCMAP *b)
+{
+  const char *kbuf, *av, *bv;
+  int ksiz, asiz, bsiz;
+  if (tcmaprnum(a) != tcmaprnum(b)) return false;
+  tcmapiterinit(a);
+  while ((kbuf = tcmapiternext(a, &ksiz))) {
+    av = tcmapiterval(kbuf, &asiz);
+    bv = tcmapget(b, kbuf, ksiz, &bsiz);
+    if (!bv || asiz != bsiz || memcmp(av, bv, asiz)) return false;
+  }
+  return true;
+}
+
+/* batched proc: search, then fetch the hits batch records at a time and
+   hand them to OCaml in one callback as raw keys and maps, which it may
+   edit in place. the returned posts are applied to the batch in order;
+   a stop takes effect after its own record. unlike tctdbqryproc this
+   does not hold the write lock across the whole run: a put or out is
+   applied only if the record is still as it was fetched, and skipped
+   otherwise, as is an out of a record already gone. */
+CAMLprim
+value otoky_tdbqry_proc_batch(value vtdbqry, value vbatch, value vfunc)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal3(vexn, vcols, vposts);
+  tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
+  TCTDB *tdb = tdbqryw->tdbw->tdb;
+  int batch = int_option(vbatch);
+  TCLIST *pkeys, *keys;
+  TCMAP **maps, **origs, *cur;
+  int *posts;
+  const char *pkbuf;
+  int i = 0, j, n, m, pksiz;
+  bool ok = true, stop = false, short_posts = false;
+  if (batch <= 0) batch = 1024;
+  vexn = Val_unit;
+  caml_enter_blocking_section();
+  pkeys = tctdbqrysearch(tdbqryw->tdbqry);
+  caml_leave_blocking_section();
+  if (!pkeys) tdbqry_error(tdbqryw, "proc_batch");
+  maps = tcmalloc(sizeof(TCMAP *) * batch);
+  origs = tcmalloc(sizeof(TCMAP *) * batch);
+  posts = tcmalloc(sizeof(int) * batch);
+  while (ok && !stop && i < tclistnum(pkeys)) {
+    keys = tclistnew2(batch);
+    caml_enter_blocking_section();
+    for (n = 0; n < batch && i < tclistnum(pkeys); i++) {
+      pkbuf = tclistval(pkeys, i, &pksiz);
+      if (!(maps[n] = tctdbget(tdb, pkbuf, pksiz))) continue;
+      origs[n] = tcmapdup(maps[n]);
+      tclistpush(keys, pkbuf, pksiz);
+      n++;
+    }
+    caml_leave_blocking_section();
+    m = 0;
+    if (n > 0) {
+      vcols = caml_alloc(n, 0);
+      for (j = 0; j < n; j++) Store_field(vcols, j, (value)maps[j]);
+      vposts = caml_callback2_exn(vfunc, (value)keys, vcols);
+      if (Is_exception_result(vposts)) {
+        vexn = Extract_exception(vposts);
+        stop = true;
+      }
+      else if (Wosize_val(vposts) != n) {
+        short_posts = true;
+        stop = true;
+      }
+      else {
+        m = n;
+        for (j = 0; j < m; j++) posts[j] = qposts_int_of_list(Field(vposts, j));
+      }
+    }
+    caml_enter_blocking_section();
+    tdb_write_begin(tdbqryw->tdbw);
+    for (j = 0; j < m && ok && !stop; j++) {
+      pkbuf = tclistval(keys, j, &pksiz);
+      if (posts[j] & (TDBQPPUT | TDBQPOUT)) {
+        /* skip a record written since it was fetched */
+        cur = tctdbget(tdb, pkbuf, pksiz);
+        if (cur && tcmap_same(origs[j], cur)) {
+          if (posts[j] & TDBQPOUT)
+            ok = tctdbout(tdb, pkbuf, pksiz) || tctdbecode(tdb) == TCENOREC;
+          else ok = tctdbput(tdb, pkbuf, pksiz, maps[j]);
+          tdb_dirty(tdbqryw->tdbw, pkbuf, pksiz);
+        }
+        if (cur) tcmapdel(cur);
+      }
+      if (posts[j] & TDBQPSTOP) stop = true;
+    }
+    tdb_write_end(tdbqryw->tdbw);
+    for (j = 0; j < n; j++) { tcmapdel(maps[j]); tcmapdel(origs[j]); }
+    tclistdel(keys);
+    caml_leave_blocking_section();
+  }
+  tclistdel(pkeys);
+  tcfree(maps);
+  tcfree(origs);
+  tcfree(posts);
+  if (vexn != Val_unit) caml_raise(vexn);
+  if (short_posts) caml_invalid_argument("TDBQRY.proc_batch: one post list per record");
+  if (!ok) tdbqry_error(tdbqryw, "proc_batch");
+  CAMLreturn (Val_unit);
+}
+
 CAMLprim
 TCLIST *otoky_tdbqry_search(value vtdbqry)
 {
@@ -2536,18 +5106,106 @@ TCLIST *otoky_tdbqry_search(value vtdbqry)
   return tclist;
 }
 
+/* search, then fetch each hit's record in the same call. with columns,
+   only those columns are copied into the returned maps; records removed
+   since the search are skipped. */
+CAMLprim
+value otoky_tdbqry_search_get(value vtdbqry, value vcolumns, value vunit)
+{
+  CAMLparam0();
+  CAMLlocal2(vcols, vres);
+  tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
+  TCLIST *pkeys, *keys, *names = NULL;
+  TCMAP **maps = NULL, *cols, *proj;
+  const char *pkbuf, *name, *val;
+  int i, j, n = 0, pksiz, nsiz, vsiz;
+  if (vcolumns != Val_int(0)) {
+    names = tclistnew();
+    for (vcolumns = Field(vcolumns, 0); vcolumns != Val_int(0); vcolumns = Field(vcolumns, 1))
+      tclistpush(names, String_val(Field(vcolumns, 0)), caml_string_length(Field(vcolumns, 0)));
+  }
+  caml_enter_blocking_section();
+  pkeys = tctdbqrysearch(tdbqryw->tdbqry);
+  if (pkeys) {
+    keys = tclistnew2(tclistnum(pkeys));
+    maps = tcmalloc(sizeof(TCMAP *) * (tclistnum(pkeys) + 1));
+    for (i = 0; i < tclistnum(pkeys); i++) {
+      pkbuf = tclistval(pkeys, i, &pksiz);
+      if (!(cols = tctdbget(tdbqryw->tdbw->tdb, pkbuf, pksiz))) continue;
+      if (names) {
+        proj = tcmapnew2(tclistnum(names) + 1);
+        for (j = 0; j < tclistnum(names); j++) {
+          name = tclistval(names, j, &nsiz);
+          if ((val = tcmapget(cols, name, nsiz, &vsiz)))
+            tcmapput(proj, name, nsiz, val, vsiz);
+        }
+        tcmapdel(cols);
+        cols = proj;
+      }
+      tclistpush(keys, pkbuf, pksiz);
+      maps[n++] = cols;
+    }
+    tclistdel(pkeys);
+  }
+  caml_leave_blocking_section();
+  if (names) tclistdel(names);
+  if (!pkeys) tdbqry_error(tdbqryw, "search_get");
+  vcols = caml_alloc(n, 0);
+  for (i = 0; i < n; i++) Store_field(vcols, i, (value)maps[i]);
+  tcfree(maps);
+  vres = caml_alloc_small(2, 0);
+  Field(vres, 0) = (value)keys;
+  Field(vres, 1) = vcols;
+  CAMLreturn (vres);
+}
+
 CAMLprim
 value otoky_tdbqry_searchout(value vtdbqry)
 {
   tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
+  TCLIST *pkeys;
+  const char *pkbuf;
+  int i, pksiz;
   bool r;
   caml_enter_blocking_section();
-  r = tctdbqrysearchout(tdbqryw->tdbqry);
+  tdb_write_begin(tdbqryw->tdbw);
+  if (!tdb_building(tdbqryw->tdbw)) r = tctdbqrysearchout(tdbqryw->tdbqry);
+  else if ((r = (pkeys = tctdbqrysearch(tdbqryw->tdbqry)) != NULL)) {
+    /* during an index build, remove one by one so the keys are logged */
+    for (i = 0; r && i < tclistnum(pkeys); i++) {
+      pkbuf = tclistval(pkeys, i, &pksiz);
+      r = tctdbout(tdbqryw->tdbw->tdb, pkbuf, pksiz) || tctdbecode(tdbqryw->tdbw->tdb) == TCENOREC;
+      tdb_dirty(tdbqryw->tdbw, pkbuf, pksiz);
+    }
+    tclistdel(pkeys);
+  }
+  tdb_write_end(tdbqryw->tdbw);
   caml_leave_blocking_section();
   if (!r) tdbqry_error(tdbqryw, "searchout");
   return Val_unit;
 }
 
+/* replace the expression of the index'th condition, so a query can be
+   built once and run with new parameters. regex and full-text
+   conditions are compiled when added, so they cannot be rebound. */
+CAMLprim
+value otoky_tdbqry_setexpr(value vtdbqry, value vindex, value vexpr)
+{
+  tdbqry_wrap *tdbqryw = tdbqry_wrap_val(vtdbqry);
+  TDBQRY *qry = tdbqryw->tdbqry;
+  TDBCOND *cond;
+  int index = Int_val(vindex);
+  /* the conditions are TC's private layout */
+  if (!tc_layout_known()) raise_error_exn(TCEMISC, "setexpr");
+  if (index < 0 || index >= qry->cnum) raise_error_exn(TCEINVALID, "setexpr");
+  cond = qry->conds + index;
+  if (cond->op == TDBQCSTRRX || cond->op >= TDBQCFTSPH) raise_error_exn(TCEINVALID, "setexpr");
+  tcfree(cond->expr);
+  cond->expr = tcmemdup(String_val(vexpr), caml_string_length(vexpr));
+  cond->esiz = caml_string_length(vexpr);
+  return Val_unit;
+}
+
 CAMLprim
 value otoky_tdbqry_setlimit(value vtdbqry, value vmax, value vskip, value vunit)
 {
@@ -2574,3 +5232,59 @@ value otoky_tdbqry_setorder(value vtdbqry, value vqord, value vname)
   tctdbqrysetorder(tdbqryw->tdbqry, String_val(vname), qord);
   return Val_unit;
 }
+
+/* Colfile */
+
+enum ckind { Ck_uint8, Ck_int32, Ck_int64, Ck_float64 };
+
+/* read one section of a columnar export straight into a Bigarray;
+   errors are raised under func, the accessor reading it */
+CAMLprim
+value otoky_colfile_read(value vpath, value vfunc, value vkind, value voff, value vlen)
+{
+  CAMLparam1(vfunc);
+  CAMLlocal1(vba);
+  static const int flags[] = { CAML_BA_UINT8, CAML_BA_INT32, CAML_BA_INT64, CAML_BA_FLOAT64 };
+  static const int sizes[] = { 1, 4, 8, 8 };
+  static const uint16_t one = 1;
+  int kind = Int_val(vkind), siz = sizes[Int_val(vkind)];
+  int fd, j, ecode = TCESUCCESS;
+  off_t off = Int64_val(voff);
+  size_t len = Int64_val(vlen), done = 0, i;
+  ssize_t n;
+  unsigned char *data, t;
+  char *path = tcstrdup(String_val(vpath)), fn_name[32];
+  vba = caml_ba_alloc_dims(flags[kind] | CAML_BA_C_LAYOUT, 1, NULL, (intnat)(len / siz));
+  data = Caml_ba_data_val(vba);
+  len = len / siz * siz;
+  caml_enter_blocking_section();
+  if ((fd = open(path, O_RDONLY)) < 0) ecode = TCEOPEN;
+  else {
+    while (done < len) {
+      if ((n = pread(fd, data + done, len - done, off + done)) <= 0) {
+        ecode = TCEREAD;
+        break;
+      }
+      done += n;
+    }
+    close(fd);
+  }
+  /* the file is little-endian */
+  if (ecode == TCESUCCESS && *(const unsigned char *)&one != 1) {
+    for (i = 0; i < len; i += siz) {
+      for (j = 0; j < siz / 2; j++) {
+        t = data[i + j];
+        data[i + j] = data[i + siz - 1 - j];
+        data[i + siz - 1 - j] = t;
+      }
+    }
+  }
+  caml_leave_blocking_section();
+  tcfree(path);
+  if (ecode != TCESUCCESS) {
+    /* out of the heap, since raising allocates */
+    snprintf(fn_name, sizeof(fn_name), "%s", String_val(vfunc));
+    raise_error_exn(ecode, fn_name);
+  }
+  CAMLreturn (vba);
+}